@@ -0,0 +1,53 @@
+#!/bin/bash
+# Sends a file through the link emulator once for every combination of the settings below, and prints a CSV line
+# for each run with the goodput and retransmit ratio from the client's -S summary.  Any setting can be overridden
+# from the environment, e.g.
+#   LOSS="0 0.02" DELAYS="0.01" CONTROLLERS="cubic bbr" ./bench.sh input.txt -n 2
+# Extra arguments after the file are passed to the client.  Run make build first
+FILE=${1:?"Usage: ./bench.sh <filename> [client options]"}
+shift
+CONTROLLERS=${CONTROLLERS:-"reno cubic bbr"}
+LOSS=${LOSS:-"0 0.01 0.05"}
+DELAYS=${DELAYS:-"0.001 0.01 0.05"}
+RATES=${RATES:-"10000 50000"}
+REORDER=${REORDER:-0}
+DUPLICATE=${DUPLICATE:-0}
+QUEUE=${QUEUE:-100}
+CAPACITY=${CAPACITY:-10}
+TIMEOUT=${TIMEOUT:-120}
+
+FILE=$(realpath "$FILE")
+set -o pipefail
+cd "$(dirname "$0")"
+echo "controller,loss_rate,prop_delay,token_rate,seconds,goodput_mbit,loss_pct,retransmit_pct,timeouts,result"
+for cc in $CONTROLLERS; do
+    for loss in $LOSS; do
+        for delay in $DELAYS; do
+            for rate in $RATES; do
+                ./link_emulator -t link -l "$loss" -p "$delay" -k "$rate" -b "$CAPACITY" -q "$QUEUE" -o "$REORDER" -u "$DUPLICATE" > /dev/null &
+                emulator=$!
+                ./server > /dev/null &
+                server=$!
+                sleep 0.2
+                summary=$(timeout "$TIMEOUT" ./client -S -c "$cc" "$@" "$FILE" | grep "^Sent ")
+                status=$?
+                # A server whose client gave up would wait for it forever
+                if [ $status -ne 0 ]; then
+                    kill $server
+                fi
+                wait $server
+                kill -INT $emulator
+                wait $emulator
+                # Sent N packets (S) in Ts: goodput GMbit/s, L% lost, R% of packets sent were retransmissions, K timeouts
+                stats=$(echo "$summary" | sed -E 's/.* in ([0-9.]+)s: goodput ([0-9.]+)Mbit\/s, ([0-9.]+)% lost, ([0-9.]+)% of .*, ([0-9]+) timeouts/\1,\2,\3,\4,\5/')
+                if [ $status -ne 0 ] || [ -z "$summary" ]; then
+                    echo "$cc,$loss,$delay,$rate,,,,,,failed"
+                elif cmp -s "$FILE" output.txt; then
+                    echo "$cc,$loss,$delay,$rate,$stats,ok"
+                else
+                    echo "$cc,$loss,$delay,$rate,$stats,corrupt"
+                fi
+            done
+        done
+    done
+done
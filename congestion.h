@@ -0,0 +1,504 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// MACROS
+#define CUBIC_C 0.4 // Both CUBIC constants follow RFC 9438
+#define CUBIC_BETA 0.7
+#define BBR_BW_ROUNDS 10 // The bottleneck bandwidth is the highest delivery rate seen over this many round trips
+#define BBR_MIN_RTT_EXPIRY 10000000 // The minimum RTT is re-probed when it hasn't been seen for this long
+#define BBR_PROBE_RTT_TIME 200000
+#define BBR_MIN_CWND 4
+#define BBR_STARTUP_GROWTH 1.25 // Startup ends once the bandwidth grows by less than this for 3 rounds in a row
+#define BBR_STARTUP_LOSS_ROUNDS 3 // Or once this many round trips in a row have had a loss
+#define BBR_GAIN_CYCLE 8
+#define BBR_HIGH_GAIN 2.885 // 2/ln(2) - enough to double the delivery rate every round trip during startup
+#define BBR_CWND_GAIN 2
+#define PACING_SS_GAIN 2 // Controllers without their own pacing rate are paced at the window over the RTT times these
+#define PACING_CA_GAIN 1.2
+
+// Everything a controller learns from one ACK
+struct cc_ack_info
+{
+    long long ack_num;
+    // Packets that reached the server since the last ACK, whether cumulatively ACKed or SACKed
+    int num_acked;
+    int in_flight;
+    // A fresh RTT sample in microseconds, or 0 if this ACK didn't produce one
+    long long rtt;
+    long long srtt;
+    // Set until everything that was in flight when the last loss was detected has been ACKed
+    int in_recovery;
+    long long now;
+};
+
+struct congestion_control;
+
+// The callbacks every congestion controller implements
+struct congestion_ops
+{
+    const char *name;
+    void (*on_send)(struct congestion_control *cc, long long seqnum, long long now);
+    void (*on_ack)(struct congestion_control *cc, const struct cc_ack_info *info);
+    void (*on_loss)(struct congestion_control *cc, long long now);
+    void (*on_timeout)(struct congestion_control *cc, long long now);
+};
+
+// State shared by every controller - each controller embeds this as its first member
+struct congestion_control
+{
+    const struct congestion_ops *ops;
+    // Both windows are in packets and may be fractional
+    double cwnd;
+    double ssthresh;
+    double max_cwnd;
+    // Packets per second the controller wants to be paced at, or 0 to pace at the window over the RTT
+    double pacing_rate;
+    // Loss recovery lasts until every packet below this sequence number has been ACKed
+    long long recovery_point;
+    long long next_seq;
+    // The state before the last timeout, put back if it turns out to be spurious
+    double undo_cwnd;
+    double undo_ssthresh;
+    long long undo_recovery_point;
+};
+
+struct reno
+{
+    struct congestion_control cc;
+    // Set while the window is inflated for fast recovery
+    int recovering;
+};
+
+struct cubic
+{
+    struct congestion_control cc;
+    double w_max;
+    // When the current congestion avoidance epoch started (0 before the first ACK of the epoch)
+    long long epoch_start;
+    // Seconds the cubic function takes to grow back to w_max
+    double k;
+    // Reno's window over the same epoch, so CUBIC is never slower than Reno
+    double w_est;
+};
+
+enum bbr_mode
+{
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT
+};
+
+struct bbr
+{
+    struct congestion_control cc;
+    enum bbr_mode mode;
+    // Bottleneck bandwidth in packets per second, and the per round samples it's the maximum of
+    double btl_bw;
+    double bw_samples[BBR_BW_ROUNDS];
+    long long min_rtt;
+    long long min_rtt_stamp;
+    // A round trip ends once the first packet sent after it started is ACKed
+    long long round_end_seq;
+    long long round_start;
+    int round_delivered;
+    long long round_count;
+    double full_bw;
+    int full_bw_count;
+    // The last round trip that had a loss, and how many before it in a row did too
+    long long loss_round;
+    int loss_rounds;
+    int cycle_index;
+    long long cycle_start;
+    long long probe_rtt_done;
+};
+
+// Function that keeps the window between one packet and the most the client can buffer
+void clamp_cwnd(struct congestion_control *cc)
+{
+    cc->cwnd = fmin(fmax(cc->cwnd, 1), cc->max_cwnd);
+}
+
+// Reno - slow start, additive increase and multiplicative decrease, with fast recovery
+void reno_on_send(struct congestion_control *cc, long long seqnum, long long now)
+{
+    (void)cc;
+    (void)seqnum;
+    (void)now;
+}
+
+void reno_on_ack(struct congestion_control *cc, const struct cc_ack_info *info)
+{
+    struct reno *reno = (struct reno *)cc;
+    if (reno->recovering)
+    {
+        // Deflating the window once the loss has been repaired
+        if (!info->in_recovery)
+        {
+            cc->cwnd = cc->ssthresh;
+            reno->recovering = 0;
+        }
+        // Every packet that leaves the network lets another one in while recovering
+        else
+        {
+            cc->cwnd += info->num_acked;
+        }
+        return;
+    }
+    // Slow start - one ACK may cover several packets, so the window grows by every packet ACKed
+    if (cc->cwnd < cc->ssthresh)
+    {
+        cc->cwnd += info->num_acked;
+    }
+    // Additive increase - one packet per window ACKed
+    else
+    {
+        cc->cwnd += info->num_acked / cc->cwnd;
+    }
+}
+
+void reno_on_loss(struct congestion_control *cc, long long now)
+{
+    struct reno *reno = (struct reno *)cc;
+    (void)now;
+    cc->ssthresh = fmax(cc->cwnd / 2, 2);
+    cc->cwnd = cc->ssthresh + 3;
+    reno->recovering = 1;
+}
+
+void reno_on_timeout(struct congestion_control *cc, long long now)
+{
+    struct reno *reno = (struct reno *)cc;
+    (void)now;
+    cc->ssthresh = fmax(cc->cwnd / 2, 2);
+    cc->cwnd = INITIAL_WINDOW;
+    reno->recovering = 0;
+}
+
+const struct congestion_ops reno_ops = {"reno", reno_on_send, reno_on_ack, reno_on_loss, reno_on_timeout};
+
+// CUBIC - after a loss the window grows back towards where the loss happened along a cubic curve of the time
+// since then, so recovery doesn't depend on the RTT the way Reno's linear growth does
+void cubic_on_send(struct congestion_control *cc, long long seqnum, long long now)
+{
+    (void)cc;
+    (void)seqnum;
+    (void)now;
+}
+
+void cubic_on_ack(struct congestion_control *cc, const struct cc_ack_info *info)
+{
+    struct cubic *cubic = (struct cubic *)cc;
+    if (cc->cwnd < cc->ssthresh)
+    {
+        cc->cwnd += info->num_acked;
+        return;
+    }
+    if (cubic->epoch_start == 0)
+    {
+        cubic->epoch_start = info->now;
+        if (cubic->w_max < cc->cwnd)
+        {
+            cubic->w_max = cc->cwnd;
+        }
+        cubic->k = cbrt((cubic->w_max - cc->cwnd) / CUBIC_C);
+        cubic->w_est = cc->cwnd;
+    }
+    double rtt = info->srtt / 1e6;
+    double t = (info->now - cubic->epoch_start) / 1e6;
+    // Aiming for where the curve will be one RTT from now
+    double target = CUBIC_C * pow(t + rtt - cubic->k, 3) + cubic->w_max;
+    cubic->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * info->num_acked / cc->cwnd;
+    if (cubic->w_est > target)
+    {
+        target = cubic->w_est;
+    }
+    if (target > cc->cwnd)
+    {
+        cc->cwnd += fmin(target - cc->cwnd, cc->cwnd / 2) * info->num_acked / cc->cwnd;
+    }
+}
+
+void cubic_on_loss(struct congestion_control *cc, long long now)
+{
+    struct cubic *cubic = (struct cubic *)cc;
+    (void)now;
+    // Fast convergence - releasing bandwidth when the window is shrinking so new flows can catch up
+    if (cc->cwnd < cubic->w_max)
+    {
+        cubic->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    }
+    else
+    {
+        cubic->w_max = cc->cwnd;
+    }
+    cc->ssthresh = fmax(cc->cwnd * CUBIC_BETA, 2);
+    cc->cwnd = cc->ssthresh;
+    cubic->epoch_start = 0;
+}
+
+void cubic_on_timeout(struct congestion_control *cc, long long now)
+{
+    struct cubic *cubic = (struct cubic *)cc;
+    (void)now;
+    cubic->w_max = cc->cwnd;
+    cc->ssthresh = fmax(cc->cwnd * CUBIC_BETA, 2);
+    cc->cwnd = INITIAL_WINDOW;
+    cubic->epoch_start = 0;
+}
+
+const struct congestion_ops cubic_ops = {"cubic", cubic_on_send, cubic_on_ack, cubic_on_loss, cubic_on_timeout};
+
+// BBR - models the path as its bottleneck bandwidth and minimum RTT and keeps about one bandwidth-delay product
+// in flight, instead of treating every loss as congestion.  The gain cycle is applied to the pacing rate
+const double bbr_gain_cycle[BBR_GAIN_CYCLE] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+// Utility function to get the estimated bandwidth-delay product in packets
+double bbr_bdp(struct bbr *bbr)
+{
+    return bbr->btl_bw * bbr->min_rtt / 1e6;
+}
+
+void bbr_on_send(struct congestion_control *cc, long long seqnum, long long now)
+{
+    struct bbr *bbr = (struct bbr *)cc;
+    if (bbr->round_start == 0)
+    {
+        bbr->round_start = now;
+        bbr->round_end_seq = seqnum + 1;
+    }
+}
+
+// Function that takes a delivery rate sample at the end of every round trip
+void bbr_update_bw(struct bbr *bbr, const struct cc_ack_info *info)
+{
+    bbr->round_delivered += info->num_acked;
+    if (bbr->round_start == 0 || info->ack_num < bbr->round_end_seq || info->now <= bbr->round_start)
+    {
+        return;
+    }
+    bbr->bw_samples[bbr->round_count % BBR_BW_ROUNDS] = bbr->round_delivered * 1e6 / (info->now - bbr->round_start);
+    bbr->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++)
+    {
+        bbr->btl_bw = fmax(bbr->btl_bw, bbr->bw_samples[i]);
+    }
+    bbr->round_count++;
+    bbr->round_start = info->now;
+    bbr->round_end_seq = bbr->cc.next_seq;
+    bbr->round_delivered = 0;
+    // Startup is over once the bandwidth stops growing
+    if (bbr->mode == BBR_STARTUP)
+    {
+        if (bbr->btl_bw >= bbr->full_bw * BBR_STARTUP_GROWTH)
+        {
+            bbr->full_bw = bbr->btl_bw;
+            bbr->full_bw_count = 0;
+        }
+        else if (++bbr->full_bw_count >= 3)
+        {
+            bbr->mode = BBR_DRAIN;
+        }
+    }
+}
+
+void bbr_on_ack(struct congestion_control *cc, const struct cc_ack_info *info)
+{
+    struct bbr *bbr = (struct bbr *)cc;
+    if (info->rtt > 0 && (bbr->min_rtt == 0 || info->rtt <= bbr->min_rtt))
+    {
+        bbr->min_rtt = info->rtt;
+        bbr->min_rtt_stamp = info->now;
+    }
+    bbr_update_bw(bbr, info);
+    // Draining the queue built up during startup, then cycling through the gains
+    if (bbr->mode == BBR_DRAIN && info->in_flight <= bbr_bdp(bbr))
+    {
+        bbr->mode = BBR_PROBE_BW;
+        bbr->cycle_index = 0;
+        bbr->cycle_start = info->now;
+    }
+    if (bbr->mode == BBR_PROBE_BW && info->now - bbr->cycle_start > bbr->min_rtt)
+    {
+        bbr->cycle_index = (bbr->cycle_index + 1) % BBR_GAIN_CYCLE;
+        bbr->cycle_start = info->now;
+    }
+    // Draining the queue every so often to see whether the minimum RTT has gone up
+    if (bbr->mode != BBR_PROBE_RTT && bbr->min_rtt_stamp > 0 && info->now - bbr->min_rtt_stamp > BBR_MIN_RTT_EXPIRY)
+    {
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->probe_rtt_done = info->now + fmax(BBR_PROBE_RTT_TIME, bbr->min_rtt);
+        bbr->min_rtt = 0;
+    }
+    if (bbr->mode == BBR_PROBE_RTT && info->now >= bbr->probe_rtt_done)
+    {
+        bbr->mode = BBR_PROBE_BW;
+        bbr->cycle_index = 0;
+        bbr->cycle_start = info->now;
+    }
+
+    // The pacing rate sets how fast we send, and the window only caps how much can be in flight
+    switch (bbr->mode)
+    {
+    case BBR_STARTUP:
+        // Until the first round trip ends there's no model to cap the window with
+        cc->cwnd = bbr->btl_bw > 0 ? fmin(cc->cwnd + info->num_acked, fmax(BBR_CWND_GAIN * bbr_bdp(bbr), BBR_MIN_CWND)) : cc->cwnd + info->num_acked;
+        cc->pacing_rate = BBR_HIGH_GAIN * bbr->btl_bw;
+        break;
+    case BBR_DRAIN:
+    case BBR_PROBE_BW:
+        // Growing back towards the model after a timeout rather than jumping straight to it
+        cc->cwnd = fmin(cc->cwnd + info->num_acked, fmax(BBR_CWND_GAIN * bbr_bdp(bbr), BBR_MIN_CWND));
+        if (bbr->mode == BBR_DRAIN)
+        {
+            cc->pacing_rate = bbr->btl_bw / BBR_HIGH_GAIN;
+        }
+        else
+        {
+            cc->pacing_rate = bbr_gain_cycle[bbr->cycle_index] * bbr->btl_bw;
+        }
+        break;
+    case BBR_PROBE_RTT:
+        cc->cwnd = BBR_MIN_CWND;
+        cc->pacing_rate = bbr->btl_bw;
+        break;
+    }
+}
+
+void bbr_on_loss(struct congestion_control *cc, long long now)
+{
+    // The model already says how much the path can carry, so a single loss doesn't change the window.  But losses
+    // round after round during startup mean the pipe is full even if the bandwidth still seems to be growing - the
+    // queue is overflowing faster than the delivery rate can show it
+    struct bbr *bbr = (struct bbr *)cc;
+    (void)now;
+    if (bbr->mode != BBR_STARTUP || (bbr->loss_rounds > 0 && bbr->loss_round == bbr->round_count))
+    {
+        return;
+    }
+    bbr->loss_rounds = bbr->loss_rounds > 0 && bbr->loss_round == bbr->round_count - 1 ? bbr->loss_rounds + 1 : 1;
+    bbr->loss_round = bbr->round_count;
+    if (bbr->loss_rounds >= BBR_STARTUP_LOSS_ROUNDS)
+    {
+        bbr->full_bw = bbr->btl_bw;
+        bbr->mode = BBR_DRAIN;
+    }
+}
+
+void bbr_on_timeout(struct congestion_control *cc, long long now)
+{
+    (void)now;
+    cc->cwnd = INITIAL_WINDOW;
+}
+
+const struct congestion_ops bbr_ops = {"bbr", bbr_on_send, bbr_on_ack, bbr_on_loss, bbr_on_timeout};
+
+// Function that creates the congestion controller with the given name - returns NULL if there's no such controller,
+// or if it can't be allocated
+struct congestion_control *create_congestion_control(const char *name, int max_cwnd)
+{
+    struct congestion_control *cc;
+    const struct congestion_ops *ops;
+    size_t size;
+    if (strcmp(name, reno_ops.name) == 0)
+    {
+        ops = &reno_ops;
+        size = sizeof(struct reno);
+    }
+    else if (strcmp(name, cubic_ops.name) == 0)
+    {
+        ops = &cubic_ops;
+        size = sizeof(struct cubic);
+    }
+    else if (strcmp(name, bbr_ops.name) == 0)
+    {
+        ops = &bbr_ops;
+        size = sizeof(struct bbr);
+    }
+    else
+    {
+        return NULL;
+    }
+    cc = calloc(1, size);
+    if (cc == NULL)
+    {
+        perror("Could not allocate congestion controller");
+        return NULL;
+    }
+    cc->ops = ops;
+    cc->cwnd = INITIAL_WINDOW;
+    cc->ssthresh = SSTHRESH;
+    cc->max_cwnd = max_cwnd;
+    return cc;
+}
+
+// The client calls the controller through these, which keep track of the state shared by every controller
+void cc_on_send(struct congestion_control *cc, long long seqnum, long long now)
+{
+    if (seqnum >= cc->next_seq)
+    {
+        cc->next_seq = seqnum + 1;
+    }
+    cc->ops->on_send(cc, seqnum, now);
+}
+
+void cc_on_ack(struct congestion_control *cc, struct cc_ack_info *info)
+{
+    info->in_recovery = info->ack_num < cc->recovery_point;
+    cc->ops->on_ack(cc, info);
+    clamp_cwnd(cc);
+}
+
+// Function that reacts to a loss found by duplicate ACKs - the window is only cut once per window of data
+void cc_on_loss(struct congestion_control *cc, long long ack_num, long long now)
+{
+    if (ack_num < cc->recovery_point)
+    {
+        return;
+    }
+    cc->recovery_point = cc->next_seq;
+    cc->ops->on_loss(cc, now);
+    clamp_cwnd(cc);
+}
+
+// Function that returns how many packets per second to send - 0 if there's no RTT to pace by yet
+double cc_pacing_rate(struct congestion_control *cc, long long srtt)
+{
+    if (cc->pacing_rate > 0)
+    {
+        return cc->pacing_rate;
+    }
+    if (srtt <= 0)
+    {
+        return 0;
+    }
+    // Leaving room for the window to grow within the RTT
+    return (cc->cwnd < cc->ssthresh ? PACING_SS_GAIN : PACING_CA_GAIN) * cc->cwnd * 1e6 / srtt;
+}
+
+void cc_on_timeout(struct congestion_control *cc, long long now)
+{
+    cc->undo_cwnd = cc->cwnd;
+    cc->undo_ssthresh = cc->ssthresh;
+    cc->undo_recovery_point = cc->recovery_point;
+    cc->recovery_point = cc->next_seq;
+    cc->ops->on_timeout(cc, now);
+    clamp_cwnd(cc);
+}
+
+// Function that puts the window back as it was before the last timeout, once the packets it gave up on turn out to
+// have been delivered after all.  Anything the window has grown by since is kept
+void cc_undo_timeout(struct congestion_control *cc)
+{
+    cc->cwnd = fmax(cc->cwnd, cc->undo_cwnd);
+    cc->ssthresh = fmax(cc->ssthresh, cc->undo_ssthresh);
+    cc->recovery_point = cc->undo_recovery_point;
+    clamp_cwnd(cc);
+}
+
+#endif
@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "utils.h"
+
+// A native replacement for rdcc_proxy.py, with the same options and the same two modes: rd drops packets at random
+// and forwards the rest straight away, and cc puts them through a token bucket with a bounded queue and then delays
+// them by the propagation delay.  link does both at once.  Any mode can also reorder and duplicate packets.
+// Everything runs on one thread in one epoll loop - delayed packets wait in a timer wheel, and the token bucket is
+// refilled from the clock rather than by a thread, so nothing is ever polled or slept on
+
+// MACROS
+#define EMU_MAX_DATAGRAM 65536
+#define EMU_BATCH 64 // Datagrams received or sent per recvmmsg/sendmmsg call
+#define EMU_RECV_BATCHES 16 // recvmmsg calls per socket before going round the loop, so the wheel keeps up under load
+#define WHEEL_TICK 10 // Microseconds per timer wheel slot
+#define WHEEL_SLOTS 65536 // A power of two - delays longer than the wheel's span go round more than once
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+#define MODE_RD 1 // Which parts of the link are emulated
+#define MODE_CC 2
+
+// A datagram on its way through the emulator
+struct emu_packet
+{
+    struct emu_packet *next;
+    long long due;
+    int len;
+    int dir;
+    char data[EMU_MAX_DATAGRAM];
+};
+
+// One direction of the link - client to server, or server to client
+struct direction
+{
+    int in_fd;
+    struct sockaddr_in to;
+    // Token bucket, in fractional tokens
+    double tokens;
+    long long last_refill;
+    // Packets waiting for a token, oldest first
+    struct emu_packet **queue;
+    int queue_head;
+    int queue_len;
+    // Packets due to go out at the end of this round
+    struct mmsghdr msgs[EMU_BATCH];
+    struct iovec iovs[EMU_BATCH];
+    struct emu_packet *batch[EMU_BATCH];
+    int batch_len;
+    long long received;
+    long long forwarded;
+    long long lost;
+    long long overflowed;
+    long long oversized;
+    long long reordered;
+    long long duplicated;
+};
+
+// Every packet in flight sits in the slot of the tick it's due in.  Slots are FIFO, so packets given the same
+// delay come out in the order they went in, and a bitmap of the occupied slots finds the next one quickly
+struct timer_wheel
+{
+    struct emu_packet *heads[WHEEL_SLOTS];
+    struct emu_packet *tails[WHEEL_SLOTS];
+    unsigned long long occupied[WHEEL_WORDS];
+    long long cursor;
+    long long count;
+};
+
+struct emulator
+{
+    int mode;
+    double loss_rate;
+    double token_rate;
+    double token_capacity;
+    int queue_size;
+    long long prop_delay;
+    double reorder_rate;
+    long long reorder_delay;
+    double duplicate_rate;
+    int max_size;
+    unsigned short rand_state[3];
+    int send_fd;
+    struct direction dirs[2];
+    struct timer_wheel wheel;
+    struct emu_packet *free_list;
+};
+
+volatile sig_atomic_t stopping = 0;
+
+void stop_emulator(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+// Function that hands out a packet buffer, reusing freed ones
+struct emu_packet *alloc_packet(struct emulator *emu)
+{
+    struct emu_packet *pkt = emu->free_list;
+    if (pkt != NULL)
+    {
+        emu->free_list = pkt->next;
+        return pkt;
+    }
+    pkt = malloc(sizeof(struct emu_packet));
+    if (pkt == NULL)
+    {
+        perror("Could not allocate packet");
+        exit(1);
+    }
+    return pkt;
+}
+
+void free_packet(struct emulator *emu, struct emu_packet *pkt)
+{
+    pkt->next = emu->free_list;
+    emu->free_list = pkt;
+}
+
+// Function that puts a packet in the slot of the tick it's due in
+void wheel_insert(struct timer_wheel *wheel, struct emu_packet *pkt)
+{
+    long long tick = pkt->due / WHEEL_TICK;
+    // A packet due before the cursor goes in the cursor's slot, which is the next to be emptied
+    if (tick < wheel->cursor)
+    {
+        tick = wheel->cursor;
+    }
+    int slot = tick & (WHEEL_SLOTS - 1);
+    pkt->next = NULL;
+    if (wheel->heads[slot] == NULL)
+    {
+        wheel->heads[slot] = pkt;
+        wheel->occupied[slot / 64] |= 1ULL << (slot % 64);
+    }
+    else
+    {
+        wheel->tails[slot]->next = pkt;
+    }
+    wheel->tails[slot] = pkt;
+    wheel->count++;
+}
+
+// Function that returns the first tick at or after the cursor with anything in its slot, or -1 if the wheel is empty
+long long wheel_next_tick(struct timer_wheel *wheel)
+{
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+    int start = wheel->cursor & (WHEEL_SLOTS - 1);
+    for (int i = 0; i <= WHEEL_WORDS; i++)
+    {
+        int word = (start / 64 + i) % WHEEL_WORDS;
+        unsigned long long bits = wheel->occupied[word];
+        // Only the slots from the cursor on count in the cursor's own word the first time round
+        if (i == 0)
+        {
+            bits &= ~0ULL << (start % 64);
+        }
+        if (bits != 0)
+        {
+            int slot = word * 64 + __builtin_ctzll(bits);
+            return wheel->cursor + ((slot - start) & (WHEEL_SLOTS - 1));
+        }
+    }
+    return wheel->cursor;
+}
+
+// Function that queues a packet to be sent at the end of this round, flushing the batch if it's full
+void flush_direction(struct emulator *emu, struct direction *dir);
+
+void batch_packet(struct emulator *emu, struct emu_packet *pkt)
+{
+    struct direction *dir = &emu->dirs[pkt->dir];
+    if (dir->batch_len == EMU_BATCH)
+    {
+        flush_direction(emu, dir);
+    }
+    int i = dir->batch_len++;
+    dir->batch[i] = pkt;
+    dir->iovs[i].iov_base = pkt->data;
+    dir->iovs[i].iov_len = pkt->len;
+    memset(&dir->msgs[i], 0, sizeof(dir->msgs[i]));
+    dir->msgs[i].msg_hdr.msg_name = &dir->to;
+    dir->msgs[i].msg_hdr.msg_namelen = sizeof(dir->to);
+    dir->msgs[i].msg_hdr.msg_iov = &dir->iovs[i];
+    dir->msgs[i].msg_hdr.msg_iovlen = 1;
+    dir->forwarded++;
+}
+
+void flush_direction(struct emulator *emu, struct direction *dir)
+{
+    int sent = 0;
+    while (sent < dir->batch_len)
+    {
+        int n = sendmmsg(emu->send_fd, dir->msgs + sent, dir->batch_len - sent, 0);
+        // A full socket buffer on the far side is just more loss, as far as the link is concerned
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+    for (int i = 0; i < dir->batch_len; i++)
+    {
+        free_packet(emu, dir->batch[i]);
+    }
+    dir->batch_len = 0;
+}
+
+// Function that sends a packet once it's made it across the link, maybe held back so later packets overtake it,
+// and maybe twice
+void deliver(struct emulator *emu, struct emu_packet *pkt, long long now, long long delay)
+{
+    struct direction *dir = &emu->dirs[pkt->dir];
+    if (emu->duplicate_rate > 0 && erand48(emu->rand_state) < emu->duplicate_rate)
+    {
+        struct emu_packet *copy = alloc_packet(emu);
+        copy->len = pkt->len;
+        copy->dir = pkt->dir;
+        memcpy(copy->data, pkt->data, pkt->len);
+        dir->duplicated++;
+        deliver(emu, copy, now, delay);
+    }
+    if (emu->reorder_rate > 0 && erand48(emu->rand_state) < emu->reorder_rate)
+    {
+        delay += emu->reorder_delay;
+        dir->reordered++;
+    }
+    if (delay <= 0)
+    {
+        batch_packet(emu, pkt);
+        return;
+    }
+    pkt->due = now + delay;
+    wheel_insert(&emu->wheel, pkt);
+}
+
+// Function that moves as many queued packets onto the link as the token bucket allows - returns when the next
+// token arrives if packets are still waiting for one, or -1
+long long drain_queue(struct emulator *emu, struct direction *dir, long long now)
+{
+    dir->tokens += (now - dir->last_refill) * emu->token_rate / 1e6;
+    if (dir->tokens > emu->token_capacity)
+    {
+        dir->tokens = emu->token_capacity;
+    }
+    dir->last_refill = now;
+    while (dir->queue_len > 0 && dir->tokens >= 1)
+    {
+        struct emu_packet *pkt = dir->queue[dir->queue_head];
+        dir->queue_head = (dir->queue_head + 1) % emu->queue_size;
+        dir->queue_len--;
+        dir->tokens -= 1;
+        deliver(emu, pkt, now, emu->prop_delay);
+    }
+    if (dir->queue_len == 0)
+    {
+        return -1;
+    }
+    return now + (long long)((1 - dir->tokens) * 1e6 / emu->token_rate) + 1;
+}
+
+// Function that handles a packet as it arrives at the emulator
+void admit(struct emulator *emu, struct emu_packet *pkt, long long now)
+{
+    struct direction *dir = &emu->dirs[pkt->dir];
+    dir->received++;
+    if (pkt->len > emu->max_size)
+    {
+        dir->oversized++;
+        free_packet(emu, pkt);
+        return;
+    }
+    if ((emu->mode & MODE_RD) && erand48(emu->rand_state) < emu->loss_rate)
+    {
+        dir->lost++;
+        free_packet(emu, pkt);
+        return;
+    }
+    if (!(emu->mode & MODE_CC))
+    {
+        deliver(emu, pkt, now, 0);
+        return;
+    }
+    if (dir->queue_len == emu->queue_size)
+    {
+        dir->overflowed++;
+        free_packet(emu, pkt);
+        return;
+    }
+    dir->queue[(dir->queue_head + dir->queue_len) % emu->queue_size] = pkt;
+    dir->queue_len++;
+}
+
+// Function that reads every datagram waiting on one direction's socket, letting queued packets out between batches
+// so a long burst doesn't overflow a queue the tokens could have been emptying
+void receive_direction(struct emulator *emu, int d, long long now)
+{
+    struct direction *dir = &emu->dirs[d];
+    struct mmsghdr msgs[EMU_BATCH];
+    struct iovec iovs[EMU_BATCH];
+    struct emu_packet *pkts[EMU_BATCH];
+    for (int i = 0; i < EMU_BATCH; i++)
+    {
+        pkts[i] = alloc_packet(emu);
+        iovs[i].iov_base = pkts[i]->data;
+        iovs[i].iov_len = EMU_MAX_DATAGRAM;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n;
+    for (int batches = 0; batches < EMU_RECV_BATCHES && (n = recvmmsg(dir->in_fd, msgs, EMU_BATCH, MSG_DONTWAIT, NULL)) > 0; batches++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            pkts[i]->len = msgs[i].msg_len;
+            pkts[i]->dir = d;
+            admit(emu, pkts[i], now);
+            pkts[i] = alloc_packet(emu);
+            iovs[i].iov_base = pkts[i]->data;
+        }
+        if (emu->mode & MODE_CC)
+        {
+            now = get_time_us();
+            drain_queue(emu, dir, now);
+        }
+        if (n < EMU_BATCH)
+        {
+            break;
+        }
+    }
+    for (int i = 0; i < EMU_BATCH; i++)
+    {
+        free_packet(emu, pkts[i]);
+    }
+}
+
+// Function that sends every packet whose delay is up
+void expire_wheel(struct emulator *emu, long long now)
+{
+    struct timer_wheel *wheel = &emu->wheel;
+    long long now_tick = now / WHEEL_TICK;
+    while (wheel->count > 0 && wheel->cursor <= now_tick)
+    {
+        long long tick = wheel_next_tick(wheel);
+        if (tick > now_tick)
+        {
+            wheel->cursor = now_tick + 1;
+            break;
+        }
+        int slot = tick & (WHEEL_SLOTS - 1);
+        struct emu_packet *pkt = wheel->heads[slot];
+        wheel->heads[slot] = NULL;
+        wheel->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+        // Packets a whole revolution or more away stay where they are
+        while (pkt != NULL)
+        {
+            struct emu_packet *next = pkt->next;
+            wheel->count--;
+            if (pkt->due / WHEEL_TICK > tick)
+            {
+                wheel_insert(wheel, pkt);
+            }
+            else
+            {
+                batch_packet(emu, pkt);
+            }
+            pkt = next;
+        }
+        wheel->cursor = tick + 1;
+    }
+    if (wheel->count == 0 && wheel->cursor <= now_tick)
+    {
+        wheel->cursor = now_tick + 1;
+    }
+}
+
+int open_port(int port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        perror("Could not create socket");
+        exit(1);
+    }
+    // Deep socket buffers, so bursts at high rates aren't lost before the emulator gets to them
+    int size = 1 << 24;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(LOCAL_HOST);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("Bind failed");
+        exit(1);
+    }
+    printf("Listening on port %d...\n", port);
+    return fd;
+}
+
+void print_direction(const char *name, struct direction *dir)
+{
+    printf("%s: %lld received, %lld forwarded, %lld lost, %lld overflowed, %lld oversized, %lld reordered, %lld duplicated\n", name,
+           dir->received, dir->forwarded, dir->lost, dir->overflowed, dir->oversized, dir->reordered, dir->duplicated);
+}
+
+int main(int argc, char *argv[])
+{
+    struct emulator *emu = calloc(1, sizeof(struct emulator));
+    int in_port_from_client = 5002, in_port_from_server = 5001, client_port = 6001, server_port = 6002;
+    int seed = 0;
+    int opt;
+    const char *test_type = "rd";
+    if (emu == NULL)
+    {
+        perror("Could not allocate emulator");
+        return 1;
+    }
+    // The same defaults as rdcc_proxy.py
+    emu->loss_rate = 0.1;
+    emu->token_rate = 100;
+    emu->token_capacity = 1;
+    emu->queue_size = 30;
+    emu->prop_delay = 100000;
+    emu->reorder_delay = 1000;
+    emu->max_size = PACKET_SIZE;
+    struct option long_options[] = {
+        {"in_port_from_client", required_argument, NULL, 'd'},
+        {"in_port_from_server", required_argument, NULL, 'a'},
+        {"client_port", required_argument, NULL, 'c'},
+        {"server_port", required_argument, NULL, 's'},
+        {"test_type", required_argument, NULL, 't'},
+        {"loss_rate", required_argument, NULL, 'l'},
+        {"token_rate", required_argument, NULL, 'k'},
+        {"token_capacity", required_argument, NULL, 'b'},
+        {"queue_size", required_argument, NULL, 'q'},
+        {"random_seed", required_argument, NULL, 'r'},
+        {"prop_delay", required_argument, NULL, 'p'},
+        {"reorder_rate", required_argument, NULL, 'o'},
+        {"reorder_delay", required_argument, NULL, 'e'},
+        {"duplicate_rate", required_argument, NULL, 'u'},
+        {"max_size", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "d:a:c:s:t:l:k:b:q:r:p:o:e:u:m:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            in_port_from_client = atoi(optarg);
+            break;
+        case 'a':
+            in_port_from_server = atoi(optarg);
+            break;
+        case 'c':
+            client_port = atoi(optarg);
+            break;
+        case 's':
+            server_port = atoi(optarg);
+            break;
+        case 't':
+            test_type = optarg;
+            break;
+        case 'l':
+            emu->loss_rate = atof(optarg);
+            break;
+        case 'k':
+            emu->token_rate = atof(optarg);
+            break;
+        case 'b':
+            emu->token_capacity = atof(optarg);
+            break;
+        case 'q':
+            emu->queue_size = atoi(optarg);
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        case 'p':
+            emu->prop_delay = atof(optarg) * 1e6;
+            break;
+        case 'o':
+            emu->reorder_rate = atof(optarg);
+            break;
+        case 'e':
+            emu->reorder_delay = atof(optarg) * 1e6;
+            break;
+        case 'u':
+            emu->duplicate_rate = atof(optarg);
+            break;
+        case 'm':
+            emu->max_size = atoi(optarg);
+            break;
+        default:
+            emu->queue_size = 0;
+        }
+    }
+    emu->mode = strcmp(test_type, "rd") == 0 ? MODE_RD : strcmp(test_type, "cc") == 0 ? MODE_CC : strcmp(test_type, "link") == 0 ? MODE_RD | MODE_CC : 0;
+    if (optind != argc || emu->mode == 0 || emu->queue_size <= 0 || emu->token_rate <= 0 || emu->token_capacity < 1 || emu->prop_delay < 0 ||
+        emu->reorder_delay < 0 || emu->max_size <= 0 || emu->max_size > EMU_MAX_DATAGRAM)
+    {
+        printf("Usage: ./link_emulator [-t rd|cc|link] [-l loss_rate] [-k token_rate] [-b token_capacity] [-q queue_size] [-r random_seed] [-p prop_delay_s] "
+               "[-o reorder_rate] [-e reorder_delay_s] [-u duplicate_rate] [-m max_size] [-d in_port_from_client] [-a in_port_from_server] "
+               "[-c client_port] [-s server_port]\n");
+        return 1;
+    }
+    emu->rand_state[0] = 0x330E;
+    emu->rand_state[1] = seed & 0xFFFF;
+    emu->rand_state[2] = (seed >> 16) & 0xFFFF;
+
+    // Packets from the client go on to the server, and ACKs from the server go on to the client
+    int ports[2][2] = {{in_port_from_client, server_port}, {in_port_from_server, client_port}};
+    long long now = get_time_us();
+    for (int d = 0; d < 2; d++)
+    {
+        struct direction *dir = &emu->dirs[d];
+        dir->in_fd = open_port(ports[d][0]);
+        dir->to.sin_family = AF_INET;
+        dir->to.sin_port = htons(ports[d][1]);
+        dir->to.sin_addr.s_addr = inet_addr(LOCAL_HOST);
+        dir->tokens = emu->token_capacity;
+        dir->last_refill = now;
+        dir->queue = calloc(emu->queue_size, sizeof(struct emu_packet *));
+        if (dir->queue == NULL)
+        {
+            perror("Could not allocate queue");
+            return 1;
+        }
+    }
+    fflush(stdout);
+    emu->send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    int epoll_fd = epoll_create1(0);
+    if (emu->send_fd < 0 || timer_fd < 0 || epoll_fd < 0)
+    {
+        perror("Could not set up the event loop");
+        return 1;
+    }
+    int fds[3] = {emu->dirs[0].in_fd, emu->dirs[1].in_fd, timer_fd};
+    for (int i = 0; i < 3; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+    emu->wheel.cursor = now / WHEEL_TICK;
+    // Stopping prints what happened to every packet, like the proxy's per-packet messages but without the cost
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_emulator;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stopping)
+    {
+        struct epoll_event events[3];
+        int n = epoll_wait(epoll_fd, events, 3, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait failed");
+            return 1;
+        }
+        now = get_time_us();
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 < 2)
+            {
+                receive_direction(emu, events[i].data.u32, now);
+            }
+            else
+            {
+                unsigned long long expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                {
+                    perror("Error reading timer");
+                }
+            }
+        }
+        // Sending whatever is due, then sleeping until the next packet's delay is up or its token arrives
+        long long wake = -1;
+        for (int d = 0; d < 2; d++)
+        {
+            long long token_due = (emu->mode & MODE_CC) ? drain_queue(emu, &emu->dirs[d], now) : -1;
+            if (token_due >= 0 && (wake < 0 || token_due < wake))
+            {
+                wake = token_due;
+            }
+        }
+        expire_wheel(emu, now);
+        flush_direction(emu, &emu->dirs[0]);
+        flush_direction(emu, &emu->dirs[1]);
+        long long tick = wheel_next_tick(&emu->wheel);
+        if (tick >= 0 && (wake < 0 || tick * WHEEL_TICK < wake))
+        {
+            wake = tick * WHEEL_TICK;
+        }
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (wake >= 0)
+        {
+            // Zero would disarm the timer, so anything already due fires as soon as possible instead
+            long long delay = wake > now ? wake - now : 1;
+            spec.it_value.tv_sec = delay / 1000000;
+            spec.it_value.tv_nsec = (delay % 1000000) * 1000;
+        }
+        timerfd_settime(timer_fd, 0, &spec, NULL);
+    }
+    print_direction("Client to server", &emu->dirs[0]);
+    print_direction("Server to client", &emu->dirs[1]);
+    return 0;
+}
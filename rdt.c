@@ -0,0 +1,700 @@
+#define _GNU_SOURCE
+#include <sys/random.h>
+
+#include "sender.h"
+#include "receiver.h"
+#include "uring.h"
+#include "rdt.h"
+
+// An upload the program writes into - the write end of a socket pair, with the upload reading the other end on its
+// own thread as if it were stdin
+struct rdt_sender
+{
+    struct rdt_sender_options options;
+    int write_fd;
+    int read_fd;
+    // What the upload returned, and errno if it failed - the upload runs on a thread of its own, with its own errno
+    int result;
+    int error;
+    pthread_t thread;
+};
+
+void rdt_sender_defaults(struct rdt_sender_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->server_ip = SERVER_IP;
+    options->server_port = SERVER_PORT_TO;
+    options->local_port = CLIENT_PORT;
+    options->cc_name = reno_ops.name;
+    options->num_streams = 1;
+    options->window_size = DEFAULT_BUFFER;
+    options->packet_size = PACKET_SIZE;
+}
+
+void rdt_receiver_defaults(struct rdt_receiver_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->port = SERVER_PORT;
+    options->client_ip = LOCAL_HOST;
+    options->client_port = CLIENT_PORT_TO;
+    options->num_workers = 1;
+    options->window_size = DEFAULT_BUFFER;
+    options->max_packet_size = PACKET_SIZE;
+    options->ack_every = ACK_EVERY;
+    options->ack_delay = ACK_DELAY;
+}
+
+// Utility function to fill in an IPv4 address - returns -1 if ip isn't one
+int set_address(struct sockaddr_in *addr, const char *ip, int port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+// Utility function for options that can't be used, once what's wrong has been printed - returns -1 with errno set
+int invalid_options(void)
+{
+    errno = EINVAL;
+    return -1;
+}
+
+int rdt_check_sender_options(const struct rdt_sender_options *options)
+{
+    struct sockaddr_in addr;
+    if (options->server_ip == NULL || set_address(&addr, options->server_ip, options->server_port) < 0)
+    {
+        printf("The server address has to be an IPv4 address\n");
+        return invalid_options();
+    }
+    if (options->server_port <= 0 || options->server_port > 65535 || options->local_port < 0 || options->local_port > 65535)
+    {
+        printf("Ports have to be between 1 and 65535\n");
+        return invalid_options();
+    }
+    if (options->window_size <= 0 || options->num_streams <= 0 || options->num_streams > MAX_STREAMS)
+    {
+        printf("The window has to be at least a packet, with 1 to %d streams\n", MAX_STREAMS);
+        return invalid_options();
+    }
+    if (options->packet_size <= HANDSHAKE_HEADER_SIZE || options->packet_size > MAX_PACKET_SIZE)
+    {
+        printf("Packets have to be more than %d and at most %d bytes\n", HANDSHAKE_HEADER_SIZE, MAX_PACKET_SIZE);
+        return invalid_options();
+    }
+    if (options->fec_block != 0 && (options->fec_block < FEC_MIN_BLOCK || options->fec_block > FEC_MAX_BLOCK))
+    {
+        printf("FEC blocks have to be %d to %d packets\n", FEC_MIN_BLOCK, FEC_MAX_BLOCK);
+        return invalid_options();
+    }
+    if (options->compress_level < 0 || options->compress_level > Z_BEST_COMPRESSION)
+    {
+        printf("The compression level has to be 0 to %d\n", Z_BEST_COMPRESSION);
+        return invalid_options();
+    }
+    if (options->resume && options->compress_level > 0)
+    {
+        printf("A compressed upload can't be resumed\n");
+        return invalid_options();
+    }
+    // A resume handshake carries the key in place of the first packet
+    if (options->resume && options->packet_size - HANDSHAKE_HEADER_SIZE < RESUME_KEY_SIZE)
+    {
+        printf("Resuming needs packets of at least %d bytes\n", HANDSHAKE_HEADER_SIZE + RESUME_KEY_SIZE);
+        return invalid_options();
+    }
+    // Checking the controller name once up front - every stream creates its own
+    struct congestion_control *cc = options->cc_name == NULL ? NULL : create_congestion_control(options->cc_name, options->window_size);
+    if (cc == NULL)
+    {
+        printf("Unknown congestion controller %s\n", options->cc_name != NULL ? options->cc_name : "(none)");
+        return invalid_options();
+    }
+    free(cc);
+    return 0;
+}
+
+int rdt_check_receiver_options(const struct rdt_receiver_options *options)
+{
+    struct sockaddr_in addr;
+    if (!options->reply_to_sender && (options->client_ip == NULL || set_address(&addr, options->client_ip, options->client_port) < 0))
+    {
+        printf("The client address has to be an IPv4 address\n");
+        return invalid_options();
+    }
+    if (options->port <= 0 || options->port > 65535 || (!options->reply_to_sender && (options->client_port <= 0 || options->client_port > 65535)))
+    {
+        printf("Ports have to be between 1 and 65535\n");
+        return invalid_options();
+    }
+    if (options->window_size <= 0 || options->ack_every <= 0 || options->ack_delay < 0 || options->num_workers <= 0)
+    {
+        printf("The window, ACK policy and worker count have to be positive\n");
+        return invalid_options();
+    }
+    if (options->max_packet_size <= HANDSHAKE_HEADER_SIZE || options->max_packet_size > MAX_PACKET_SIZE)
+    {
+        printf("Packets have to be more than %d and at most %d bytes\n", HANDSHAKE_HEADER_SIZE, MAX_PACKET_SIZE);
+        return invalid_options();
+    }
+    if (options->on_data != NULL && options->direct)
+    {
+        printf("Direct mode writes out of order, so it needs an output file rather than a callback\n");
+        return invalid_options();
+    }
+    if (options->writer_thread && (options->direct || options->on_data != NULL))
+    {
+        printf("The writer thread only writes buffered packets to output files, so not with direct mode or a callback\n");
+        return invalid_options();
+    }
+    return 0;
+}
+
+int rdt_use_io_uring(void)
+{
+    return use_uring_transport();
+}
+
+// Function that creates the socket an upload is sent from, bound so the ACKs come back to it, and checks the kernel
+// can do GSO if it's asked for - returns the socket, or -1
+int open_sender_socket(const struct rdt_sender_options *options, int *max_segments)
+{
+    struct sockaddr_in client_addr;
+    int packet_size = options->packet_size;
+    *max_segments = 1;
+    // Create a UDP socket for sending packets and receiving ACKs
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("Could not create socket");
+        return -1;
+    }
+
+    // Configure the client address structure
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sin_family = AF_INET;
+    client_addr.sin_port = htons(options->local_port);
+    client_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // Bind the socket to the client address so the ACKs come back to it
+    if (bind(sockfd, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
+    {
+        perror("Bind failed");
+        close(sockfd);
+        return -1;
+    }
+
+    // Checking the kernel supports GSO by turning it on for the socket - it's then turned back off, since only
+    // the sends that ask for it should be split
+    if (options->use_gso)
+    {
+        if (setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &packet_size, sizeof(packet_size)) < 0)
+        {
+            perror("GSO isn't available, sending packets one at a time");
+        }
+        else
+        {
+            int off = 0;
+            setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+            *max_segments = fmin(MAX_GSO_SEGMENTS, MAX_PACKET_SIZE / packet_size);
+        }
+    }
+    return sockfd;
+}
+
+// Function that sends everything src has, which it closes once it's done - returns 0 once the server has it all,
+// or -1 with errno set.  A resumed upload is known to the server by resume_key
+int send_source(const struct rdt_sender_options *options, struct file_source *src, unsigned long long resume_key)
+{
+    struct sockaddr_in server_addr_to;
+    struct tracer tracer;
+    unsigned int conn_id;
+    int max_segments;
+    int num_streams = options->num_streams;
+    int tracing = options->trace_name != NULL || options->live_stats;
+    int num_started = 0;
+    int error = 0;
+
+    // A random connection ID, so the server can tell this upload apart from any others it's receiving
+    if (getrandom(&conn_id, sizeof(conn_id), 0) != sizeof(conn_id))
+    {
+        perror("Could not pick a connection ID");
+        close_file_source(src);
+        return -1;
+    }
+    // Configure the server address structure to which we will send data
+    set_address(&server_addr_to, options->server_ip, options->server_port);
+    int sockfd = open_sender_socket(options, &max_segments);
+    if (sockfd < 0)
+    {
+        close_file_source(src);
+        return -1;
+    }
+    // The handshake has the longest header, and it carries a full payload too
+    src->payload_size = options->packet_size - HANDSHAKE_HEADER_SIZE;
+
+    // Get file size - a streamed input's size isn't known until it ends
+    long long num_packets = (src->size + src->payload_size - 1) / src->payload_size;
+    if (src->streaming)
+    {
+        num_packets = UNKNOWN_LENGTH;
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("Starting to send file: %s, which has size %lld (%lld packets)\n", filename, (long long)src->size, num_packets);
+    }
+    */
+    // Small files may not have enough packets to go around, and a streamed input can't be split up front
+    num_streams = src->streaming ? 1 : split_streams(num_packets, num_streams);
+    struct flow *flows = calloc(num_streams, sizeof(struct flow));
+    if (flows == NULL)
+    {
+        perror("Could not allocate streams");
+        close_file_source(src);
+        close(sockfd);
+        return -1;
+    }
+    for (int i = 0; i < num_streams; i++)
+    {
+        struct flow *flow = &flows[i];
+        flow->conn_id = conn_id;
+        flow->stream = i;
+        flow->num_streams = num_streams;
+        flow->total_packets = src->streaming ? 0 : num_packets;
+        stream_range(num_packets, num_streams, i, &flow->first_packet, &flow->num_packets);
+        // Every stream ends with the packet carrying its digest - even an empty file has an (empty) first packet
+        if (!src->streaming)
+        {
+            flow->num_packets = (flow->num_packets > 0 ? flow->num_packets : 1) + 1;
+        }
+
+        flow->src = src;
+        flow->cc_name = options->cc_name;
+        flow->window_size = options->window_size;
+        flow->max_segments = max_segments;
+        flow->fec_block = options->fec_block;
+        flow->resume = options->resume;
+        flow->resume_key = resume_key;
+
+        flow->server_addr = &server_addr_to;
+        flow->data_fd = sockfd;
+    }
+    // Every stream traces to its own ring, so tracing never makes the streams wait for each other
+    if (tracing)
+    {
+        if (start_tracer(&tracer, options->trace_name, num_streams, options->live_stats, print_client_stats) < 0)
+        {
+            perror("Could not start tracing");
+            free(flows);
+            close_file_source(src);
+            close(sockfd);
+            return -1;
+        }
+        for (int i = 0; i < num_streams; i++)
+        {
+            flows[i].trace = &tracer.rings[i];
+        }
+    }
+
+    if (num_streams == 1)
+    {
+        // A single stream reads its ACKs straight off the socket
+        flows[0].ack_fd = sockfd;
+        run_flow(&flows[0]);
+    }
+    else
+    {
+        // Every stream sends on the shared socket but gets its ACKs through its own socket pair, so it can sleep
+        // on them in its own event loop.  If one can't be started, the rest are never started and the ones that
+        // were give up
+        for (; num_started < num_streams; num_started++)
+        {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair) < 0)
+            {
+                perror("Could not create socket pair");
+                fail_flows(flows, num_streams);
+                break;
+            }
+            flows[num_started].relay_fd = pair[0];
+            flows[num_started].ack_fd = pair[1];
+            int result = pthread_create(&flows[num_started].thread, NULL, run_flow, &flows[num_started]);
+            if (result != 0)
+            {
+                printf("Could not start stream %d\n", num_started);
+                close(pair[0]);
+                close(pair[1]);
+                errno = result;
+                fail_flows(flows, num_streams);
+                break;
+            }
+        }
+        relay_acks(flows, num_streams, sockfd);
+        for (int i = 0; i < num_started; i++)
+        {
+            pthread_join(flows[i].thread, NULL);
+            close(flows[i].relay_fd);
+            close(flows[i].ack_fd);
+        }
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("File sent\n");
+    }
+    */
+    if (tracing)
+    {
+        if (options->live_stats)
+        {
+            print_client_summary(&tracer);
+        }
+        stop_tracer(&tracer);
+    }
+    // The first stream to fail says why the upload did
+    for (int i = 0; i < num_streams && error == 0; i++)
+    {
+        error = flows[i].failed ? (flows[i].error != 0 ? flows[i].error : EIO) : 0;
+    }
+    free(flows);
+    close_file_source(src);
+    close(sockfd);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int rdt_send_file(const struct rdt_sender_options *options, const char *filename)
+{
+    struct file_source src;
+    unsigned long long resume_key = 0;
+    if (rdt_check_sender_options(options) < 0)
+    {
+        return -1;
+    }
+    // Open file for reading
+    if (open_file_source(&src, filename, options->use_mmap, options->compress_level) < 0)
+    {
+        perror("Error opening file");
+        return -1;
+    }
+    // Only a file we can read again from any point can be resumed
+    if (options->resume && (src.streaming || file_resume_key(filename, &resume_key) < 0))
+    {
+        printf("Only a regular file can be resumed\n");
+        close_file_source(&src);
+        return invalid_options();
+    }
+    return send_source(options, &src, resume_key);
+}
+
+int rdt_send_fd(const struct rdt_sender_options *options, int fd)
+{
+    struct file_source src;
+    if (rdt_check_sender_options(options) < 0)
+    {
+        return -1;
+    }
+    if (options->resume)
+    {
+        printf("Only a file sent by name can be resumed\n");
+        return invalid_options();
+    }
+    // Sending from a copy of the descriptor, so closing the source leaves the caller's open
+    int copy = dup(fd);
+    FILE *fp = copy < 0 ? NULL : fdopen(copy, "rb");
+    if (fp == NULL)
+    {
+        perror("Error opening file");
+        if (copy >= 0)
+        {
+            close(copy);
+        }
+        return -1;
+    }
+    if (init_file_source(&src, fp, options->use_mmap, options->compress_level) < 0)
+    {
+        perror("Error opening file");
+        close_file_source(&src);
+        return -1;
+    }
+    return send_source(options, &src, 0);
+}
+
+int rdt_send_buffer(const struct rdt_sender_options *options, const void *data, size_t len)
+{
+    struct file_source src;
+    if (rdt_check_sender_options(options) < 0)
+    {
+        return -1;
+    }
+    // A buffer is sent as it is, like a memory mapped file
+    if (options->resume || options->compress_level > 0)
+    {
+        printf("A buffer can't be compressed or resumed\n");
+        return invalid_options();
+    }
+    init_buffer_source(&src, data, len);
+    return send_source(options, &src, 0);
+}
+
+void *run_pushed_upload(void *arg)
+{
+    struct rdt_sender *sender = arg;
+    sender->result = rdt_send_fd(&sender->options, sender->read_fd);
+    sender->error = errno;
+    // Writes that come after the upload gave up fail rather than block
+    close(sender->read_fd);
+    return NULL;
+}
+
+struct rdt_sender *rdt_sender_open(const struct rdt_sender_options *options)
+{
+    int pair[2];
+    if (rdt_check_sender_options(options) < 0)
+    {
+        return NULL;
+    }
+    if (options->resume)
+    {
+        printf("Only a file sent by name can be resumed\n");
+        invalid_options();
+        return NULL;
+    }
+    struct rdt_sender *sender = calloc(1, sizeof(struct rdt_sender));
+    if (sender == NULL)
+    {
+        perror("Could not allocate sender");
+        return NULL;
+    }
+    // A stream socket rather than a pipe, so a write after the upload gave up fails instead of raising SIGPIPE
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        perror("Could not create socket pair");
+        free(sender);
+        return NULL;
+    }
+    sender->options = *options;
+    sender->read_fd = pair[0];
+    sender->write_fd = pair[1];
+    int result = pthread_create(&sender->thread, NULL, run_pushed_upload, sender);
+    if (result != 0)
+    {
+        printf("Could not start the upload\n");
+        errno = result;
+        close(pair[0]);
+        close(pair[1]);
+        free(sender);
+        return NULL;
+    }
+    return sender;
+}
+
+int rdt_sender_write(struct rdt_sender *sender, const void *data, size_t len)
+{
+    const char *next = data;
+    while (len > 0)
+    {
+        ssize_t bytes_sent = send(sender->write_fd, next, len, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_sent < 0)
+        {
+            return -1;
+        }
+        next += bytes_sent;
+        len -= bytes_sent;
+    }
+    return 0;
+}
+
+int rdt_sender_close(struct rdt_sender *sender)
+{
+    // The upload sees the end of its input and finishes
+    close(sender->write_fd);
+    pthread_join(sender->thread, NULL);
+    int result = sender->result;
+    if (result < 0)
+    {
+        errno = sender->error;
+    }
+    free(sender);
+    return result;
+}
+
+// Utility function for when a receiver can't be set up - closes the sockets of the first count workers
+int free_workers(struct worker *workers, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        close(workers[i].sockfd);
+    }
+    free(workers);
+    return -1;
+}
+
+int rdt_receive(const struct rdt_receiver_options *options)
+{
+    struct sockaddr_in server_addr;
+    struct server_config config;
+    struct tracer tracer;
+    int reuse = 1;
+    int tracing = options->trace_name != NULL || options->live_stats;
+    _Atomic int stop = 0;
+    if (rdt_check_receiver_options(options) < 0)
+    {
+        return -1;
+    }
+    memset(&config, 0, sizeof(config));
+    config.window_size = options->window_size;
+    config.direct = options->direct;
+    config.writer_thread = options->writer_thread;
+    config.listen = options->listen;
+    config.reply_to_sender = options->reply_to_sender;
+    config.max_packet_size = options->max_packet_size;
+    config.gro = options->gro;
+    config.policy.ack_every = options->ack_every;
+    config.policy.ack_delay = options->ack_delay;
+    config.policy.num_unacked = 0;
+    config.on_data = options->on_data;
+    config.on_done = options->on_done;
+    config.ctx = options->ctx;
+    // A server that takes a single upload only needs one worker
+    int num_workers = config.listen ? options->num_workers : 1;
+
+    // Configure the server address structure
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(options->port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // Configure the client address structure to which we will send ACKs
+    if (!config.reply_to_sender)
+    {
+        set_address(&config.client_addr_to, options->client_ip, options->client_port);
+    }
+
+    struct worker *workers = calloc(num_workers, sizeof(struct worker));
+    if (workers == NULL)
+    {
+        perror("Could not allocate workers");
+        return -1;
+    }
+    // Every worker gets its own UDP socket for receiving packets and sending ACKs, all bound to the same port
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].config = &config;
+        workers[i].stop = num_workers > 1 ? &stop : NULL;
+        workers[i].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (workers[i].sockfd < 0)
+        {
+            perror("Could not create socket");
+            return free_workers(workers, i);
+        }
+        if (num_workers > 1 && setsockopt(workers[i].sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        {
+            perror("Could not share the port between workers");
+            return free_workers(workers, i + 1);
+        }
+        // Bind the socket to the server address
+        if (bind(workers[i].sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            perror("Bind failed");
+            return free_workers(workers, i + 1);
+        }
+        // Letting the kernel coalesce runs of packets into one buffer, which we split back up
+        if (config.gro && setsockopt(workers[i].sockfd, SOL_UDP, UDP_GRO, &reuse, sizeof(reuse)) < 0)
+        {
+            perror("GRO isn't available, receiving packets one at a time");
+            config.gro = 0;
+        }
+    }
+    // The program is shared by the whole group of sockets, so attaching it to one is enough
+    if (num_workers > 1 && steer_by_connection(workers[0].sockfd, num_workers) < 0)
+    {
+        perror("Could not steer connections to workers");
+        return free_workers(workers, num_workers);
+    }
+
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("Waiting for handshake\n");
+    }
+    */
+    // Every worker traces to its own ring
+    if (tracing)
+    {
+        if (start_tracer(&tracer, options->trace_name, num_workers, options->live_stats, print_server_stats) < 0)
+        {
+            perror("Could not start tracing");
+            return free_workers(workers, num_workers);
+        }
+        for (int i = 0; i < num_workers; i++)
+        {
+            workers[i].trace = &tracer.rings[i];
+        }
+    }
+    if (num_workers == 1)
+    {
+        run_worker(&workers[0]);
+    }
+    else
+    {
+        int num_started = 0;
+        for (; num_started < num_workers; num_started++)
+        {
+            int result = pthread_create(&workers[num_started].thread, NULL, run_worker, &workers[num_started]);
+            if (result != 0)
+            {
+                printf("Could not start worker %d\n", num_started);
+                fail_worker(&workers[num_started], result);
+                break;
+            }
+        }
+        // Listening workers only return once one of them has given up
+        for (int i = 0; i < num_started; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("File received, shutting down\n");
+    }
+    */
+    if (tracing)
+    {
+        if (options->live_stats)
+        {
+            print_server_stats(&tracer, get_time_us());
+        }
+        stop_tracer(&tracer);
+    }
+    // A file that doesn't match its digest was still written, but the exit status says it can't be trusted
+    int corrupt = 0, error = 0;
+    for (int i = 0; i < num_workers; i++)
+    {
+        close(workers[i].sockfd);
+        corrupt |= workers[i].corrupt;
+        if (error == 0)
+        {
+            error = workers[i].error;
+        }
+    }
+    free(workers);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return corrupt;
+}
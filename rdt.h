@@ -0,0 +1,114 @@
+#ifndef RDT_H
+#define RDT_H
+#include <stddef.h>
+
+// The public interface of librdt, which runs uploads over our protocol inside any program.  The client and server
+// programs are thin wrappers around it.  Every call blocks until its transfer is over, so a program that wants to
+// do other things at the same time runs them on a thread of its own.  A transfer that can't be set up, or that hits
+// an error once it's under way (a socket that stops working, a file that can't be read or written), returns -1 with
+// errno set to why - the process is never ended for it
+
+#define RDT_API __attribute__((visibility("default")))
+
+// How a sender reaches the server and sends the data.  rdt_sender_defaults fills in what the client uses without
+// any options - the server's port on the local machine, through the proxy
+struct rdt_sender_options
+{
+    const char *server_ip;
+    int server_port;
+    // The port ACKs come back to, or 0 for any free one
+    int local_port;
+    // reno, cubic or bbr
+    const char *cc_name;
+    int num_streams;
+    int window_size;
+    // The largest datagram sent, headers included
+    int packet_size;
+    int use_mmap;
+    int use_gso;
+    // The largest forward error correction block, or 0 to send no parity
+    int fec_block;
+    // A zlib level from 1 to 9 to compress the upload with, or 0.  Not for buffers
+    int compress_level;
+    // Pick the upload up wherever the server got to before.  Only for a regular file sent by name
+    int resume;
+    // Where to write a binary trace of the upload (see trace_decode), or NULL, and whether to print statistics
+    // every second and once it's done
+    const char *trace_name;
+    int live_stats;
+};
+
+// Called with every piece of an upload as it arrives, in order within each stream, at its offset in the upload.
+// A multi-stream upload's streams arrive side by side, so the offsets of consecutive calls can jump around.  The
+// data is only valid until the callback returns
+typedef void (*rdt_data_callback)(void *ctx, unsigned int conn_id, long long offset, const char *data, size_t len);
+// Called once every stream of an upload has arrived, with whether the data didn't match what the client sent
+typedef void (*rdt_done_callback)(void *ctx, unsigned int conn_id, int corrupt);
+
+// How a receiver listens and where the data goes.  rdt_receiver_defaults fills in what the server uses without any
+// options, which writes the upload to output.txt
+struct rdt_receiver_options
+{
+    int port;
+    // Where ACKs are sent, unless reply_to_sender sends them to wherever each upload's packets come from
+    const char *client_ip;
+    int client_port;
+    int reply_to_sender;
+    // Keep taking uploads forever, each written to output-<connection ID>.txt, rather than returning after one
+    int listen;
+    // Write packets to the file as they arrive rather than buffering them until they're in order
+    int direct;
+    // Write buffered packets on a thread of their own, so a slow disk shrinks the window the client is told about
+    // rather than holding up the socket.  Not for direct mode or callbacks
+    int writer_thread;
+    int gro;
+    // Threads sharing the port when listening, with every upload handled by one of them
+    int num_workers;
+    int window_size;
+    int max_packet_size;
+    // ACK after this many packets, or once the oldest unACKed one is ack_delay microseconds old
+    int ack_every;
+    long long ack_delay;
+    const char *trace_name;
+    int live_stats;
+    // When on_data is set, uploads are handed to it rather than written to files.  Not with direct or resumed
+    // uploads, which are written out of order
+    rdt_data_callback on_data;
+    rdt_done_callback on_done;
+    void *ctx;
+};
+
+// An upload being written to by the program, see rdt_sender_open
+struct rdt_sender;
+
+RDT_API void rdt_sender_defaults(struct rdt_sender_options *options);
+RDT_API void rdt_receiver_defaults(struct rdt_receiver_options *options);
+
+// Functions that check options are usable, printing what's wrong if they aren't - returns -1 if they aren't
+RDT_API int rdt_check_sender_options(const struct rdt_sender_options *options);
+RDT_API int rdt_check_receiver_options(const struct rdt_receiver_options *options);
+
+// Function that moves every transfer started after it onto io_uring, which takes far fewer system calls per
+// megabyte.  It's for the whole process, so it's called before any transfer starts.  Returns -1, saying why, if
+// the kernel (or the build) doesn't have io_uring, in which case nothing changes
+RDT_API int rdt_use_io_uring(void);
+
+// Functions that upload a file by name ("-" is stdin), whatever a file descriptor reads until it ends, or a buffer
+// in memory.  The descriptor is left open, and the buffer is sent from where it is.  Returns 0 once the server has
+// everything, or -1 if the upload failed (errno is ETIMEDOUT if the server never answered)
+RDT_API int rdt_send_file(const struct rdt_sender_options *options, const char *filename);
+RDT_API int rdt_send_fd(const struct rdt_sender_options *options, int fd);
+RDT_API int rdt_send_buffer(const struct rdt_sender_options *options, const void *data, size_t len);
+
+// Functions that upload whatever the program writes, for data that's produced as it goes.  The upload runs on a
+// thread of its own, and rdt_sender_write blocks while it's behind.  rdt_sender_close ends the upload, waits for
+// the server to get everything and frees the sender, returning what rdt_send_fd would have.  NULL or -1 on failure
+RDT_API struct rdt_sender *rdt_sender_open(const struct rdt_sender_options *options);
+RDT_API int rdt_sender_write(struct rdt_sender *sender, const void *data, size_t len);
+RDT_API int rdt_sender_close(struct rdt_sender *sender);
+
+// Function that receives uploads until the first is done, or when listening until something fails.  Returns 0, 1 if
+// an upload didn't match what the client sent, or -1 if the receiver couldn't be set up or had to give up
+RDT_API int rdt_receive(const struct rdt_receiver_options *options);
+
+#endif
@@ -0,0 +1,1735 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <linux/filter.h>
+#include <math.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "writer.h"
+
+struct packet_recv
+{
+    unsigned short length;
+    int received;
+};
+
+// Decompression for an upload the client compressed - its payload is a stream of records, each a header followed
+// by a block that's either compressed or stored as it is.  Packets are decoded in order as they're saved, and the
+// blocks are written to the file one after the other
+struct decompressor
+{
+    char header[RECORD_HEADER_SIZE];
+    // The current record's block as it arrives, and what it decompresses into
+    char *record;
+    char *block;
+    // Bytes of the current record (header included) received so far
+    size_t have;
+    unsigned char method;
+    size_t raw_len;
+    size_t stored_len;
+    off_t offset;
+    // Set once the records stop making sense - nothing more is written
+    int failed;
+};
+
+// Where a connection's data goes instead of a file, for a program that embeds the server - on_data gets each
+// stream's data in order, at its offset in the upload, and on_done is called once every stream is complete
+struct data_sink
+{
+    void (*on_data)(void *ctx, unsigned int conn_id, long long offset, const char *data, size_t len);
+    void (*on_done)(void *ctx, unsigned int conn_id, int corrupt);
+    void *ctx;
+    unsigned int conn_id;
+};
+
+// Ring buffer of out of order packets - packet seqnum always lives in slot seqnum % capacity, so saving
+// packets never moves the rest of the buffer.  In direct mode there are no slots: every payload is written
+// straight to its offset in the output file, and a bitmap of the whole stream tracks which packets have arrived
+struct recv_window
+{
+    struct packet_recv *slots;
+    // Payload storage for each slot
+    char *payloads;
+    unsigned long long *received_bits;
+    int fd;
+    // NULL unless the data goes to a sink rather than to fd
+    const struct data_sink *sink;
+    // Where the stream's part of the file starts, and how big each piece of it is
+    off_t base;
+    int payload_size;
+    // Slots in the ring, or the stream's packet count in direct mode
+    long long capacity;
+    // One past the highest sequence number buffered so far
+    long long highest_received;
+    // Scratch space for rebuilding a packet from parity, allocated the first time it's needed
+    char *rebuilt;
+    // NULL unless the upload is compressed, in which case packets are decompressed rather than written where they go
+    struct decompressor *decoder;
+    // How much of a direct mode stream's part of the file has been reserved, counted from base, or -1 once the
+    // filesystem has said it can't
+    off_t reserved;
+    // CRC32C of the first digested packets of the stream, built up as they're written in order
+    uint32_t digest;
+    long long digested;
+    // Packets saved in order whose writes are held back so a run of them goes out in one call, starting with
+    // packet pending_first.  Their payloads stay in their slots until flush_writes
+    struct iovec pending[FILE_BATCH];
+    int num_pending;
+    long long pending_first;
+    // The worker's writer thread, which writes the packets instead when it has one.  Packets before queued have
+    // been handed to it and those before written are in the file - the slots in between can't be reused yet
+    struct disk_writer *writer;
+    long long queued;
+    _Atomic long long written;
+    // The errno of the first write or read back of the output that failed, which the worker gives up over
+    int error;
+};
+
+// Room for the UDP_GRO control message that says where a coalesced buffer splits into packets
+union gro_control
+{
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+// Storage for receiving many datagrams with a single recvmmsg call.  With GRO each one may be several packets
+// coalesced by the kernel
+struct recv_batch
+{
+    char *buffers;
+    int buffer_size;
+    int num_msgs;
+    // Where each datagram came from
+    struct sockaddr_in *addrs;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    union gro_control *controls;
+};
+
+// When to send an ACK for in order packets - after every ack_every packets, or once the oldest unACKed packet
+// has waited ack_delay microseconds.  Anything out of order is always ACKed right away
+struct ack_policy
+{
+    int ack_every;
+    long long ack_delay;
+    int num_unacked;
+    long long first_unacked_time;
+};
+
+// One stream of the file - the client can split the file into several ranges of packets, each of which has its
+// own sequence numbers and is reassembled at its offset in the output file
+struct stream
+{
+    int started;
+    // UNKNOWN_LENGTH for a streamed upload until its FIN arrives
+    long long num_packets;
+    long long expected_seq_num;
+    struct recv_window window;
+    struct ack_policy policy;
+    // Set when something in the current batch has to be ACKed right away
+    int ack_now;
+    // Packets rebuilt from parity since the last ACK
+    int recovered;
+    // The digest the client sent after the stream's data, once it's arrived, and the digest a resumed stream's
+    // checkpoint had for everything before where it picks up
+    int has_digest;
+    uint32_t client_digest;
+    uint32_t checkpoint_digest;
+    // One past the last packet the client was told there's room for
+    long long advertised_edge;
+};
+
+// One upload, told apart from the others by the connection ID in every packet.  Each connection has its own
+// streams and output file
+struct connection
+{
+    unsigned int conn_id;
+    // Where ACKs for the connection are sent
+    struct sockaddr_in addr;
+    // Closed once every stream is done - the connection is kept until it times out so that the final ACKs can be
+    // sent again if the client missed them
+    FILE *fp;
+    // Where the data goes instead when the server is embedded with a callback, and set once every stream is done
+    struct data_sink sink;
+    int complete;
+    // Allocated once the first handshake tells us how many streams there are
+    struct stream *streams;
+    int num_streams;
+    int num_done;
+    long long last_active;
+    // Set when the client can resume the upload after either side dies.  The output is named after the key the
+    // client sent, and how far each stream has been written is saved next to it every so often
+    int resumable;
+    unsigned long long resume_key;
+    char checkpoint_name[48];
+    long long total_packets;
+    int payload_size;
+    // Set when a stream has moved on since the last checkpoint
+    int checkpoint_dirty;
+    long long next_checkpoint;
+    // Set if a stream's digest didn't match what was written
+    int corrupt;
+    // The worker's writer thread, or NULL if the worker writes the packets itself
+    struct disk_writer *writer;
+    // The next connection in the same hash bucket, and in the worker's list of every connection
+    struct connection *bucket_next;
+    struct connection *next;
+};
+
+// Settings every worker shares
+struct server_config
+{
+    int window_size;
+    int direct;
+    struct ack_policy policy;
+    // Keep accepting uploads forever rather than exiting after the first one
+    int listen;
+    // Send ACKs to wherever each connection's packets come from rather than to client_addr_to
+    int reply_to_sender;
+    // The largest datagram we take, and whether the kernel coalesces datagrams with GRO
+    int max_packet_size;
+    int gro;
+    struct sockaddr_in client_addr_to;
+    // Give every worker a thread that writes buffered packets to their files
+    int writer_thread;
+    // Set when the server is embedded and hands the data to a callback rather than writing output files
+    void (*on_data)(void *ctx, unsigned int conn_id, long long offset, const char *data, size_t len);
+    void (*on_done)(void *ctx, unsigned int conn_id, int corrupt);
+    void *ctx;
+};
+
+// A thread with its own socket and connections.  The kernel hands every packet of a connection to the same
+// worker's socket, so workers never share any state
+struct worker
+{
+    int sockfd;
+    const struct server_config *config;
+    struct connection *buckets[CONN_BUCKETS];
+    struct connection *connections;
+    // Set once the only upload is done when the server isn't listening, and if any upload was corrupt
+    int finished;
+    int corrupt;
+    // The ring the worker traces its events to, or NULL when nothing is traced
+    struct trace_ring *trace;
+    // NULL unless the worker has a writer thread
+    struct disk_writer *writer;
+    // The errno of whatever made the worker give up, or 0.  stop is shared by every worker when there are several,
+    // and is set once any of them has given up so that the rest stop too
+    int error;
+    _Atomic int *stop;
+    pthread_t thread;
+};
+
+// Function that records why a worker has to give up, keeping the first error, and tells any other workers to stop
+void fail_worker(struct worker *worker, int error)
+{
+    if (worker->error == 0)
+    {
+        worker->error = error != 0 ? error : EIO;
+    }
+    if (worker->stop != NULL)
+    {
+        atomic_store(worker->stop, 1);
+    }
+}
+
+// Utility function to record why a stream's output couldn't be written, keeping the first error
+void fail_recv_window(struct recv_window *window)
+{
+    if (window->error == 0)
+    {
+        window->error = errno != 0 ? errno : EIO;
+    }
+}
+
+// Function that sets up a stream's buffer of out of order packets - returns -1 if it can't be allocated, which like
+// init_direct_window only means the handshake is turned away
+int init_recv_window(struct recv_window *window, int fd, off_t base, int payload_size, int capacity)
+{
+    window->slots = calloc(capacity, sizeof(struct packet_recv));
+    window->payloads = malloc((size_t)capacity * payload_size);
+    if (window->slots == NULL || window->payloads == NULL)
+    {
+        perror("Could not allocate receive window");
+        free(window->slots);
+        free(window->payloads);
+        return -1;
+    }
+    window->received_bits = NULL;
+    window->fd = fd;
+    window->sink = NULL;
+    window->base = base;
+    window->payload_size = payload_size;
+    window->capacity = capacity;
+    window->highest_received = 0;
+    window->rebuilt = NULL;
+    window->decoder = NULL;
+    window->reserved = -1;
+    window->digest = 0;
+    window->digested = 0;
+    window->num_pending = 0;
+    window->writer = NULL;
+    window->queued = 0;
+    window->written = 0;
+    window->error = 0;
+    return 0;
+}
+
+// Function that sets up direct mode once the handshake has told us how many packets are coming - returns -1 if
+// the bitmap can't be allocated, which only means this handshake is turned away
+int init_direct_window(struct recv_window *window, int fd, off_t base, int payload_size, long long num_packets)
+{
+    window->slots = NULL;
+    window->payloads = NULL;
+    window->received_bits = calloc(num_packets / 64 + 1, sizeof(unsigned long long));
+    if (window->received_bits == NULL)
+    {
+        perror("Could not allocate received bitmap");
+        return -1;
+    }
+    window->fd = fd;
+    window->sink = NULL;
+    window->base = base;
+    window->payload_size = payload_size;
+    window->capacity = num_packets;
+    window->highest_received = 0;
+    window->rebuilt = NULL;
+    window->decoder = NULL;
+    window->reserved = 0;
+    window->digest = 0;
+    window->digested = 0;
+    window->num_pending = 0;
+    window->writer = NULL;
+    window->queued = 0;
+    window->written = 0;
+    window->error = 0;
+    return 0;
+}
+
+// Function that reserves space in a direct mode file for a packet about to be written there, and up to DIRECT_RESERVE
+// bytes after it, without changing the file size - the last packet's write sets the exact size.  The space is
+// reserved as packets arrive rather than for the packet count the client sent, so a bogus count can't fill the
+// disk, and a packet further ahead than that is left to allocate its own space like any write.  This is only an
+// optimization, so a filesystem that can't do it is left to allocate as it's written to
+void reserve_space(struct recv_window *window, long long seqnum)
+{
+    off_t end = (off_t)(seqnum + 1) * window->payload_size;
+    off_t stream_end = (off_t)window->capacity * window->payload_size;
+    if (window->reserved < 0 || end <= window->reserved || end - window->reserved > DIRECT_RESERVE)
+    {
+        return;
+    }
+    end = stream_end - end > DIRECT_RESERVE ? end + DIRECT_RESERVE : stream_end;
+    if (fallocate(window->fd, FALLOC_FL_KEEP_SIZE, window->base + window->reserved, end - window->reserved) < 0)
+    {
+        // Running out of space is worth saying, even though it's the writes that fail over it
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+        {
+            perror("Could not reserve space in output file");
+        }
+        window->reserved = -1;
+        return;
+    }
+    window->reserved = end;
+}
+
+// Function that sets up decompression for a stream - returns -1 if it can't be allocated
+int init_decompressor(struct recv_window *window)
+{
+    struct decompressor *dec = calloc(1, sizeof(struct decompressor));
+    if (dec == NULL || (dec->record = malloc(compressBound(COMPRESS_BLOCK))) == NULL || (dec->block = malloc(COMPRESS_BLOCK)) == NULL)
+    {
+        perror("Could not allocate decompressor");
+        if (dec != NULL)
+        {
+            free(dec->record);
+            free(dec);
+        }
+        return -1;
+    }
+    window->decoder = dec;
+    return 0;
+}
+
+void free_recv_window(struct recv_window *window)
+{
+    free(window->slots);
+    free(window->payloads);
+    free(window->received_bits);
+    free(window->rebuilt);
+    if (window->decoder != NULL)
+    {
+        free(window->decoder->record);
+        free(window->decoder->block);
+        free(window->decoder);
+    }
+}
+
+// Utility function to check whether a packet in the window has been received
+int is_received(struct recv_window *window, long long seqnum)
+{
+    if (window->received_bits != NULL)
+    {
+        return (window->received_bits[seqnum / 64] >> (seqnum % 64)) & 1;
+    }
+    return window->slots[seqnum % window->capacity].received;
+}
+
+// Utility function to get the slot a packet is buffered in
+struct packet_recv *recv_slot(struct recv_window *window, long long seqnum)
+{
+    return &window->slots[seqnum % window->capacity];
+}
+
+// Utility function to get the storage a buffered packet's payload is kept in
+char *recv_payload(struct recv_window *window, long long seqnum)
+{
+    return window->payloads + (size_t)(seqnum % window->capacity) * window->payload_size;
+}
+
+// Utility function to get one past the last packet the window has room for.  With a writer thread a slot is only
+// free once the packet a full window back is in the file, which can be well after it was saved
+long long window_edge(struct recv_window *window, long long expected_seq_num)
+{
+    if (window->writer != NULL)
+    {
+        return atomic_load(&window->written) + window->capacity;
+    }
+    return expected_seq_num + window->capacity;
+}
+
+// Utility function to put a packet saved in order in its slot, if it isn't there already - only the handshake's
+// payload isn't, and its slot is still free
+char *keep_payload(struct recv_window *window, long long seqnum, unsigned short length, const char *payload)
+{
+    char *slot_payload = recv_payload(window, seqnum);
+    if (payload != slot_payload)
+    {
+        memcpy(slot_payload, payload, length);
+    }
+    return slot_payload;
+}
+
+// Function that checks a record's header once it's all arrived - returns -1 if it can't be a record the client sent
+int parse_record_header(struct decompressor *dec)
+{
+    dec->method = dec->header[0];
+    dec->raw_len = get_u32(dec->header + 1);
+    dec->stored_len = get_u32(dec->header + 5);
+    if (dec->raw_len == 0 || dec->raw_len > COMPRESS_BLOCK || dec->stored_len == 0 || dec->stored_len > compressBound(COMPRESS_BLOCK))
+    {
+        return -1;
+    }
+    if (dec->method == RECORD_STORED)
+    {
+        return dec->stored_len == dec->raw_len ? 0 : -1;
+    }
+    return dec->method == RECORD_ZLIB ? 0 : -1;
+}
+
+// Function that writes data at its offset in the upload - to the output file, or to the sink if there is one
+void write_output(struct recv_window *window, const char *data, size_t len, off_t offset)
+{
+    if (window->sink != NULL)
+    {
+        window->sink->on_data(window->sink->ctx, window->sink->conn_id, offset, data, len);
+        return;
+    }
+    struct iovec iov = {(void *)data, len};
+    if (window->error == 0 && write_file_at(window->fd, &iov, 1, offset) < 0)
+    {
+        perror("Error writing to file");
+        fail_recv_window(window);
+    }
+}
+
+// Function that decodes the next in order piece of a compressed upload, writing out every block it completes and
+// adding it to the digest
+void decompress_payload(struct recv_window *window, const char *data, size_t len)
+{
+    struct decompressor *dec = window->decoder;
+    while (len > 0 && !dec->failed)
+    {
+        size_t num_bytes;
+        if (dec->have < RECORD_HEADER_SIZE)
+        {
+            num_bytes = fmin(len, RECORD_HEADER_SIZE - dec->have);
+            memcpy(dec->header + dec->have, data, num_bytes);
+        }
+        else
+        {
+            num_bytes = fmin(len, RECORD_HEADER_SIZE + dec->stored_len - dec->have);
+            memcpy(dec->record + dec->have - RECORD_HEADER_SIZE, data, num_bytes);
+        }
+        dec->have += num_bytes;
+        data += num_bytes;
+        len -= num_bytes;
+        if (dec->have == RECORD_HEADER_SIZE && parse_record_header(dec) < 0)
+        {
+            printf("Corrupt compressed data, ignoring the rest of the upload\n");
+            dec->failed = 1;
+        }
+        if (dec->failed || dec->have < RECORD_HEADER_SIZE + dec->stored_len)
+        {
+            continue;
+        }
+        // The whole record is here
+        const char *block = dec->record;
+        if (dec->method == RECORD_ZLIB)
+        {
+            uLongf raw_len = dec->raw_len;
+            if (uncompress((Bytef *)dec->block, &raw_len, (const Bytef *)dec->record, dec->stored_len) != Z_OK || raw_len != dec->raw_len)
+            {
+                printf("Corrupt compressed data, ignoring the rest of the upload\n");
+                dec->failed = 1;
+                continue;
+            }
+            block = dec->block;
+        }
+        write_output(window, block, dec->raw_len, dec->offset);
+        window->digest = crc32c(window->digest, block, dec->raw_len);
+        dec->offset += dec->raw_len;
+        dec->have = 0;
+    }
+}
+
+// Function that writes out the packets held back by queue_write, all in one call.  With a writer thread it waits
+// for the writer to get through everything queued for the window instead.  A failed write is recorded in the window
+void flush_writes(struct recv_window *window)
+{
+    if (window->writer != NULL)
+    {
+        wait_for_writes(window->writer, &window->written, window->queued);
+        return;
+    }
+    if (window->num_pending == 0)
+    {
+        return;
+    }
+    if (window->error == 0 &&
+        write_file_at(window->fd, window->pending, window->num_pending, window->base + (off_t)window->pending_first * window->payload_size) < 0)
+    {
+        perror("Error writing to file");
+        fail_recv_window(window);
+    }
+    window->num_pending = 0;
+}
+
+// Function that holds back the write of a packet saved in order, so the run it's part of is written with one call
+// once it's FILE_BATCH packets long or its first slot is needed again
+void queue_write(struct recv_window *window, long long seqnum, unsigned short length, const char *payload)
+{
+    if (window->num_pending == FILE_BATCH || (window->num_pending > 0 && seqnum != window->pending_first + window->num_pending))
+    {
+        flush_writes(window);
+    }
+    char *slot_payload = keep_payload(window, seqnum, length, payload);
+    if (window->num_pending == 0)
+    {
+        window->pending_first = seqnum;
+    }
+    window->pending[window->num_pending].iov_base = slot_payload;
+    window->pending[window->num_pending].iov_len = length;
+    window->num_pending++;
+}
+
+// Function that writes a packet's payload to its final position in the file - streams are written side by side,
+// so every write is positional.  A compressed upload is only ever written in order, and is decompressed as it goes.
+// Buffered packets going to a file are written in runs, see queue_write, or handed to the writer thread if there
+// is one.  Packets written in order are added to the digest straight away.  Returns -1 if the writer's queue is
+// full, in which case nothing was done with the packet
+int write_packet_to_file(struct recv_window *window, long long seqnum, unsigned short length, const char *payload)
+{
+    if (window->decoder != NULL)
+    {
+        decompress_payload(window, payload, length);
+        return 0;
+    }
+    if (window->writer != NULL)
+    {
+        off_t offset = window->base + (off_t)seqnum * window->payload_size;
+        if (push_write(window->writer, window->fd, offset, keep_payload(window, seqnum, length, payload), length, seqnum, &window->written) < 0)
+        {
+            return -1;
+        }
+        window->queued = seqnum + 1;
+    }
+    else if (window->slots != NULL && window->sink == NULL)
+    {
+        queue_write(window, seqnum, length, payload);
+    }
+    else
+    {
+        write_output(window, payload, length, window->base + (off_t)seqnum * window->payload_size);
+    }
+    if (seqnum == window->digested)
+    {
+        window->digest = crc32c(window->digest, payload, length);
+        window->digested++;
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("Wrote %d bytes to the file \n", length);
+    }
+    */
+    return 0;
+}
+
+void free_recv_batch(struct recv_batch *batch)
+{
+    free(batch->buffers);
+    free(batch->addrs);
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->controls);
+}
+
+// Function that allocates a batch - the buffers hold about as many packets as MAX_BATCH full sized ones, so with
+// GRO there are fewer, bigger buffers.  Returns -1 if they can't be allocated
+int init_recv_batch(struct recv_batch *batch, const struct server_config *config)
+{
+    batch->buffer_size = config->gro ? GRO_BUFFER_SIZE : config->max_packet_size;
+    batch->num_msgs = config->gro ? fmax(1, (long long)MAX_BATCH * config->max_packet_size / GRO_BUFFER_SIZE) : MAX_BATCH;
+    batch->buffers = malloc((size_t)batch->num_msgs * batch->buffer_size);
+    batch->addrs = malloc(batch->num_msgs * sizeof(struct sockaddr_in));
+    batch->msgs = malloc(batch->num_msgs * sizeof(struct mmsghdr));
+    batch->iovs = malloc(batch->num_msgs * sizeof(struct iovec));
+    batch->controls = malloc(batch->num_msgs * sizeof(union gro_control));
+    if (batch->buffers == NULL || batch->addrs == NULL || batch->msgs == NULL || batch->iovs == NULL || batch->controls == NULL)
+    {
+        perror("Could not allocate receive batch");
+        free_recv_batch(batch);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Utility function to get where a received datagram splits into packets - the GRO segment size if the kernel
+// coalesced several, otherwise the whole datagram is one packet
+int segment_size(struct recv_batch *batch, int ind)
+{
+    struct msghdr *msg = &batch->msgs[ind].msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+    return batch->msgs[ind].msg_len;
+}
+
+// Function that drains every datagram already waiting on the socket (as many as the batch holds) with one
+// recvmmsg call - returns the number of datagrams received, 0 if there weren't any, or -1 if the socket has failed.
+// Their headers still have to be parsed
+int recv_packets(struct recv_batch *batch, int sockfd)
+{
+    for (int i = 0; i < batch->num_msgs; i++)
+    {
+        batch->iovs[i].iov_base = batch->buffers + (size_t)i * batch->buffer_size;
+        batch->iovs[i].iov_len = batch->buffer_size;
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        batch->msgs[i].msg_hdr.msg_control = batch->controls[i].buf;
+        batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->controls[i].buf);
+    }
+    int num_received = recv_datagrams(sockfd, batch->msgs, batch->num_msgs);
+    if (num_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    if (num_received < 0)
+    {
+        perror("Error receiving packets");
+    }
+    return num_received;
+}
+
+// Function that sets up a stream from its handshake, which carries the packet count of the whole file, the size of
+// the pieces it's cut into and the stream's first packet - returns -1 if the handshake doesn't make sense.  A
+// streamed upload is a single stream whose length is only known once its FIN arrives, and can't be resumed.  The
+// data goes to sink rather than fd when it isn't NULL, and is written by writer when it isn't NULL
+int handle_handshake(struct stream *stream, struct packet *pkt, int fd, const struct data_sink *sink, struct disk_writer *writer, int direct, int window_size)
+{
+    long long first_packet = 0;
+    if (!(pkt->flags & FLAG_HANDSHAKE) || pkt->payload_size == 0 || pkt->length > pkt->payload_size ||
+        ((pkt->flags & FLAG_COMPRESSED) && !(pkt->flags & FLAG_STREAM)) || ((pkt->flags & FLAG_RESUME) && (pkt->flags & FLAG_STREAM)))
+    {
+        return -1;
+    }
+    // Every packet's offset in the file has to fit in an off_t, which is 64 bits
+    if (!(pkt->flags & FLAG_STREAM) && (pkt->seqnum < 0 || pkt->seqnum > LLONG_MAX / pkt->payload_size))
+    {
+        return -1;
+    }
+    // The writer has no room for the first packet, so the client has to send the handshake again.  Nothing else
+    // is queued in between, so once there's room here the write below can't fail
+    if (writer != NULL && !(pkt->flags & (FLAG_RESUME | FLAG_COMPRESSED)) && writer_full(writer))
+    {
+        return -1;
+    }
+    if (pkt->flags & FLAG_STREAM)
+    {
+        stream->num_packets = (pkt->flags & FLAG_FIN) ? 2 : UNKNOWN_LENGTH;
+    }
+    else
+    {
+        // Every stream ends with the packet carrying its digest - even an empty file has an (empty) first packet
+        stream_range(pkt->seqnum, pkt->num_streams, pkt->stream, &first_packet, &stream->num_packets);
+        stream->num_packets = (stream->num_packets > 0 ? stream->num_packets : 1) + 1;
+    }
+    off_t base = (off_t)first_packet * pkt->payload_size;
+    // Direct mode's bitmap covers the whole stream, so it needs to know the length up front
+    if (direct && !(pkt->flags & FLAG_STREAM))
+    {
+        // Writing every packet straight to the file, so there's no limit on how far ahead a packet can be.  A
+        // bogus packet count shouldn't take down a server that's handling other uploads
+        if (init_direct_window(&stream->window, fd, base, pkt->payload_size, stream->num_packets - 1) < 0)
+        {
+            return -1;
+        }
+    }
+    // Initializing a buffer of packets to store out of order packets
+    else if (init_recv_window(&stream->window, fd, base, pkt->payload_size, window_size) < 0)
+    {
+        return -1;
+    }
+    stream->window.sink = sink;
+    // Compressed uploads are always streamed, so they're saved in order.  They're decompressed as they're saved,
+    // which leaves nothing for the writer to do
+    if (pkt->flags & FLAG_COMPRESSED)
+    {
+        if (init_decompressor(&stream->window) < 0)
+        {
+            free_recv_window(&stream->window);
+            return -1;
+        }
+    }
+    else
+    {
+        stream->window.writer = writer;
+    }
+    if (pkt->flags & FLAG_RESUME)
+    {
+        // A resumed stream's handshake only carries the key, and the stream carries on from its checkpoint
+        stream->window.highest_received = stream->expected_seq_num;
+        stream->window.digested = stream->expected_seq_num;
+        stream->window.digest = stream->checkpoint_digest;
+        stream->window.queued = stream->expected_seq_num;
+        stream->window.written = stream->expected_seq_num;
+    }
+    else
+    {
+        // The handshake carries the stream's first packet
+        write_packet_to_file(&stream->window, 0, pkt->length, pkt->payload);
+        stream->expected_seq_num = 1;
+    }
+    stream->started = 1;
+    return 0;
+}
+
+// Our ACK messages are the next expected sequence number followed by the SACK blocks - returns -1 if the ACK can't be
+// sent
+int send_ack(struct ack *ack, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    char buf[MAX_ACK_SIZE];
+    struct iovec iov = {buf, write_ack(buf, ack)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    int bytes_sent = send_message(sockfd, &msg);
+    if (bytes_sent < 0)
+    {
+        perror("Error sending ACK");
+        return -1;
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("ACK %d\n", ack->acknum);
+    }
+    */
+    return 0;
+}
+
+// Function that fills in the ACK with the expected sequence number, how much room there is after it and the runs
+// of buffered packets after it
+void build_ack(struct ack *ack, int stream, struct recv_window *window, long long expected_seq_num)
+{
+    ack->acknum = expected_seq_num;
+    ack->window = window_edge(window, expected_seq_num) - expected_seq_num;
+    ack->stream = stream;
+    ack->num_sacks = 0;
+    // Nothing past the highest buffered packet can be SACKed
+    long long seq = expected_seq_num;
+    while (seq < window->highest_received && ack->num_sacks < MAX_SACK_BLOCKS)
+    {
+        // Skipping over the hole
+        while (seq < window->highest_received && !is_received(window, seq))
+        {
+            seq++;
+        }
+        if (seq == window->highest_received)
+        {
+            break;
+        }
+        struct sack_block *block = &ack->sacks[ack->num_sacks++];
+        block->start = seq;
+        // Extending the block over every buffered packet in the run
+        while (seq < window->highest_received && is_received(window, seq))
+        {
+            seq++;
+        }
+        block->end = seq;
+    }
+}
+
+// Function that appropriately buffers the packet - returns the index the packet was buffered at or -1 if packet was discarded
+long long buffer_received_packet(struct packet *pkt, struct recv_window *window, long long *expected_seq_num)
+{
+    long long ind = pkt->seqnum - *expected_seq_num;
+    if (ind < 0)
+    {
+        // If the packet is out of order, we don't want to buffer it
+        /*
+        if (PRINT_STATEMENTS)
+        {
+            printf("Out of order packet %lld received, ignoring\n", pkt->seqnum);
+        }
+        */
+        return -1;
+    }
+    if (pkt->seqnum >= window_edge(window, *expected_seq_num))
+    {
+        // If the packet is too far ahead, we can't buffer it
+        printf("Packet %lld too far ahead, ignoring\n", pkt->seqnum);
+        return -1;
+    }
+    // If we already received the packet, we don't need to buffer it again
+    if (window->received_bits != NULL)
+    {
+        if (!is_received(window, pkt->seqnum))
+        {
+            reserve_space(window, pkt->seqnum);
+            write_packet_to_file(window, pkt->seqnum, pkt->length, pkt->payload);
+            window->received_bits[pkt->seqnum / 64] |= 1ULL << (pkt->seqnum % 64);
+        }
+    }
+    else
+    {
+        struct packet_recv *slot = recv_slot(window, pkt->seqnum);
+        if (!slot->received)
+        {
+            // The slot may still hold a packet a full window back that hasn't been written yet
+            if (window->num_pending > 0 && pkt->seqnum >= window->pending_first + window->capacity)
+            {
+                flush_writes(window);
+            }
+            memcpy(recv_payload(window, pkt->seqnum), pkt->payload, pkt->length);
+            slot->length = pkt->length;
+            slot->received = 1;
+        }
+    }
+    if (pkt->seqnum >= window->highest_received)
+    {
+        window->highest_received = pkt->seqnum + 1;
+    }
+    return ind;
+}
+
+// Function that adds everything before packet end to a direct mode stream's digest.  Packets that arrived in order
+// were added as they were written, so only those written after a hole are read back from the file
+void digest_from_file(struct recv_window *window, long long end)
+{
+    char buf[READBACK_SIZE];
+    off_t offset = window->base + (off_t)window->digested * window->payload_size;
+    off_t stop = window->base + (off_t)end * window->payload_size;
+    // Only the last packet of the file is short, so the file ends wherever it does
+    while (offset < stop)
+    {
+        ssize_t bytes_read = pread(window->fd, buf, stop - offset < READBACK_SIZE ? stop - offset : READBACK_SIZE, offset);
+        if (bytes_read < 0)
+        {
+            perror("Error reading file back");
+            fail_recv_window(window);
+            return;
+        }
+        if (bytes_read == 0)
+        {
+            break;
+        }
+        window->digest = crc32c(window->digest, buf, bytes_read);
+        offset += bytes_read;
+    }
+    if (end > window->digested)
+    {
+        window->digested = end;
+    }
+}
+
+// Function that writes all sequential received packets and updates the expected sequence number/buffer appropriately
+void save_packets(struct recv_window *window, long long *expected_seq_num)
+{
+    // In direct mode the packets are already written, so we only need to move past them
+    if (window->received_bits != NULL)
+    {
+        while (*expected_seq_num < window->capacity && is_received(window, *expected_seq_num))
+        {
+            (*expected_seq_num)++;
+        }
+        digest_from_file(window, *expected_seq_num);
+        return;
+    }
+    struct packet_recv *slot = recv_slot(window, *expected_seq_num);
+    while (slot->received)
+    {
+        // A packet the writer has no room for stays in its slot until it has
+        if (write_packet_to_file(window, *expected_seq_num, slot->length, recv_payload(window, *expected_seq_num)) < 0)
+        {
+            break;
+        }
+        // Freeing up the slot for the packet a full window ahead
+        slot->received = 0;
+        (*expected_seq_num)++;
+        slot = recv_slot(window, *expected_seq_num);
+    }
+}
+
+// Function that rebuilds the one packet missing from a parity packet's block, by XORing the parity with every other
+// packet of the block - packets that have already been written are read back from the file.  Returns 0 and turns
+// pkt into the rebuilt packet, or -1 if nothing's missing, more than one packet is missing or the block doesn't fit
+// in the window
+int rebuild_from_parity(struct stream *stream, struct packet *pkt)
+{
+    struct recv_window *window = &stream->window;
+    long long first = pkt->seqnum;
+    long long end = first + pkt->num_streams;
+    long long missing = -1;
+    if (pkt->length != window->payload_size || end > stream->num_packets || end > stream->expected_seq_num + window->capacity)
+    {
+        return -1;
+    }
+    // Everything before the expected packet has been received, and its slot may have been reused already
+    for (long long seq = first > stream->expected_seq_num ? first : stream->expected_seq_num; seq < end; seq++)
+    {
+        if (!is_received(window, seq))
+        {
+            if (missing >= 0)
+            {
+                return -1;
+            }
+            missing = seq;
+        }
+    }
+    if (missing < 0)
+    {
+        return -1;
+    }
+    if (window->rebuilt == NULL)
+    {
+        window->rebuilt = malloc(2 * (size_t)window->payload_size);
+        // The packet is only rebuilt some other time, or sent again
+        if (window->rebuilt == NULL)
+        {
+            perror("Could not allocate parity buffer");
+            return -1;
+        }
+    }
+    char *read_buf = window->rebuilt + window->payload_size;
+    memcpy(window->rebuilt, pkt->payload, window->payload_size);
+    for (long long seq = first; seq < end; seq++)
+    {
+        const char *payload;
+        if (seq == missing)
+        {
+            continue;
+        }
+        if (window->slots != NULL && seq >= stream->expected_seq_num)
+        {
+            payload = recv_payload(window, seq);
+        }
+        else
+        {
+            // A compressed upload's file holds what the packets decompressed into, not the packets themselves
+            flush_writes(window);
+            if (window->decoder != NULL ||
+                pread(window->fd, read_buf, window->payload_size, window->base + seq * window->payload_size) != window->payload_size)
+            {
+                return -1;
+            }
+            payload = read_buf;
+        }
+        for (int i = 0; i < window->payload_size; i++)
+        {
+            window->rebuilt[i] ^= payload[i];
+        }
+    }
+    pkt->flags = 0;
+    pkt->seqnum = missing;
+    pkt->payload = window->rebuilt;
+    stream->recovered++;
+    return 0;
+}
+
+// Function that gets the earliest time a delayed ACK is due on any stream of the connection, or -1 if none are
+// waiting
+long long next_ack_deadline(struct connection *conn)
+{
+    long long deadline = -1;
+    for (int i = 0; i < conn->num_streams; i++)
+    {
+        struct ack_policy *policy = &conn->streams[i].policy;
+        if (policy->num_unacked > 0 && (deadline < 0 || policy->first_unacked_time + policy->ack_delay < deadline))
+        {
+            deadline = policy->first_unacked_time + policy->ack_delay;
+        }
+    }
+    return deadline;
+}
+
+// Function that sends the pending ACK of a stream - returns -1 if it can't be sent
+int ack_stream(struct connection *conn, int stream, int sockfd, struct trace_ring *trace)
+{
+    struct ack ack;
+    ack.conn_id = conn->conn_id;
+    build_ack(&ack, stream, &conn->streams[stream].window, conn->streams[stream].expected_seq_num);
+    ack.recovered = conn->streams[stream].recovered;
+    if (send_ack(&ack, sockfd, &conn->addr, sizeof(conn->addr)) < 0)
+    {
+        return -1;
+    }
+    trace_event(trace, TRACE_ACK_SENT, stream, ack.acknum, ack.num_sacks, conn->conn_id);
+    conn->streams[stream].advertised_edge = ack.acknum + ack.window;
+    conn->streams[stream].policy.num_unacked = 0;
+    conn->streams[stream].ack_now = 0;
+    conn->streams[stream].recovered = 0;
+    return 0;
+}
+
+struct connection *find_connection(struct worker *worker, unsigned int conn_id)
+{
+    struct connection *conn = worker->buckets[conn_id % CONN_BUCKETS];
+    while (conn != NULL && conn->conn_id != conn_id)
+    {
+        conn = conn->bucket_next;
+    }
+    return conn;
+}
+
+// Function that writes out everything a connection's streams are holding back
+void flush_connection(struct connection *conn)
+{
+    for (int i = 0; i < conn->num_streams; i++)
+    {
+        flush_writes(&conn->streams[i].window);
+    }
+}
+
+// Function that gives up on the worker if any of a connection's streams couldn't write its output
+void check_connection(struct worker *worker, struct connection *conn)
+{
+    for (int i = 0; i < conn->num_streams; i++)
+    {
+        if (conn->streams[i].window.error != 0)
+        {
+            fail_worker(worker, conn->streams[i].window.error);
+        }
+    }
+}
+
+// Function that frees everything belonging to a connection - the caller unlinks it from the worker's list
+void close_connection(struct worker *worker, struct connection *conn)
+{
+    struct connection **link = &worker->buckets[conn->conn_id % CONN_BUCKETS];
+    while (*link != conn)
+    {
+        link = &(*link)->bucket_next;
+    }
+    *link = conn->bucket_next;
+    flush_connection(conn);
+    check_connection(worker, conn);
+    for (int i = 0; i < conn->num_streams; i++)
+    {
+        free_recv_window(&conn->streams[i].window);
+    }
+    free(conn->streams);
+    if (conn->fp != NULL)
+    {
+        fclose(conn->fp);
+    }
+    free(conn);
+}
+
+// Function that saves how far every stream of a resumable upload has been written.  The output is flushed to disk
+// first and the checkpoint is replaced with a single rename, so it never claims more than is really there
+void save_checkpoint(struct connection *conn)
+{
+    char tmp_name[sizeof(conn->checkpoint_name) + 4];
+    size_t size = CHECKPOINT_HEADER_SIZE + (size_t)conn->num_streams * CHECKPOINT_STREAM_SIZE;
+    char *buf = malloc(size);
+    // Like a checkpoint that can't be written, this only means more has to be sent again
+    if (buf == NULL)
+    {
+        perror("Could not allocate checkpoint");
+        return;
+    }
+    put_u64(buf, conn->resume_key);
+    put_u64(buf + 8, conn->total_packets);
+    put_u32(buf + 16, conn->payload_size);
+    put_u32(buf + 20, conn->num_streams);
+    // Everything before a stream's expected packet has been written and digested.  A stream whose digest has
+    // already been checked records the point just before it, so it's checked again if the upload is resumed,
+    // and a stream that hasn't been picked up again yet keeps what the last checkpoint had
+    for (int i = 0; i < conn->num_streams; i++)
+    {
+        struct stream *stream = &conn->streams[i];
+        char *entry = buf + CHECKPOINT_HEADER_SIZE + (size_t)i * CHECKPOINT_STREAM_SIZE;
+        long long expected = stream->expected_seq_num;
+        if (stream->started && expected >= stream->num_packets)
+        {
+            expected = stream->num_packets - 1;
+        }
+        put_u64(entry, expected);
+        put_u32(entry + 8, stream->started ? stream->window.digest : stream->checkpoint_digest);
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", conn->checkpoint_name);
+    flush_connection(conn);
+    fdatasync(fileno(conn->fp));
+    FILE *fp = fopen(tmp_name, "wb");
+    int failed = fp == NULL;
+    if (!failed)
+    {
+        failed = fwrite(buf, 1, size, fp) != size || fflush(fp) != 0 || fsync(fileno(fp)) < 0;
+        failed |= fclose(fp) != 0;
+    }
+    // Not being able to save only means more has to be sent again if the upload is interrupted
+    if (failed || rename(tmp_name, conn->checkpoint_name) < 0)
+    {
+        perror("Could not save checkpoint");
+    }
+    free(buf);
+    conn->checkpoint_dirty = 0;
+    conn->next_checkpoint = get_time_us() + CHECKPOINT_INTERVAL;
+}
+
+// Function that picks a resumable upload up from its checkpoint, if there's one for the same file cut up the same
+// way.  Otherwise, or if there's no memory to read it into, whatever was in the output file is thrown away and the
+// upload starts over
+void load_checkpoint(struct connection *conn, struct packet *pkt)
+{
+    size_t size = CHECKPOINT_HEADER_SIZE + (size_t)conn->num_streams * CHECKPOINT_STREAM_SIZE;
+    long long first_packet, num_packets;
+    int valid = 0;
+    conn->total_packets = pkt->seqnum;
+    conn->payload_size = pkt->payload_size;
+    conn->next_checkpoint = get_time_us() + CHECKPOINT_INTERVAL;
+    // One byte extra, so a longer checkpoint doesn't pass for the right size
+    char *buf = malloc(size + 1);
+    if (buf == NULL)
+    {
+        perror("Could not allocate checkpoint");
+    }
+    FILE *fp = buf != NULL ? fopen(conn->checkpoint_name, "rb") : NULL;
+    if (fp != NULL)
+    {
+        valid = fread(buf, 1, size + 1, fp) == size && get_u64(buf) == conn->resume_key && (long long)get_u64(buf + 8) == conn->total_packets &&
+                (int)get_u32(buf + 16) == conn->payload_size && (int)get_u32(buf + 20) == conn->num_streams;
+        fclose(fp);
+    }
+    for (int i = 0; valid && i < conn->num_streams; i++)
+    {
+        stream_range(conn->total_packets, conn->num_streams, i, &first_packet, &num_packets);
+        char *entry = buf + CHECKPOINT_HEADER_SIZE + (size_t)i * CHECKPOINT_STREAM_SIZE;
+        conn->streams[i].expected_seq_num = get_u64(entry);
+        conn->streams[i].checkpoint_digest = get_u32(entry + 8);
+        valid = conn->streams[i].expected_seq_num >= 0 && conn->streams[i].expected_seq_num <= (num_packets > 0 ? num_packets : 1);
+    }
+    if (!valid)
+    {
+        for (int i = 0; i < conn->num_streams; i++)
+        {
+            conn->streams[i].expected_seq_num = 0;
+        }
+        if (ftruncate(fileno(conn->fp), 0) < 0)
+        {
+            perror("Could not truncate output file");
+        }
+    }
+    /*
+    if (PRINT_STATEMENTS && valid)
+    {
+        printf("Resuming from checkpoint %s\n", conn->checkpoint_name);
+    }
+    */
+    free(buf);
+}
+
+// Function that drops an earlier connection uploading the same resumable file, whose client died and came back
+// under a new connection ID - how far it got is saved first, so the new connection picks up from there
+void drop_resumed_connection(struct worker *worker, unsigned long long resume_key)
+{
+    for (struct connection **link = &worker->connections; *link != NULL; link = &(*link)->next)
+    {
+        struct connection *conn = *link;
+        if (conn->resumable && conn->resume_key == resume_key)
+        {
+            if (conn->checkpoint_dirty)
+            {
+                save_checkpoint(conn);
+            }
+            *link = conn->next;
+            close_connection(worker, conn);
+            return;
+        }
+    }
+}
+
+// Function that starts a new connection from its first handshake, with its output file - returns NULL if the file
+// can't be opened or allocated.  A resumable upload's output is opened without truncating it, since its checkpoint may say part
+// of it is already there.  An embedded server with a callback has no output file, and so can't resume uploads
+struct connection *open_connection(struct worker *worker, struct packet *pkt, struct sockaddr_in *from)
+{
+    char filename[32];
+    unsigned int conn_id = pkt->conn_id;
+    if ((pkt->flags & FLAG_RESUME) && (pkt->length != RESUME_KEY_SIZE || worker->config->on_data != NULL))
+    {
+        return NULL;
+    }
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL)
+    {
+        perror("Could not allocate connection");
+        return NULL;
+    }
+    if (worker->config->on_data != NULL)
+    {
+        conn->sink.on_data = worker->config->on_data;
+        conn->sink.on_done = worker->config->on_done;
+        conn->sink.ctx = worker->config->ctx;
+        conn->sink.conn_id = conn_id;
+    }
+    else if (pkt->flags & FLAG_RESUME)
+    {
+        conn->resumable = 1;
+        conn->resume_key = get_u64(pkt->payload);
+        drop_resumed_connection(worker, conn->resume_key);
+    }
+    // A server that only takes one upload always writes to output.txt, and a resumable upload is named by its key
+    // so that it's found again under a new connection ID
+    if (worker->config->listen && conn->resumable)
+    {
+        snprintf(filename, sizeof(filename), "output-%016llx.txt", conn->resume_key);
+    }
+    else if (worker->config->listen)
+    {
+        snprintf(filename, sizeof(filename), "output-%08x.txt", conn_id);
+    }
+    else
+    {
+        snprintf(filename, sizeof(filename), "output.txt");
+    }
+    snprintf(conn->checkpoint_name, sizeof(conn->checkpoint_name), "%s.ckpt", filename);
+    if (conn->resumable)
+    {
+        int fd = open(filename, O_RDWR | O_CREAT, 0644);
+        conn->fp = fd < 0 ? NULL : fdopen(fd, "r+b");
+        if (fd >= 0 && conn->fp == NULL)
+        {
+            close(fd);
+        }
+    }
+    else if (conn->sink.on_data == NULL)
+    {
+        // Opened for reading too, since direct mode reads back what it wrote out of order to digest it
+        conn->fp = fopen(filename, "w+b");
+        // Whatever a checkpoint says about the old output no longer holds
+        unlink(conn->checkpoint_name);
+    }
+
+    if (conn->fp == NULL && conn->sink.on_data == NULL)
+    {
+        perror("Could not open output file");
+        free(conn);
+        return NULL;
+    }
+    conn->conn_id = conn_id;
+    conn->writer = worker->writer;
+    conn->addr = worker->config->reply_to_sender ? *from : worker->config->client_addr_to;
+    conn->bucket_next = worker->buckets[conn_id % CONN_BUCKETS];
+    worker->buckets[conn_id % CONN_BUCKETS] = conn;
+    conn->next = worker->connections;
+    worker->connections = conn;
+    return conn;
+}
+
+// Function that checks a stream's digest once everything before it has been written, which completes the stream.
+// A stream that doesn't match is still ACKed, since sending it again wouldn't change what was written
+void check_digest(struct connection *conn, struct stream *stream)
+{
+    if (!stream->has_digest || stream->expected_seq_num != stream->num_packets - 1)
+    {
+        return;
+    }
+    if (stream->window.digest != stream->client_digest)
+    {
+        printf("Stream %d of connection %u doesn't match its digest (%08x, expected %08x)\n", (int)(stream - conn->streams),
+               conn->conn_id, stream->window.digest, stream->client_digest);
+        conn->corrupt = 1;
+    }
+    stream->expected_seq_num++;
+}
+
+// Function that saves whatever a stream couldn't hand to the writer thread while its queue was full, and completes
+// the stream if that was all it was waiting for
+void resume_stream(struct connection *conn, struct stream *stream)
+{
+    long long before = stream->expected_seq_num;
+    if (!stream->started || stream->window.writer == NULL || before >= stream->num_packets)
+    {
+        return;
+    }
+    save_packets(&stream->window, &stream->expected_seq_num);
+    check_digest(conn, stream);
+    if (stream->expected_seq_num == before)
+    {
+        return;
+    }
+    conn->checkpoint_dirty |= conn->resumable;
+    stream->ack_now = 1;
+    conn->num_done += stream->expected_seq_num >= stream->num_packets;
+}
+
+// Function that checks whether a stream with a writer thread needs to hear when the writer has made room - because
+// a packet couldn't be queued, or because the client was last told there's less than half a window left
+int waiting_on_writer(struct stream *stream)
+{
+    struct recv_window *window = &stream->window;
+    if (!stream->started || window->writer == NULL || stream->expected_seq_num >= stream->num_packets)
+    {
+        return 0;
+    }
+    return recv_slot(window, stream->expected_seq_num)->received || stream->advertised_edge - stream->expected_seq_num <= window->capacity / 2;
+}
+
+// Function that handles one packet of a connection, writing whatever it completes and deciding whether it has
+// to be ACKed right away.  Without the memory for its streams the packet is dropped, and the client sends it again
+void handle_packet(struct connection *conn, struct packet *pkt, const struct server_config *config)
+{
+    long long buffered_ind;
+    if (conn->streams == NULL)
+    {
+        conn->num_streams = pkt->num_streams > 0 ? pkt->num_streams : 1;
+        conn->streams = calloc(conn->num_streams, sizeof(struct stream));
+        if (conn->streams == NULL)
+        {
+            perror("Could not allocate streams");
+            conn->num_streams = 0;
+            return;
+        }
+        for (int i = 0; i < conn->num_streams; i++)
+        {
+            conn->streams[i].policy = config->policy;
+        }
+        if (conn->resumable)
+        {
+            load_checkpoint(conn, pkt);
+        }
+    }
+    // Either every stream of an upload is resumed or none of them are
+    if (pkt->stream >= conn->num_streams || ((pkt->flags & FLAG_HANDSHAKE) && !(pkt->flags & FLAG_RESUME) != !conn->resumable))
+    {
+        return;
+    }
+
+    struct stream *stream = &conn->streams[pkt->stream];
+    // The first packet of every stream is its handshake, and the client doesn't send anything else on the
+    // stream until the handshake is ACKed
+    if (!stream->started)
+    {
+        int fd = conn->fp != NULL ? fileno(conn->fp) : -1;
+        const struct data_sink *sink = conn->sink.on_data != NULL ? &conn->sink : NULL;
+        if (handle_handshake(stream, pkt, fd, sink, conn->writer, config->direct, config->window_size) < 0)
+        {
+            return;
+        }
+        /*
+        if (PRINT_STATEMENTS)
+        {
+            printf("Handshake received: %lld packets expected\n", stream->num_packets);
+        }
+        */
+        conn->num_done += stream->expected_seq_num >= stream->num_packets;
+        stream->ack_now = 1;
+        return;
+    }
+    // A parity packet is only any use if exactly one packet of its block is missing, which it then stands in for
+    if ((pkt->flags & FLAG_PARITY) && rebuild_from_parity(stream, pkt) < 0)
+    {
+        return;
+    }
+    // The FIN tells us where a streamed upload's data ends, with its digest coming right after
+    if ((pkt->flags & FLAG_FIN) && pkt->seqnum < stream->num_packets - 1 && pkt->seqnum >= stream->window.highest_received - 1)
+    {
+        stream->num_packets = pkt->seqnum + 2;
+    }
+    // We receive any number of repeat handshake messages, which are ACKed again in case the client missed the
+    // first ACK.  The same goes for packets of a stream that's already done
+    if ((pkt->flags & FLAG_HANDSHAKE) || pkt->seqnum >= stream->num_packets || stream->expected_seq_num >= stream->num_packets)
+    {
+        stream->ack_now = 1;
+        return;
+    }
+    if (pkt->length > stream->window.payload_size)
+    {
+        return;
+    }
+    int had_holes = stream->window.highest_received > stream->expected_seq_num;
+    if (pkt->flags & FLAG_DIGEST)
+    {
+        // The digest is the last packet of the stream
+        if (pkt->seqnum != stream->num_packets - 1 || pkt->length != DIGEST_SIZE)
+        {
+            return;
+        }
+        buffered_ind = stream->has_digest ? -1 : pkt->seqnum - stream->expected_seq_num;
+        stream->client_digest = get_u32(pkt->payload);
+        stream->has_digest = 1;
+    }
+    else
+    {
+        buffered_ind = buffer_received_packet(pkt, &stream->window, &stream->expected_seq_num);
+        if (buffered_ind > -1)
+        {
+            save_packets(&stream->window, &stream->expected_seq_num);
+        }
+    }
+    check_digest(conn, stream);
+    // The expected packet moves the stream on, which the next checkpoint has to record
+    conn->checkpoint_dirty |= conn->resumable && buffered_ind == 0;
+    // Duplicates, out of order packets and packets that fill a hole are ACKed right away so the client
+    // learns about the loss (or the repair) as soon as possible
+    if (buffered_ind != 0 || had_holes)
+    {
+        stream->ack_now = 1;
+    }
+    if (stream->policy.num_unacked++ == 0)
+    {
+        stream->policy.first_unacked_time = get_time_us();
+    }
+    // The final ACK is never delayed
+    if (stream->expected_seq_num >= stream->num_packets)
+    {
+        conn->num_done++;
+        stream->ack_now = 1;
+    }
+}
+
+// Function that handles one packet that arrived from the given address
+void handle_datagram(struct worker *worker, char *buf, int len, struct sockaddr_in *from, long long now)
+{
+    struct packet pkt;
+    if (read_header(buf, len, &pkt) < 0)
+    {
+        trace_event(worker->trace, TRACE_DROP, 0, 0, len, 0);
+        return;
+    }
+    trace_event(worker->trace, TRACE_RECV, pkt.stream, pkt.seqnum, pkt.length, pkt.conn_id);
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printRecv(&pkt);
+    }
+    */
+    struct connection *conn = find_connection(worker, pkt.conn_id);
+    if (conn == NULL)
+    {
+        // Only a handshake starts a connection, and a server that isn't listening only ever takes the first one
+        if (!(pkt.flags & FLAG_HANDSHAKE) || (!worker->config->listen && worker->connections != NULL))
+        {
+            return;
+        }
+        conn = open_connection(worker, &pkt, from);
+        if (conn == NULL)
+        {
+            return;
+        }
+    }
+    conn->last_active = now;
+    handle_packet(conn, &pkt, worker->config);
+}
+
+// Function that runs one worker's event loop - with listen set it only returns once it or another worker has given
+// up, otherwise it returns once the first upload it sees is done.  Why it gave up is left in worker->error
+void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    const struct server_config *config = worker->config;
+    struct event_loop loop;
+    struct disk_writer writer;
+    int num_received, events;
+    // Set when the writer may have made room without saying so, see below
+    int recheck = 0;
+    long long deadline, conn_deadline;
+    struct recv_batch batch;
+    worker->writer = NULL;
+    if (init_recv_batch(&batch, config) < 0)
+    {
+        fail_worker(worker, errno);
+        return NULL;
+    }
+    if (init_event_loop(&loop, worker->sockfd) < 0)
+    {
+        fail_worker(worker, errno);
+        free_recv_batch(&batch);
+        return NULL;
+    }
+    // Direct mode writes every packet as it arrives and a sink takes the data itself, so only buffered packets
+    // going to a file are written by the writer thread.  It tells us when it's made room through an eventfd
+    if (config->writer_thread && !config->direct && config->on_data == NULL)
+    {
+        if (start_writer(&writer) < 0)
+        {
+            fail_worker(worker, errno);
+        }
+        else
+        {
+            worker->writer = &writer;
+            if (watch_input(&loop, writer.worker_fd, 1) < 0)
+            {
+                fail_worker(worker, errno);
+            }
+        }
+    }
+    while (!worker->finished && worker->error == 0 && (worker->stop == NULL || !atomic_load(worker->stop)))
+    {
+        // Waiting for more packets, but no longer than the delayed ACK timers (an idle connection, or a checkpoint
+        // that is due) allow.  With other workers around we also look every so often for whether one has given up
+        deadline = recheck ? get_time_us() : -1;
+        recheck = 0;
+        if (worker->stop != NULL && deadline < 0)
+        {
+            deadline = get_time_us() + STOP_CHECK_INTERVAL;
+        }
+        for (struct connection *conn = worker->connections; conn != NULL; conn = conn->next)
+        {
+            conn_deadline = next_ack_deadline(conn);
+            if (config->listen && (conn_deadline < 0 || conn->last_active + CONN_TIMEOUT < conn_deadline))
+            {
+                conn_deadline = conn->last_active + CONN_TIMEOUT;
+            }
+            if (conn->checkpoint_dirty && (conn_deadline < 0 || conn->next_checkpoint < conn_deadline))
+            {
+                conn_deadline = conn->next_checkpoint;
+            }
+            if (conn_deadline >= 0 && (deadline < 0 || conn_deadline < deadline))
+            {
+                deadline = conn_deadline;
+            }
+        }
+        events = wait_for_events(&loop, deadline);
+        if (events < 0)
+        {
+            fail_worker(worker, errno);
+            break;
+        }
+        long long now = get_time_us();
+        for (struct connection **link = &worker->connections; *link != NULL;)
+        {
+            struct connection *conn = *link;
+            for (int s = 0; s < conn->num_streams; s++)
+            {
+                struct ack_policy *policy = &conn->streams[s].policy;
+                if (policy->num_unacked > 0 && now >= policy->first_unacked_time + policy->ack_delay &&
+                    ack_stream(conn, s, worker->sockfd, worker->trace) < 0)
+                {
+                    fail_worker(worker, errno);
+                }
+            }
+            if (conn->checkpoint_dirty && now >= conn->next_checkpoint)
+            {
+                save_checkpoint(conn);
+                check_connection(worker, conn);
+            }
+            // Dropping connections that have gone quiet, whether or not they finished
+            if (config->listen && now >= conn->last_active + CONN_TIMEOUT)
+            {
+                *link = conn->next;
+                close_connection(worker, conn);
+                continue;
+            }
+            link = &conn->next;
+        }
+        if (events & EVENT_INPUT)
+        {
+            drain_wakeups(worker->writer);
+        }
+        if (worker->writer != NULL && atomic_load(&worker->writer->error))
+        {
+            fail_worker(worker, atomic_load(&worker->writer->error));
+        }
+        if (worker->error != 0)
+        {
+            break;
+        }
+        // Without a writer thread nothing but packets can move a connection on
+        if (!(events & EVENT_SOCKET) && worker->writer == NULL)
+        {
+            continue;
+        }
+        // Processing everything that's arrived since the last ACK
+        num_received = (events & EVENT_SOCKET) ? recv_packets(&batch, worker->sockfd) : 0;
+        if (num_received < 0)
+        {
+            fail_worker(worker, errno);
+            break;
+        }
+        now = get_time_us();
+        for (int i = 0; i < num_received; i++)
+        {
+            // Anything bigger than our buffers was cut short, so it's no use
+            if (batch.msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                continue;
+            }
+            char *buf = batch.buffers + (size_t)i * batch.buffer_size;
+            int len = batch.msgs[i].msg_len;
+            // Splitting coalesced datagrams back into the packets they were sent as
+            int size = segment_size(&batch, i);
+            for (int offset = 0; offset < len; offset += size)
+            {
+                handle_datagram(worker, buf + offset, fmin(size, len - offset), &batch.addrs[i], now);
+            }
+        }
+        for (struct connection *conn = worker->connections; conn != NULL; conn = conn->next)
+        {
+            for (int s = 0; s < conn->num_streams; s++)
+            {
+                struct stream *stream = &conn->streams[s];
+                if (worker->writer != NULL && stream->started)
+                {
+                    resume_stream(conn, stream);
+                    // Telling the client straight away once the writer has made room for a good part of the window
+                    if (window_edge(&stream->window, stream->expected_seq_num) - stream->advertised_edge >= fmax(1, stream->window.capacity / 2))
+                    {
+                        stream->ack_now = 1;
+                    }
+                }
+                if ((stream->ack_now || stream->policy.num_unacked >= stream->policy.ack_every) &&
+                    ack_stream(conn, s, worker->sockfd, worker->trace) < 0)
+                {
+                    fail_worker(worker, errno);
+                }
+            }
+            // Everything has been written, so the file can be closed straight away
+            if (!conn->complete && conn->num_streams > 0 && conn->num_done >= conn->num_streams)
+            {
+                conn->complete = 1;
+                if (conn->fp != NULL)
+                {
+                    flush_connection(conn);
+                    fclose(conn->fp);
+                    conn->fp = NULL;
+                }
+                else if (conn->sink.on_done != NULL)
+                {
+                    conn->sink.on_done(conn->sink.ctx, conn->conn_id, conn->corrupt);
+                }
+                // A finished upload has nothing left to resume
+                if (conn->resumable)
+                {
+                    unlink(conn->checkpoint_name);
+                    conn->checkpoint_dirty = 0;
+                }
+                worker->corrupt |= conn->corrupt;
+                worker->finished = !config->listen;
+            }
+            check_connection(worker, conn);
+        }
+        if (worker->writer != NULL)
+        {
+            // Everything queued while handling the batch goes to the writer in one go
+            kick_writer(worker->writer);
+            for (struct connection *conn = worker->connections; conn != NULL && !recheck; conn = conn->next)
+            {
+                for (int s = 0; s < conn->num_streams && !recheck; s++)
+                {
+                    recheck = waiting_on_writer(&conn->streams[s]);
+                }
+            }
+            // The writer only wakes us once it's written something after we said we're waiting.  If it's already
+            // written everything there's no wakeup coming, so we look again straight away instead
+            if (recheck)
+            {
+                atomic_store(&worker->writer->worker_waiting, 1);
+                recheck = writer_idle(worker->writer);
+            }
+        }
+    }
+    // No shutdown protocol - see https://piazza.com/class/ln0rg59p7g82fk/post/226 -> Not necessary for client to shutdown
+    while (worker->connections != NULL)
+    {
+        struct connection *conn = worker->connections;
+        worker->connections = conn->next;
+        close_connection(worker, conn);
+    }
+    if (worker->writer != NULL)
+    {
+        stop_writer(worker->writer);
+        if (atomic_load(&writer.error))
+        {
+            fail_worker(worker, atomic_load(&writer.error));
+        }
+        worker->writer = NULL;
+    }
+    free_recv_batch(&batch);
+    free_event_loop(&loop);
+    return NULL;
+}
+
+// Function that makes the kernel pick each packet's worker socket from its connection ID, so every packet of a
+// connection reaches the same worker - returns -1 if the kernel doesn't support it
+int steer_by_connection(int sockfd, int num_workers)
+{
+    // The program sees the UDP payload, and loads the connection ID straight from the header - it doesn't matter
+    // which worker a connection goes to as long as it's always the same one
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, CONN_ID_OFFSET},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_workers},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+// Function that prints what the server has received so far - called by the trace flusher once a second with -S,
+// and once more when the server exits
+void print_server_stats(struct tracer *tracer, long long now)
+{
+    double seconds = (now - tracer->start) / 1e6;
+    printf("%.1fs: %lld packets received (%.2fMB, %.2fMbit/s), %lld ACKs sent, %lld datagrams dropped\n", seconds,
+           trace_count(tracer, TRACE_RECV), trace_total(tracer, TRACE_RECV) / 1e6, trace_total(tracer, TRACE_RECV) * 8 / 1e6 / seconds,
+           trace_count(tracer, TRACE_ACK_SENT), trace_count(tracer, TRACE_DROP));
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,2111 @@
+#ifndef SENDER_H
+#define SENDER_H
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "utils.h"
+#include "congestion.h"
+#include "trace.h"
+
+struct sent_packet
+{
+    long long seqnum;
+    unsigned short length;
+    // FLAG_FIN if this is the last packet of a streamed upload - resends have to carry it too
+    unsigned char flags;
+    // Points into the memory mapped file, or into the window's own copy of the payload
+    const char *payload;
+    int resent;
+    int sacked;
+    // Set when a timeout gave up on the packet - it's resent once the window has room for it
+    int lost;
+    long long time_sent;
+    long long deadline;
+};
+
+// Retransmission deadline for one send of a packet
+struct timer_entry
+{
+    long long deadline;
+    long long seqnum;
+};
+
+// Min-heap of retransmission deadlines.  Entries aren't removed when their packet is ACKed or resent - they're
+// discarded once they reach the top and no longer match the packet's current deadline
+struct timer_heap
+{
+    struct timer_entry *entries;
+    int size;
+    int capacity;
+};
+
+// Forward error correction.  New full sized packets are split into blocks, and after each block a parity packet
+// carrying the XOR of their payloads is sent, so the server can rebuild any one packet of the block that's lost
+// without waiting for it to be resent.  The block size follows the loss rate: the more packets are lost, the
+// smaller the blocks and the more parity is sent.  Parity packets are never resent
+struct fec_encoder
+{
+    // The largest block size, the size of the current block and how many packets it has so far
+    int max_block;
+    int block_size;
+    int count;
+    long long first;
+    int payload_size;
+    // Parity is accumulated in one of several buffers, since each has to stay put until its batch is flushed
+    char *parity;
+    int next_buffer;
+    // Decaying counts of the packets sent and lost, for the loss rate
+    double sent;
+    double lost;
+};
+
+// Ring buffer of the packets in flight - packet seqnum always lives in slot seqnum % capacity, so sliding the
+// window forward never moves any data
+struct send_window
+{
+    struct sent_packet *slots;
+    // Payload storage for each slot - NULL when the file is memory mapped and packets point straight into it
+    char *payloads;
+    int capacity;
+    // The connection and stream every packet in the window belongs to, and the packet of the file that stream
+    // starts at
+    unsigned int conn_id;
+    int stream;
+    long long first_packet;
+    int payload_size;
+    // Every hole below this sequence number has already been resent during the current recovery
+    long long holes_resent_to;
+    // Packets from lost_next up to lost_end may be marked lost and still have to be resent.  Duplicate ACKs don't
+    // trigger fast retransmit until everything before lost_end has been ACKed
+    long long lost_next;
+    long long lost_end;
+    // F-RTO (RFC 5682) - set to 1 after a timeout resends the oldest packet, and to 2 once the first ACK after that
+    // has moved the window and two new packets have been sent.  Lost packets are held back until it's over.  If the
+    // next ACK moves the window as well, packets sent before the timeout are still arriving and it was spurious
+    int frto;
+    // The packets that were in flight when the timeout happened are the ones below frto_recover
+    long long frto_recover;
+    // Packets below this sequence number have been read into their slots, whether or not they've been sent yet
+    long long read_ahead;
+    struct timer_heap timers;
+    // NULL unless forward error correction is on - resends are counted as losses
+    struct fec_encoder *fec;
+    // CRC32C of the stream's data read so far, and the payload of the packet that carries it once the data is all
+    // sent
+    uint32_t digest;
+    char digest_payload[DIGEST_SIZE];
+    // The ring this stream traces its events to, or NULL when nothing is traced
+    struct trace_ring *trace;
+    // The errno of the first send or read that failed, or 0 - the stream gives up once it's set
+    int error;
+};
+
+// Compression for an upload sent with -z.  The input is cut into blocks of COMPRESS_BLOCK bytes, each compressed on
+// its own into a record (or stored as it is if it doesn't shrink), and the records are sent one after the other as
+// a streamed upload.  The server decompresses them in order as it writes the file
+struct compressor
+{
+    int level;
+    // The block being read in, and the record it was compressed into, which is sent from record_pos on
+    char *raw;
+    size_t raw_len;
+    char *record;
+    size_t record_len;
+    size_t record_pos;
+    int input_done;
+    // CRC32C of the input read so far - the server checks it against what it decompressed
+    uint32_t digest;
+};
+
+// The file being sent - either read into the send window as we go, or memory mapped so that packets can
+// point straight into it.  Input that isn't a regular file (stdin, a pipe) is streamed: its length isn't known, so
+// it's read in order as it arrives, and the last packet is marked with FLAG_FIN
+struct file_source
+{
+    // fp is NULL when sending a buffer, which is used like a mapping of the file that isn't ours to unmap
+    FILE *fp;
+    const char *map;
+    int mapped;
+    off_t size;
+    // Every packet but the last carries this many bytes of the file
+    int payload_size;
+    int streaming;
+    // Bytes of the next packet already read from a streamed input, and the input's flags before we made it
+    // non-blocking
+    int pending;
+    int saved_flags;
+    // NULL unless the upload is compressed
+    struct compressor *compressor;
+};
+
+// Room for the UDP_SEGMENT control message of one GSO send
+union gso_control
+{
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+};
+
+// Scratch space for sending many packets with a single sendmmsg call.  With GSO, runs of full sized packets are
+// sent as one message that the kernel splits back into segments, so a message can span several packets' iovecs
+struct send_batch
+{
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iovs[MAX_BATCH][2];
+    char headers[MAX_BATCH][HEADER_SIZE];
+    union gso_control controls[MAX_BATCH];
+    // Packets and messages in the batch
+    int count;
+    int num_msgs;
+    // The most packets one message can carry (1 without GSO), and the wire size of a full packet
+    int max_segments;
+    int segment_size;
+    // Packets in the last message, and whether it can still take more
+    int open_segments;
+    int open_full;
+};
+
+// RFC 6298 round trip time estimator - every value is in microseconds
+struct rtt_estimator
+{
+    long long srtt;
+    long long rttvar;
+    long long rto;
+    long long last_backoff;
+    int has_sample;
+    // The most recent sample, for the congestion controller
+    long long latest;
+};
+
+// One stream of the file - its own range of packets, sequence numbers, congestion state and thread
+struct flow
+{
+    unsigned int conn_id;
+    int stream;
+    int num_streams;
+    long long first_packet;
+    // UNKNOWN_LENGTH when streaming, until the input ends
+    long long num_packets;
+    // The packet count of the whole file, which is what the handshake carries
+    long long total_packets;
+    struct file_source *src;
+    const char *cc_name;
+    int window_size;
+    // The most packets one GSO send can carry, or 1 without GSO
+    int max_segments;
+    // The largest forward error correction block, or 0 to send no parity
+    int fec_block;
+    // Set when the server should pick the upload up from wherever it got to before, with the key it knows the
+    // file by
+    int resume;
+    unsigned long long resume_key;
+    struct sockaddr_in *server_addr;
+    // Packets are sent on data_fd and ACKs are read from ack_fd.  With several streams the ACKs are relayed to
+    // ack_fd through relay_fd, otherwise both are the UDP socket
+    int data_fd;
+    int ack_fd;
+    int relay_fd;
+    // Set once the relay has passed on the stream's final ACK, or by the stream if the server never answered its
+    // handshake
+    int done;
+    // Set when the stream gave up, with why in error - ETIMEDOUT if the server never answered
+    _Atomic int failed;
+    int error;
+    // The ring the stream traces its events to, or NULL when nothing is traced
+    struct trace_ring *trace;
+    pthread_t thread;
+};
+
+// Function that sets up a stream's window - returns -1 if it can't be allocated
+int init_send_window(
+    struct send_window *window,
+    int capacity,
+    int copy_payloads,
+    unsigned int conn_id,
+    int stream,
+    long long first_packet,
+    int payload_size)
+{
+    window->slots = calloc(capacity, sizeof(struct sent_packet));
+    window->payloads = copy_payloads ? malloc((size_t)capacity * payload_size) : NULL;
+    window->timers.capacity = 2 * capacity;
+    window->timers.entries = malloc(window->timers.capacity * sizeof(struct timer_entry));
+    if (window->slots == NULL || window->timers.entries == NULL || (copy_payloads && window->payloads == NULL))
+    {
+        perror("Could not allocate send window");
+        free(window->slots);
+        free(window->payloads);
+        free(window->timers.entries);
+        return -1;
+    }
+    window->capacity = capacity;
+    window->conn_id = conn_id;
+    window->stream = stream;
+    window->first_packet = first_packet;
+    window->payload_size = payload_size;
+    window->holes_resent_to = 0;
+    window->lost_next = 0;
+    window->lost_end = 0;
+    window->frto = 0;
+    window->frto_recover = 0;
+    window->read_ahead = 0;
+    window->timers.size = 0;
+    window->fec = NULL;
+    window->digest = 0;
+    window->trace = NULL;
+    window->error = 0;
+    return 0;
+}
+
+void free_send_window(struct send_window *window)
+{
+    free(window->slots);
+    free(window->payloads);
+    free(window->timers.entries);
+}
+
+// Utility function to get the slot a packet is buffered in
+struct sent_packet *window_slot(struct send_window *window, long long seqnum)
+{
+    return &window->slots[seqnum % window->capacity];
+}
+
+// Function that records why a stream has to give up, from errno - only the first error is kept, since anything
+// after it usually follows from it
+void fail_window(struct send_window *window)
+{
+    if (window->error == 0)
+    {
+        window->error = errno != 0 ? errno : EIO;
+    }
+}
+
+// Function that adds a retransmission timer - returns -1 if the heap is full and can't grow, leaving it as it was
+int push_timer(struct timer_heap *heap, long long deadline, long long seqnum)
+{
+    if (heap->size == heap->capacity)
+    {
+        struct timer_entry *entries = realloc(heap->entries, 2 * heap->capacity * sizeof(struct timer_entry));
+        if (entries == NULL)
+        {
+            perror("Could not grow timer heap");
+            return -1;
+        }
+        heap->entries = entries;
+        heap->capacity *= 2;
+    }
+    // Sifting the new entry up to its place
+    int ind = heap->size++;
+    while (ind > 0 && heap->entries[(ind - 1) / 2].deadline > deadline)
+    {
+        heap->entries[ind] = heap->entries[(ind - 1) / 2];
+        ind = (ind - 1) / 2;
+    }
+    heap->entries[ind].deadline = deadline;
+    heap->entries[ind].seqnum = seqnum;
+    return 0;
+}
+
+void pop_timer(struct timer_heap *heap)
+{
+    struct timer_entry last = heap->entries[--heap->size];
+    // Sifting the last entry down from the top
+    int ind = 0;
+    while (2 * ind + 1 < heap->size)
+    {
+        int child = 2 * ind + 1;
+        if (child + 1 < heap->size && heap->entries[child + 1].deadline < heap->entries[child].deadline)
+        {
+            child++;
+        }
+        if (heap->entries[child].deadline >= last.deadline)
+        {
+            break;
+        }
+        heap->entries[ind] = heap->entries[child];
+        ind = child;
+    }
+    heap->entries[ind] = last;
+}
+
+// Function that sends a whole packet - only the header and the length bytes of payload go over the wire.  Returns -1
+// if it couldn't be sent
+int serve_packet(struct packet *pkt, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    char header[HANDSHAKE_HEADER_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    iov[0].iov_base = header;
+    iov[0].iov_len = write_header(header, pkt->flags, pkt->stream, pkt->num_streams, pkt->conn_id, pkt->seqnum, pkt->payload_size, pkt->payload, pkt->length);
+    iov[1].iov_base = pkt->payload;
+    iov[1].iov_len = pkt->length;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr_size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    int bytes_sent = send_message(sockfd, &msg);
+    if (bytes_sent < 0)
+    {
+        perror("Error sending packet");
+        return -1;
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printSend(pkt, 0);
+    }
+    */
+    return 0;
+}
+
+// Function that fills in a message made of a packet's header followed by a payload stored elsewhere
+void build_segment_msg(
+    struct msghdr *msg,
+    struct iovec *iov,
+    char *header,
+    unsigned int conn_id,
+    int stream,
+    long long seqnum,
+    unsigned char flags,
+    unsigned short length,
+    const char *payload,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    // Only handshakes carry the number of streams and the payload size
+    iov[0].iov_base = header;
+    iov[0].iov_len = write_header(header, flags, stream, 0, conn_id, seqnum, 0, payload, length);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = length;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = addr;
+    msg->msg_namelen = addr_size;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 2;
+}
+
+// Function that sends a packet's header followed by a payload stored elsewhere, without copying the payload -
+// returns -1 if it couldn't be sent
+int serve_segment(unsigned int conn_id, int stream, long long seqnum, unsigned char flags, unsigned short length, const char *payload, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    char header[HEADER_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    build_segment_msg(&msg, iov, header, conn_id, stream, seqnum, flags, length, payload, addr, addr_size);
+    int bytes_sent = send_message(sockfd, &msg);
+    if (bytes_sent < 0)
+    {
+        perror("Error sending packet");
+        return -1;
+    }
+    return 0;
+}
+
+// Function that sends every packet in the batch, using as few sendmmsg calls as the kernel allows.  The batch is
+// emptied either way - returns -1 if the packets couldn't all be sent
+int flush_batch(struct send_batch *batch, int sockfd)
+{
+    int num_sent = 0;
+    int result = 0;
+    while (num_sent < batch->num_msgs)
+    {
+        int sent = send_datagrams(sockfd, &batch->msgs[num_sent], batch->num_msgs - num_sent);
+        if (sent < 0)
+        {
+            perror("Error sending packets");
+            result = -1;
+            break;
+        }
+        num_sent += sent;
+    }
+    batch->count = 0;
+    batch->num_msgs = 0;
+    batch->open_full = 0;
+    return result;
+}
+
+// Function that sets up an empty batch - max_segments above 1 turns on GSO, with every full packet segment_size
+// bytes on the wire
+void init_send_batch(struct send_batch *batch, int max_segments, int segment_size)
+{
+    batch->count = 0;
+    batch->num_msgs = 0;
+    batch->max_segments = max_segments;
+    batch->segment_size = segment_size;
+    batch->open_segments = 0;
+    batch->open_full = 0;
+}
+
+// Function that adds a packet to the batch, flushing the batch first if it's full.  With GSO, a packet joins the
+// last message if every packet already in it is full sized - only the last segment of a GSO send may be short.
+// Returns -1 if flushing the batch failed, though the packet is still added
+int batch_segment(
+    struct send_batch *batch,
+    unsigned int conn_id,
+    int stream,
+    long long seqnum,
+    unsigned char flags,
+    unsigned short length,
+    const char *payload,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    int result = 0;
+    if (batch->count == MAX_BATCH)
+    {
+        result = flush_batch(batch, sockfd);
+    }
+    int ind = batch->count++;
+    struct msghdr *msg;
+    if (batch->open_full && batch->open_segments < batch->max_segments)
+    {
+        // The packet's iovecs directly follow the message's, so the message just gets longer
+        msg = &batch->msgs[batch->num_msgs - 1].msg_hdr;
+        write_header(batch->headers[ind], flags, stream, 0, conn_id, seqnum, 0, payload, length);
+        batch->iovs[ind][0].iov_base = batch->headers[ind];
+        batch->iovs[ind][0].iov_len = HEADER_SIZE;
+        batch->iovs[ind][1].iov_base = (void *)payload;
+        batch->iovs[ind][1].iov_len = length;
+        msg->msg_iovlen += 2;
+        batch->open_segments++;
+    }
+    else
+    {
+        msg = &batch->msgs[batch->num_msgs++].msg_hdr;
+        build_segment_msg(msg, batch->iovs[ind], batch->headers[ind], conn_id, stream, seqnum, flags, length, payload, addr, addr_size);
+        if (batch->max_segments > 1)
+        {
+            // Telling the kernel where to split the message - a message no longer than this goes out as it is
+            union gso_control *control = &batch->controls[batch->num_msgs - 1];
+            msg->msg_control = control->buf;
+            msg->msg_controllen = sizeof(control->buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment_size = batch->segment_size;
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+        batch->open_segments = 1;
+    }
+    batch->open_full = batch->max_segments > 1 && HEADER_SIZE + length == batch->segment_size;
+    return result;
+}
+
+int send_handshake(long long file_size, struct packet *pkt, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    // Setting the sequence number to the file size
+    pkt->seqnum = file_size;
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("Sending handshake: ");
+    }
+    */
+    return serve_packet(pkt, sockfd, addr, addr_size);
+}
+
+// Function that receives an ACK for our connection without blocking - ACKs for any other connection are skipped.
+// Returns the ACK number, -1 on failure, or -2 if there are no more ACKs waiting
+long long recv_ack(struct ack *ack, unsigned int conn_id, int sockfd, struct sockaddr_in *addr, socklen_t addr_size)
+{
+    char buf[MAX_ACK_SIZE];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct mmsghdr msg;
+    int num_received;
+    do
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_hdr.msg_name = addr;
+        msg.msg_hdr.msg_namelen = addr_size;
+        msg.msg_hdr.msg_iov = &iov;
+        msg.msg_hdr.msg_iovlen = 1;
+        num_received = recv_datagrams(sockfd, &msg, 1);
+    } while (num_received > 0 && (read_ack(buf, msg.msg_len, ack) < 0 || ack->conn_id != conn_id));
+    if (num_received < 0)
+    {
+        if (errno == EWOULDBLOCK || errno == EAGAIN)
+        {
+            // Nothing left to read, return -2 to deal with it in the main
+            /*
+            if (PRINT_STATEMENTS)
+            {
+                printf("No message received.\n");
+            }
+            */
+            return -2;
+        }
+        else
+        {
+            perror("Recvfrom failed");
+            return -1;
+        }
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("ACK %lld\n", ack->acknum);
+    }
+    */
+    return ack->acknum;
+}
+
+// Function that sets up sending whatever fp reads, memory mapping it if requested.  A compression level above 0
+// compresses the upload, which is then streamed since its compressed size isn't known, and so is anything that
+// isn't a regular file.  Returns -1 on failure
+int init_file_source(struct file_source *src, FILE *fp, int use_mmap, int compress_level)
+{
+    struct stat st;
+    src->fp = fp;
+    src->map = NULL;
+    src->mapped = 0;
+    src->pending = 0;
+    src->saved_flags = -1;
+    src->compressor = NULL;
+    if (src->fp == NULL || fstat(fileno(src->fp), &st) < 0)
+    {
+        return -1;
+    }
+    src->size = st.st_size;
+    src->streaming = !S_ISREG(st.st_mode) || compress_level > 0;
+    if (compress_level > 0)
+    {
+        src->compressor = calloc(1, sizeof(struct compressor));
+        if (src->compressor == NULL)
+        {
+            return -1;
+        }
+        src->compressor->level = compress_level;
+        src->compressor->raw = malloc(COMPRESS_BLOCK);
+        src->compressor->record = malloc(RECORD_HEADER_SIZE + compressBound(COMPRESS_BLOCK));
+        if (src->compressor->raw == NULL || src->compressor->record == NULL)
+        {
+            return -1;
+        }
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        // We can't wait on the input and the socket at once if reading blocks
+        src->saved_flags = fcntl(fileno(src->fp), F_GETFL);
+        if (src->saved_flags < 0 || fcntl(fileno(src->fp), F_SETFL, src->saved_flags | O_NONBLOCK) < 0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+    if (use_mmap && !src->streaming && src->size > 0)
+    {
+        void *map = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fileno(src->fp), 0);
+        if (map == MAP_FAILED)
+        {
+            return -1;
+        }
+        madvise(map, src->size, MADV_SEQUENTIAL);
+        src->map = map;
+        src->mapped = 1;
+    }
+    return 0;
+}
+
+// Function that sets up sending a buffer already in memory, which is sent straight from where it is like a memory
+// mapped file - the buffer has to stay put until the upload is done
+void init_buffer_source(struct file_source *src, const char *data, size_t len)
+{
+    memset(src, 0, sizeof(*src));
+    src->map = data;
+    src->size = len;
+    src->saved_flags = -1;
+}
+
+// Function that works out the key a resumed upload is known by - a hash of the file's full path, size and
+// modification time, so the server only carries on with an upload of the same file that hasn't changed since.
+// Returns -1 if the file can't be found
+int file_resume_key(const char *filename, unsigned long long *key)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if (realpath(filename, path) == NULL || stat(path, &st) < 0)
+    {
+        return -1;
+    }
+    long long fields[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    // 64 bit FNV-1a over the path and then the fields
+    *key = 14695981039346656037ULL;
+    for (size_t i = 0; path[i] != '\0'; i++)
+    {
+        *key = (*key ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < sizeof(fields); i++)
+    {
+        *key = (*key ^ ((unsigned char *)fields)[i]) * 1099511628211ULL;
+    }
+    return 0;
+}
+
+void close_file_source(struct file_source *src)
+{
+    if (src->mapped)
+    {
+        munmap((void *)src->map, src->size);
+    }
+    // The input may be shared with whoever started us, so it's left the way we found it
+    if (src->saved_flags >= 0)
+    {
+        fcntl(fileno(src->fp), F_SETFL, src->saved_flags);
+    }
+    if (src->compressor != NULL)
+    {
+        free(src->compressor->raw);
+        free(src->compressor->record);
+        free(src->compressor);
+    }
+    if (src->fp != NULL)
+    {
+        fclose(src->fp);
+    }
+}
+
+// Function that opens the file to send - "-" is stdin.  Returns -1 on failure
+int open_file_source(struct file_source *src, const char *filename, int use_mmap, int compress_level)
+{
+    FILE *fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (init_file_source(src, fp, use_mmap, compress_level) < 0)
+    {
+        // Keeping the reason it failed for the caller's perror
+        int saved_errno = errno;
+        close_file_source(src);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Utility function to get the length of packet packet_num of the file - only the last one is short
+int packet_length(struct file_source *src, long long packet_num)
+{
+    off_t offset = (off_t)packet_num * src->payload_size;
+    return offset >= src->size ? 0 : fmin(src->payload_size, src->size - offset);
+}
+
+// Function that gets the payload of packet packet_num of the file - a pointer into the mapping if the file is
+// memory mapped, otherwise it's read into buf.  Every stream reads its own part of the file at the same time, so
+// reads are positional.  Returns the payload length, or -1 if the file couldn't be read
+int read_file_and_create_packet(struct file_source *src, long long packet_num, char *buf, const char **payload)
+{
+    off_t offset = (off_t)packet_num * src->payload_size;
+    int length = packet_length(src, packet_num);
+    if (src->map != NULL)
+    {
+        *payload = src->map + offset;
+        return length;
+    }
+    // Read in the file
+    int bytes_read = pread(fileno(src->fp), buf, length, offset);
+    if (bytes_read < 0)
+    {
+        perror("Error reading file");
+        return -1;
+    }
+    *payload = buf;
+    return bytes_read;
+}
+
+// Function that compresses the block that's been read in into the next record, or stores it if it doesn't shrink
+void compress_block(struct compressor *comp)
+{
+    uLongf stored_len = compressBound(COMPRESS_BLOCK);
+    char method = RECORD_ZLIB;
+    if (compress2((Bytef *)comp->record + RECORD_HEADER_SIZE, &stored_len, (const Bytef *)comp->raw, comp->raw_len, comp->level) != Z_OK ||
+        stored_len >= comp->raw_len)
+    {
+        method = RECORD_STORED;
+        memcpy(comp->record + RECORD_HEADER_SIZE, comp->raw, comp->raw_len);
+        stored_len = comp->raw_len;
+    }
+    comp->record[0] = method;
+    put_u32(comp->record + 1, comp->raw_len);
+    put_u32(comp->record + 5, stored_len);
+    comp->record_len = RECORD_HEADER_SIZE + stored_len;
+    comp->record_pos = 0;
+    comp->digest = crc32c(comp->digest, comp->raw, comp->raw_len);
+    comp->raw_len = 0;
+}
+
+// Function that reads up to len bytes of the stream of compressed records, the way read does - returns 0 once the
+// input has ended and every record has been read, or -1 with errno set if the input has nothing more for us yet
+ssize_t read_compressed(struct file_source *src, char *buf, size_t len)
+{
+    struct compressor *comp = src->compressor;
+    while (comp->record_pos == comp->record_len)
+    {
+        if (comp->input_done)
+        {
+            return 0;
+        }
+        // Reading in the rest of the next block - it's only compressed once it's full or the input ends
+        while (comp->raw_len < COMPRESS_BLOCK)
+        {
+            ssize_t bytes_read = read(fileno(src->fp), comp->raw + comp->raw_len, COMPRESS_BLOCK - comp->raw_len);
+            if (bytes_read == 0)
+            {
+                comp->input_done = 1;
+                break;
+            }
+            if (bytes_read < 0)
+            {
+                return -1;
+            }
+            comp->raw_len += bytes_read;
+        }
+        if (comp->raw_len > 0)
+        {
+            compress_block(comp);
+        }
+    }
+    size_t num_bytes = fmin(len, comp->record_len - comp->record_pos);
+    memcpy(buf, comp->record + comp->record_pos, num_bytes);
+    comp->record_pos += num_bytes;
+    return num_bytes;
+}
+
+// Function that reads the next packet of a streamed input into buf, carrying on from wherever the last call got
+// to - returns the payload length once the packet is full or the input has ended, -1 if there's nothing more to
+// read yet, or -2 if the input couldn't be read.  The packet the input ends on is always short (possibly empty), so
+// a full packet is never the last
+int read_stream_packet(struct file_source *src, char *buf)
+{
+    while (src->pending < src->payload_size)
+    {
+        size_t len = src->payload_size - src->pending;
+        ssize_t bytes_read = src->compressor != NULL ? read_compressed(src, buf + src->pending, len) : read(fileno(src->fp), buf + src->pending, len);
+        if (bytes_read == 0)
+        {
+            break;
+        }
+        if (bytes_read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return -1;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error reading input");
+            return -2;
+        }
+        src->pending += bytes_read;
+    }
+    int length = src->pending;
+    src->pending = 0;
+    return length;
+}
+
+// Utility function to get the storage a packet's payload is read into when the file isn't memory mapped
+char *window_payload(struct send_window *window, long long seqnum)
+{
+    if (window->payloads == NULL)
+    {
+        return NULL;
+    }
+    return window->payloads + (size_t)(seqnum % window->capacity) * window->payload_size;
+}
+
+// Function that will buffer sent packets for us
+int buffer_packet(long long seqnum, unsigned short length, unsigned char flags, const char *payload, struct send_window *window, long long ack_num, long long rto)
+{
+    long long ind = seqnum - ack_num;
+    if (ind < 0)
+    {
+        printf("Already received ACK up to packet %lld, which occurs after packet %lld\n", ack_num, seqnum);
+        return -1;
+    }
+    if (ind >= window->capacity)
+    {
+        printf("Exceeded maximum window size with packet %lld while waiting for ack for %lld\n", seqnum, ack_num);
+        return -1;
+    }
+    struct sent_packet *sent = window_slot(window, seqnum);
+    sent->seqnum = seqnum;
+    sent->length = length;
+    sent->flags = flags;
+    sent->payload = payload;
+    sent->resent = 0;
+    sent->sacked = 0;
+    sent->lost = 0;
+    sent->time_sent = get_time_us();
+    sent->deadline = sent->time_sent + rto;
+    if (push_timer(&window->timers, sent->deadline, seqnum) < 0)
+    {
+        fail_window(window);
+    }
+    // printf("Buffered packet %d\n", seqnum);
+    return ind;
+}
+
+// Function that handles moving the window forward upon receiving an ACK - the ACKed slots are simply reused
+long long handle_ack(struct send_window *window, long long old_ack, long long new_ack, long long seq_num)
+{
+    long long num_pkt_recv = new_ack - old_ack;
+    // Several ACKs can be handled before sending again, so everything sent may already be ACKed
+    if (old_ack < seq_num && old_ack != window_slot(window, old_ack)->seqnum)
+    {
+        printf("ERROR: old_ack %lld does not match buffered packet %lld\n", old_ack, window_slot(window, old_ack)->seqnum);
+        errno = EPROTO;
+        fail_window(window);
+        return old_ack;
+    }
+    if (num_pkt_recv <= 0)
+    {
+        /*
+        if (PRINT_STATEMENTS)
+        {
+            printf("Received old ACK for %lld - currently on %lld\n", new_ack, old_ack);
+        }
+        */
+        return old_ack;
+    }
+    if (new_ack > seq_num)
+    {
+        printf("Received ACK %lld for packets that haven't been sent yet\n", new_ack);
+        return old_ack;
+    }
+    /*
+    if (PRINT_STATEMENTS)
+    {
+        printf("Moved buffer forward %lld packets\n", num_pkt_recv);
+    }
+    */
+    return new_ack;
+}
+
+// Function that marks a packet as resent once it's been sent again, and restarts its retransmission timer
+void mark_resent(struct send_window *window, struct sent_packet *sent, long long rto)
+{
+    trace_event(window->trace, TRACE_RESEND, window->stream, sent->seqnum, sent->length, 0);
+    sent->resent = 1;
+    sent->lost = 0;
+    sent->time_sent = get_time_us();
+    sent->deadline = sent->time_sent + rto;
+    if (push_timer(&window->timers, sent->deadline, sent->seqnum) < 0)
+    {
+        fail_window(window);
+    }
+    if (window->fec != NULL)
+    {
+        window->fec->lost++;
+    }
+}
+
+// Function that resends a packet straight away
+void resend_packet(
+    struct send_window *window,
+    long long packet_num,
+    long long ack_num,
+    long long rto,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    long long ind = packet_num - ack_num;
+    if (ind < 0 || ind >= window->capacity)
+    {
+        printf("Can't resend packet %lld - not currently buffered", packet_num);
+        return;
+    }
+    struct sent_packet *sent = window_slot(window, packet_num);
+    if (serve_segment(window->conn_id, window->stream, sent->seqnum, sent->flags, sent->length, sent->payload, sockfd, addr, addr_size) < 0)
+    {
+        fail_window(window);
+        return;
+    }
+    mark_resent(window, sent, rto);
+}
+
+// Function that gives up on a packet whose retransmission deadline has passed.  Its timer no longer matches, so
+// it's discarded, and the packet is resent by send_unsent_packets once the window has room
+void mark_lost(struct send_window *window, long long seqnum)
+{
+    struct sent_packet *sent = window_slot(window, seqnum);
+    sent->lost = 1;
+    sent->deadline = -1;
+    if (window->lost_next >= window->lost_end)
+    {
+        window->lost_next = seqnum;
+        window->lost_end = seqnum + 1;
+    }
+    else
+    {
+        window->lost_next = seqnum < window->lost_next ? seqnum : window->lost_next;
+        window->lost_end = seqnum >= window->lost_end ? seqnum + 1 : window->lost_end;
+    }
+}
+
+// Function that sets up forward error correction for a stream - returns -1 if its buffers can't be allocated
+int init_fec_encoder(struct fec_encoder *fec, int max_block, int payload_size)
+{
+    fec->parity = malloc((size_t)FEC_BUFFERS * payload_size);
+    if (fec->parity == NULL)
+    {
+        perror("Could not allocate parity buffers");
+        return -1;
+    }
+    fec->max_block = max_block;
+    fec->block_size = max_block;
+    fec->count = 0;
+    fec->first = 0;
+    fec->payload_size = payload_size;
+    fec->next_buffer = 0;
+    fec->sent = 0;
+    fec->lost = 0;
+    return 0;
+}
+
+void free_fec_encoder(struct fec_encoder *fec)
+{
+    free(fec->parity);
+}
+
+// Function that picks the size of the next block - big enough that FEC_TARGET_LOSSES of its packets are expected
+// to be lost, so that most blocks lose no more than the one packet the parity can rebuild
+int fec_block_size(struct fec_encoder *fec)
+{
+    if (fec->lost <= 0)
+    {
+        return fec->max_block;
+    }
+    return fmax(FEC_MIN_BLOCK, fmin(fec->max_block, FEC_TARGET_LOSSES * fec->sent / fec->lost));
+}
+
+// Function that queues the parity of the current block, if it has any packets, and starts a new block
+void fec_flush(
+    struct fec_encoder *fec,
+    struct send_window *window,
+    struct send_batch *batch,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    if (fec->count == 0)
+    {
+        return;
+    }
+    char *parity = fec->parity + (size_t)fec->next_buffer * fec->payload_size;
+    if (batch_segment(batch, window->conn_id, window->stream, fec->first, FLAG_PARITY, fec->payload_size, parity, sockfd, addr, addr_size) < 0)
+    {
+        fail_window(window);
+    }
+    // The block size goes where handshakes put the number of streams
+    write_header(batch->headers[batch->count - 1], FLAG_PARITY, window->stream, fec->count, window->conn_id, fec->first, 0, parity, fec->payload_size);
+    fec->count = 0;
+    fec->next_buffer = (fec->next_buffer + 1) % FEC_BUFFERS;
+    // Every buffer may now be waiting in the batch, so it has to go before the first one is reused
+    if (fec->next_buffer == 0 && flush_batch(batch, sockfd) < 0)
+    {
+        fail_window(window);
+    }
+}
+
+// Function that adds a new packet to the current block, queueing the block's parity once it's complete.  Only full
+// sized packets are covered, so a short packet (the last of the file) ends the block early
+void fec_add_packet(
+    struct fec_encoder *fec,
+    long long seqnum,
+    unsigned short length,
+    const char *payload,
+    struct send_window *window,
+    struct send_batch *batch,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    // Halving both counts now and then, so the loss rate follows recent packets
+    if (++fec->sent >= FEC_LOSS_WINDOW)
+    {
+        fec->sent /= 2;
+        fec->lost /= 2;
+    }
+    if (length != fec->payload_size)
+    {
+        fec_flush(fec, window, batch, sockfd, addr, addr_size);
+        return;
+    }
+    char *parity = fec->parity + (size_t)fec->next_buffer * fec->payload_size;
+    if (fec->count == 0)
+    {
+        fec->first = seqnum;
+        fec->block_size = fec_block_size(fec);
+        memcpy(parity, payload, length);
+    }
+    else
+    {
+        for (int i = 0; i < length; i++)
+        {
+            parity[i] ^= payload[i];
+        }
+    }
+    if (++fec->count == fec->block_size)
+    {
+        fec_flush(fec, window, batch, sockfd, addr, addr_size);
+    }
+}
+
+// Function that computes the RTO from the estimator as in RFC 6298, dropping any backoff.  It's also called when an
+// ACK moves the window without giving a sample (it covers a resent packet), since the path is delivering again
+void reset_rto(struct rtt_estimator *est)
+{
+    if (est->has_sample)
+    {
+        est->rto = est->srtt + fmax(CLOCK_GRANULARITY, 4 * est->rttvar);
+        est->rto = fmin(fmax(est->rto, MIN_RTO), MAX_RTO);
+    }
+}
+
+// Function that folds a new RTT sample into the estimator and recomputes the RTO
+void update_est_rtt(struct rtt_estimator *est, long long sample_rtt)
+{
+    if (!est->has_sample)
+    {
+        est->srtt = sample_rtt;
+        est->rttvar = sample_rtt / 2;
+        est->has_sample = 1;
+    }
+    else
+    {
+        // The deviation has to be updated with the old smoothed RTT
+        est->rttvar = (1.0 - BETA) * est->rttvar + BETA * llabs(est->srtt - sample_rtt);
+        est->srtt = (1.0 - ALPHA) * est->srtt + ALPHA * sample_rtt;
+    }
+    est->latest = sample_rtt;
+    reset_rto(est);
+}
+
+// Function that doubles the RTO after a retransmission timeout - returns 0 without backing off if the last
+// backoff was less than an RTO ago, since deadlines expiring that close together are part of the same loss event
+int backoff_rto(struct rtt_estimator *est)
+{
+    long long now = get_time_us();
+    if (now - est->last_backoff < est->rto)
+    {
+        return 0;
+    }
+    est->rto = fmin(est->rto * 2, MAX_RTO);
+    est->last_backoff = now;
+    return 1;
+}
+
+// Function that takes an RTT sample from a packet the moment it's first ACKed or SACKed.  Following Karn's
+// rule, packets that have been resent are never sampled, since we can't tell which copy was ACKed
+void take_rtt_sample(struct rtt_estimator *est, struct sent_packet *sent)
+{
+    if (!sent->resent)
+    {
+        update_est_rtt(est, get_time_us() - sent->time_sent);
+    }
+}
+
+// Function that samples the newest packet a cumulative ACK covers which wasn't already SACKed - older
+// packets may have been held at the server behind a hole, which would inflate the sample.  If the ACK also covers a
+// resent packet nothing is sampled, since it may have been the resend filling a hole that let the ACK move
+void sample_rtt(struct rtt_estimator *est, struct send_window *window, long long old_ack, long long new_ack)
+{
+    struct sent_packet *newest = NULL;
+    if (new_ack - old_ack > window->capacity)
+    {
+        return;
+    }
+    for (long long seq = new_ack - 1; seq >= old_ack; seq--)
+    {
+        struct sent_packet *sent = window_slot(window, seq);
+        if (sent->resent)
+        {
+            return;
+        }
+        if (newest == NULL && !sent->sacked)
+        {
+            newest = sent;
+        }
+    }
+    if (newest != NULL)
+    {
+        take_rtt_sample(est, newest);
+    }
+}
+
+// Function that marks every buffered packet covered by the ACK's SACK blocks and counts the ones that weren't
+// SACKed before - returns the sequence number just past the highest SACKed packet, or ack_num if nothing beyond
+// the cumulative ACK has been received
+long long mark_sacked(
+    struct send_window *window,
+    struct ack *ack,
+    long long ack_num,
+    long long seq_num,
+    struct rtt_estimator *est,
+    int *num_newly_sacked)
+{
+    long long highest_sacked = ack_num;
+    *num_newly_sacked = 0;
+    struct sent_packet *newest_sacked = NULL;
+    for (int i = 0; i < ack->num_sacks; i++)
+    {
+        // Clamping the block to the packets we actually have buffered
+        long long start = ack->sacks[i].start > ack_num ? ack->sacks[i].start : ack_num;
+        long long end = ack->sacks[i].end < seq_num ? ack->sacks[i].end : seq_num;
+        for (long long seq = start; seq < end; seq++)
+        {
+            struct sent_packet *sent = window_slot(window, seq);
+            if (sent->sacked)
+            {
+                continue;
+            }
+            if (newest_sacked == NULL || sent->seqnum > newest_sacked->seqnum)
+            {
+                newest_sacked = sent;
+            }
+            sent->sacked = 1;
+            (*num_newly_sacked)++;
+        }
+        if (end > highest_sacked)
+        {
+            highest_sacked = end;
+        }
+    }
+    if (newest_sacked != NULL)
+    {
+        take_rtt_sample(est, newest_sacked);
+    }
+    return highest_sacked;
+}
+
+// Function that counts the SACKed packets from ack_num up to highest_sacked
+int count_sacked(struct send_window *window, long long ack_num, long long highest_sacked)
+{
+    int sacked = 0;
+    for (long long seq = ack_num; seq < highest_sacked; seq++)
+    {
+        sacked += window_slot(window, seq)->sacked;
+    }
+    return sacked;
+}
+
+// Function that counts the newly ACKed packets that hadn't already been SACKed
+int count_delivered(struct send_window *window, long long old_ack, long long new_ack)
+{
+    int delivered = 0;
+    for (long long seq = old_ack; seq < new_ack; seq++)
+    {
+        delivered += !window_slot(window, seq)->sacked;
+    }
+    return delivered;
+}
+
+// Function that resends every packet in the holes below the highest SACKed packet that hasn't already been resent.
+// Only the holes revealed since the last call are scanned - a resent hole that's lost again is left to its timer
+void resend_holes(
+    struct send_window *window,
+    long long ack_num,
+    long long highest_sacked,
+    long long rto,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    for (long long seq = ack_num > window->holes_resent_to ? ack_num : window->holes_resent_to; seq < highest_sacked; seq++)
+    {
+        struct sent_packet *sent = window_slot(window, seq);
+        if (!sent->sacked && !sent->resent)
+        {
+            resend_packet(window, seq, ack_num, rto, sockfd, addr, addr_size);
+        }
+    }
+    if (highest_sacked > window->holes_resent_to)
+    {
+        window->holes_resent_to = highest_sacked;
+    }
+}
+
+// Utility function to check whether a timer still belongs to an unSACKed packet in flight
+int timer_is_live(struct send_window *window, struct timer_entry *timer, long long ack_num, long long seq_num)
+{
+    if (timer->seqnum < ack_num || timer->seqnum >= seq_num)
+    {
+        return 0;
+    }
+    struct sent_packet *sent = window_slot(window, timer->seqnum);
+    return !sent->sacked && sent->deadline == timer->deadline;
+}
+
+// Function that returns the earliest retransmission deadline of the unSACKed packets in flight
+long long earliest_deadline(struct send_window *window, long long ack_num, long long seq_num)
+{
+    struct timer_heap *heap = &window->timers;
+    // Discarding the timers of packets that have been ACKed, SACKed or resent since
+    while (heap->size > 0 && !timer_is_live(window, &heap->entries[0], ack_num, seq_num))
+    {
+        pop_timer(heap);
+    }
+    return heap->size > 0 ? heap->entries[0].deadline : -1;
+}
+
+// Function that handles every retransmission deadline that has passed.  On a new timeout only the oldest unACKed
+// packet is resent straight away - every other packet whose deadline has passed is marked lost, and left to the
+// window and the pacer, since a timeout leaves the window at a single packet
+void expire_packets(
+    struct send_window *window,
+    long long ack_num,
+    long long seq_num,
+    int timed_out,
+    long long rto,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    struct timer_heap *heap = &window->timers;
+    long long now = get_time_us();
+    while (heap->size > 0 && heap->entries[0].deadline <= now)
+    {
+        struct timer_entry timer = heap->entries[0];
+        pop_timer(heap);
+        if (timer_is_live(window, &timer, ack_num, seq_num) && !(timed_out && timer.seqnum == ack_num))
+        {
+            mark_lost(window, timer.seqnum);
+        }
+    }
+    if (timed_out)
+    {
+        resend_packet(window, ack_num, ack_num, rto, sockfd, addr, addr_size);
+    }
+}
+
+// Function that counts the packets in flight - sent, and neither SACKed nor given up on as lost
+int count_in_flight(struct send_window *window, long long ack_num, long long seq_num)
+{
+    int in_flight = 0;
+    for (long long seq = ack_num; seq < seq_num; seq++)
+    {
+        struct sent_packet *sent = window_slot(window, seq);
+        in_flight += !sent->sacked && !sent->lost;
+    }
+    return in_flight;
+}
+
+// Utility function to check whether there are lost packets waiting to be resent that the window has room for
+int lost_ready(struct send_window *window, int cwnd, long long ack_num, long long seq_num)
+{
+    return !window->frto && window->lost_next < window->lost_end && count_in_flight(window, ack_num, seq_num) < cwnd;
+}
+
+// Function that takes back a spurious timeout's losses.  The packets it marked lost are back in flight, and every
+// packet in flight gets a fresh deadline - the old ones were as short as the RTO that turned out to be too short
+void undo_lost(struct send_window *window, long long ack_num, long long seq_num, long long rto)
+{
+    long long now = get_time_us();
+    for (long long seq = ack_num; seq < seq_num; seq++)
+    {
+        struct sent_packet *sent = window_slot(window, seq);
+        if (!sent->sacked)
+        {
+            sent->lost = 0;
+            sent->deadline = now + rto;
+            if (push_timer(&window->timers, sent->deadline, seq) < 0)
+            {
+                fail_window(window);
+            }
+        }
+    }
+    window->lost_next = ack_num;
+    window->lost_end = ack_num;
+}
+
+// Function that traces the window whenever the congestion controller has changed it, in thousandths of a packet
+void trace_window(struct send_window *window, struct congestion_control *cc, long long ack_num, double *traced_cwnd, double *traced_ssthresh)
+{
+    if (window->trace == NULL || (cc->cwnd == *traced_cwnd && cc->ssthresh == *traced_ssthresh))
+    {
+        return;
+    }
+    *traced_cwnd = cc->cwnd;
+    *traced_ssthresh = cc->ssthresh;
+    trace_event(window->trace, TRACE_CWND, window->stream, ack_num, llround(cc->cwnd * 1000), fmin(cc->ssthresh * 1000, UINT_MAX));
+}
+
+// Function that reads the next count packets of the stream into their window slots with one call, rather than a
+// call for each packet.  The slots of packets that haven't been sent yet are free, and the read is split in two
+// where the slots wrap around.  Only packets read in full are marked as read - any others are read one at a time
+void read_packets_ahead(struct file_source *src, struct send_window *window, long long seq_num, int count)
+{
+    struct iovec iov[2];
+    off_t offset = (off_t)(window->first_packet + seq_num) * src->payload_size;
+    off_t len = offset >= src->size ? 0 : fmin((off_t)count * src->payload_size, src->size - offset);
+    off_t to_wrap = (off_t)(window->capacity - seq_num % window->capacity) * src->payload_size;
+    iov[0].iov_base = window_payload(window, seq_num);
+    iov[0].iov_len = len < to_wrap ? len : to_wrap;
+    iov[1].iov_base = window->payloads;
+    iov[1].iov_len = len - iov[0].iov_len;
+    ssize_t bytes_read = read_file_at(fileno(src->fp), iov, iov[1].iov_len > 0 ? 2 : 1, offset);
+    // Nothing is marked as read, so the packets are read one at a time instead - which fails the same way
+    if (bytes_read < 0)
+    {
+        return;
+    }
+    window->read_ahead = seq_num + (bytes_read == len ? count : bytes_read / src->payload_size);
+}
+
+// Function that sends as many new packets as the window allows, spaced out by the pacing rate (packets per
+// second, 0 to send them all at once).  next_send is when the pacer lets the next packet go.  When streaming,
+// num_packets is set once the input ends - returns 1 if a streamed input had nothing more to read yet.  A send or
+// read that fails stops it, with the window's error set
+int send_unsent_packets(
+    int cwnd,
+    struct congestion_control *cc,
+    double pacing_rate,
+    long long *next_send,
+    long long *seq_num,
+    long long ack_num,
+    long long *num_packets,
+    long long rto,
+    struct file_source *src,
+    struct send_window *window,
+    struct send_batch *batch,
+    int sockfd,
+    struct sockaddr_in *addr,
+    socklen_t addr_size)
+{
+    int starved = 0;
+    long long now = get_time_us();
+    // Time spent idle can't be saved up into a burst
+    if (*next_send < now)
+    {
+        *next_send = now;
+    }
+    // Packets a timeout gave up on go before any new ones, as the window and the pacer let them - unless F-RTO has
+    // yet to decide whether they were really lost
+    int in_flight = window->lost_next < window->lost_end ? count_in_flight(window, ack_num, *seq_num) : 0;
+    while (!window->error && !window->frto && window->lost_next < window->lost_end && in_flight < cwnd && (pacing_rate <= 0 || *next_send <= now + PACING_SLACK))
+    {
+        long long seq = window->lost_next++;
+        struct sent_packet *sent = window_slot(window, seq);
+        if (seq < ack_num || sent->sacked || !sent->lost)
+        {
+            continue;
+        }
+        if (batch_segment(batch, window->conn_id, window->stream, seq, sent->flags, sent->length, sent->payload, sockfd, addr, addr_size) < 0)
+        {
+            fail_window(window);
+        }
+        mark_resent(window, sent, rto);
+        in_flight++;
+        if (pacing_rate > 0)
+        {
+            *next_send += 1e6 / pacing_rate;
+        }
+    }
+    // The number of currently sent but unacked packets - nothing new is sent until every lost packet has been resent
+    int num_unacked = *seq_num - ack_num;
+    int num_to_send = window->lost_next < window->lost_end && !window->frto ? 0 : cwnd - num_unacked;
+    for (int i = 0; i < num_to_send && *seq_num < *num_packets && !window->error; i++)
+    {
+        // Anything due within the slack goes out with this batch rather than waiting for another wakeup
+        if (pacing_rate > 0 && *next_send > now + PACING_SLACK)
+        {
+            break;
+        }
+        const char *payload;
+        unsigned char flags = 0;
+        int length;
+        if (*seq_num == *num_packets - 1)
+        {
+            // Every packet of the stream's data has been read, so its digest is complete.  A compressed upload's
+            // digest covers the input rather than the records, since that's what the server writes
+            put_u32(window->digest_payload, src->compressor != NULL ? src->compressor->digest : window->digest);
+            payload = window->digest_payload;
+            length = DIGEST_SIZE;
+            flags = FLAG_DIGEST;
+        }
+        else if (src->streaming)
+        {
+            // A partly read packet stays in its slot until the rest of it arrives
+            payload = window_payload(window, *seq_num);
+            length = read_stream_packet(src, window_payload(window, *seq_num));
+            if (length == -2)
+            {
+                fail_window(window);
+                break;
+            }
+            if (length < 0)
+            {
+                starved = 1;
+                break;
+            }
+            if (length < src->payload_size)
+            {
+                flags = FLAG_FIN;
+                *num_packets = *seq_num + 2;
+            }
+        }
+        else if (window->payloads != NULL)
+        {
+            // Reading every packet the window lets us send now at once
+            if (*seq_num >= window->read_ahead)
+            {
+                read_packets_ahead(src, window, *seq_num, fmin(num_to_send - i, *num_packets - 1 - *seq_num));
+            }
+            payload = window_payload(window, *seq_num);
+            length = *seq_num < window->read_ahead ? packet_length(src, window->first_packet + *seq_num)
+                                                   : read_file_and_create_packet(src, window->first_packet + *seq_num, window_payload(window, *seq_num), &payload);
+        }
+        else
+        {
+            length = read_file_and_create_packet(src, window->first_packet + *seq_num, window_payload(window, *seq_num), &payload);
+        }
+        if (length < 0)
+        {
+            fail_window(window);
+            break;
+        }
+        // Packets are read in order the first time they're sent
+        if (!(flags & FLAG_DIGEST))
+        {
+            window->digest = crc32c(window->digest, payload, length);
+        }
+        if (pacing_rate > 0)
+        {
+            *next_send += 1e6 / pacing_rate;
+        }
+        // Buffer the packet and queue it up to be sent
+        buffer_packet(*seq_num, length, flags, payload, window, ack_num, rto);
+        if (batch_segment(batch, window->conn_id, window->stream, *seq_num, flags, length, payload, sockfd, addr, addr_size) < 0)
+        {
+            fail_window(window);
+        }
+        cc_on_send(cc, *seq_num, get_time_us());
+        trace_event(window->trace, TRACE_SEND, window->stream, *seq_num, length, flags);
+        if (window->fec != NULL && !(flags & FLAG_DIGEST))
+        {
+            fec_add_packet(window->fec, *seq_num, length, payload, window, batch, sockfd, addr, addr_size);
+        }
+        (*seq_num)++;
+    }
+    // The last block of the stream is cut short once the data has all been sent
+    if (window->fec != NULL && *seq_num >= *num_packets - 1)
+    {
+        fec_flush(window->fec, window, batch, sockfd, addr, addr_size);
+    }
+    // Send everything the window allows at once
+    if (flush_batch(batch, sockfd) < 0)
+    {
+        fail_window(window);
+    }
+    return starved;
+}
+
+// Function that sends one stream's part of the file - runs on its own thread when the file is split across
+// several streams, and returns once every packet of the stream has been ACKed, or with failed set and error saying
+// why if the server never answered its handshake or the stream couldn't go on
+void *run_flow(void *arg)
+{
+    struct flow *flow = arg;
+    int sockfd = flow->data_fd;
+    int events, num_times_ack_repeated, cwnd;
+    long long new_ack, seq_num, ack_num, old_ack;
+    struct sockaddr_in server_addr_from;
+    socklen_t addr_size = sizeof(server_addr_from);
+    struct rtt_estimator est;
+    struct packet pkt;
+    struct ack ack;
+    long long highest_sacked = 0;
+    int num_newly_sacked;
+    long long num_packets = flow->num_packets;
+    // Set while a streamed input has nothing for us to send, so we wait on it too
+    int starved = 0;
+    int watching_input = 0;
+    struct congestion_control *cc;
+    struct cc_ack_info info;
+    struct event_loop loop;
+    // The window as it was last traced
+    double traced_cwnd = 0;
+    double traced_ssthresh = 0;
+    long long handshake_sent, deadline, wait_until;
+    long long next_send = 0;
+    // One past the last packet the server has said it has room for, and when to ask it again if it said there's
+    // none and nothing's in flight to bring back a newer ACK
+    long long peer_edge;
+    long long next_probe = -1;
+    // When a packet was last sent or an ACK last told us something new, and when to resend the newest packet if
+    // nothing more is heard (once until the next ACK does), so that losing the last few packets of a flight or their
+    // ACKs doesn't mean waiting out the RTO
+    long long last_progress = 0;
+    long long tail_probe;
+    int tail_probed = 0;
+    long long prev_seq_num;
+    const char *handshake_payload;
+    char *handshake_buf = malloc(flow->src->payload_size);
+    ack_num = 0;
+    num_times_ack_repeated = 0;
+    struct send_window window;
+    struct fec_encoder fec;
+    struct send_batch *batch = malloc(sizeof(struct send_batch));
+    // Every stream has its own congestion state
+    cc = create_congestion_control(flow->cc_name, flow->window_size);
+    if (batch == NULL || handshake_buf == NULL)
+    {
+        perror("Could not allocate send batch");
+    }
+    // The controller's name was checked up front, so it can only have failed to allocate, which it's said already.
+    // Memory mapped packets are sent straight from the mapping, so the window doesn't need its own copies
+    memset(&window, 0, sizeof(window));
+    fec.parity = NULL;
+    if (batch == NULL || handshake_buf == NULL || cc == NULL ||
+        init_send_window(&window, flow->window_size, flow->src->map == NULL, flow->conn_id, flow->stream, flow->first_packet, flow->src->payload_size) < 0 ||
+        (flow->fec_block > 0 && init_fec_encoder(&fec, flow->fec_block, flow->src->payload_size) < 0) || init_event_loop(&loop, flow->ack_fd) < 0)
+    {
+        flow->error = errno;
+        flow->failed = 1;
+        free(fec.parity);
+        free_send_window(&window);
+        free(batch);
+        free(handshake_buf);
+        free(cc);
+        return NULL;
+    }
+    window.trace = flow->trace;
+    window.fec = flow->fec_block > 0 ? &fec : NULL;
+    init_send_batch(batch, flow->max_segments, HEADER_SIZE + flow->src->payload_size);
+    est.srtt = 0;
+    est.rttvar = 0;
+    est.rto = INITIAL_RTO;
+    est.last_backoff = 0;
+    est.has_sample = 0;
+    est.latest = 0;
+
+    int handshake_length;
+    pkt.flags = FLAG_HANDSHAKE;
+    if (flow->src->streaming)
+    {
+        // Nothing's in flight yet, so there's nothing to do but wait for the first packet's worth of input
+        while ((handshake_length = read_stream_packet(flow->src, handshake_buf)) == -1)
+        {
+            if (!watching_input)
+            {
+                watching_input = 1;
+                if (watch_input(&loop, fileno(flow->src->fp), 1) < 0)
+                {
+                    break;
+                }
+            }
+            if (wait_for_events(&loop, -1) < 0)
+            {
+                break;
+            }
+        }
+        handshake_payload = handshake_buf;
+        pkt.flags |= FLAG_STREAM;
+        if (flow->src->compressor != NULL)
+        {
+            pkt.flags |= FLAG_COMPRESSED;
+        }
+        // The whole input may fit in the handshake, leaving only the digest
+        if (handshake_length < flow->src->payload_size)
+        {
+            pkt.flags |= FLAG_FIN;
+            num_packets = 2;
+        }
+    }
+    else if (flow->resume)
+    {
+        // A resumed stream's handshake carries the file's key instead of its first packet, which is sent like any
+        // other packet if the server still needs it
+        put_u64(handshake_buf, flow->resume_key);
+        handshake_payload = handshake_buf;
+        handshake_length = RESUME_KEY_SIZE;
+        pkt.flags |= FLAG_RESUME;
+    }
+    else
+    {
+        handshake_length = read_file_and_create_packet(flow->src, flow->first_packet, handshake_buf, &handshake_payload);
+    }
+    // A stream that can't read its first packet gives up without sending anything
+    if (handshake_length < 0)
+    {
+        fail_window(&window);
+        handshake_length = 0;
+    }
+    if (!(pkt.flags & FLAG_RESUME))
+    {
+        window.digest = crc32c(0, handshake_payload, handshake_length);
+    }
+    pkt.seqnum = 0;
+    pkt.length = handshake_length;
+    pkt.payload = (char *)handshake_payload;
+    pkt.conn_id = flow->conn_id;
+    pkt.stream = flow->stream;
+    pkt.num_streams = flow->num_streams;
+    // Telling the server how big the pieces of the file are
+    pkt.payload_size = flow->src->payload_size;
+
+    // Send handshake - it carries the packet count of the whole file, which the server splits the same way we did.
+    // A streamed upload's packet count isn't known, so it's sent as 0 and the server waits for the FIN instead
+    handshake_sent = get_time_us();
+    if (!window.error && send_handshake(flow->total_packets, &pkt, sockfd, flow->server_addr, addr_size) < 0)
+    {
+        fail_window(&window);
+    }
+    // printPacket(&pkt);
+    deadline = handshake_sent + est.rto;
+    int handshake_attempts = 1;
+
+    // The handshake's ACK is the first the stream gets.  It's 1 unless the stream is resumed, when it's wherever the
+    // server got to
+    ack_num = -2;
+    while (ack_num < 0 && !flow->failed && !window.error)
+    {
+        events = wait_for_events(&loop, deadline);
+        if (events < 0)
+        {
+            fail_window(&window);
+            break;
+        }
+        while ((events & EVENT_SOCKET) && ack_num < 0 && (ack_num = recv_ack(&ack, flow->conn_id, flow->ack_fd, &server_addr_from, addr_size)) != -2)
+        {
+            if (ack_num == -1)
+            {
+                fail_window(&window);
+                break;
+            }
+        }
+        // A server that drops packets this size (or a link that does) never answers, so we don't wait forever
+        if (ack_num < 0 && get_time_us() >= deadline && handshake_attempts == MAX_HANDSHAKE_ATTEMPTS)
+        {
+            printf("No reply to %d handshakes - check the server is running and accepts %d byte packets (-M)\n",
+                   handshake_attempts, HANDSHAKE_HEADER_SIZE + flow->src->payload_size);
+            flow->error = ETIMEDOUT;
+            flow->failed = 1;
+        }
+        else if (ack_num < 0 && get_time_us() >= deadline)
+        {
+            handshake_attempts++;
+            backoff_rto(&est);
+            // Send handshake - a resent handshake can't be used as an RTT sample
+            handshake_sent = -1;
+            if (send_handshake(flow->total_packets, &pkt, sockfd, flow->server_addr, addr_size) < 0)
+            {
+                fail_window(&window);
+            }
+            // printPacket(&pkt);
+            deadline = get_time_us() + est.rto;
+        }
+    }
+    if (handshake_sent >= 0 && ack_num >= 0)
+    {
+        update_est_rtt(&est, get_time_us() - handshake_sent);
+    }
+    seq_num = ack_num;
+    highest_sacked = ack_num;
+    peer_edge = ack_num + ack.window;
+    // The server already has everything before where a resumed stream picks up, but the digest still covers it
+    for (long long seq = 0; flow->resume && seq < ack_num && seq < num_packets - 1 && !window.error; seq++)
+    {
+        int length = read_file_and_create_packet(flow->src, flow->first_packet + seq, handshake_buf, &handshake_payload);
+        if (length < 0)
+        {
+            fail_window(&window);
+            break;
+        }
+        window.digest = crc32c(window.digest, handshake_payload, length);
+    }
+    /*
+
+    if (PRINT_STATEMENTS)
+    {
+        printf("Handshake Received\n");
+    }
+    */
+    // Changed the following <= to < for correct client shutdown if the server's final ACK is not lost
+    while (!flow->failed && !window.error && ack_num < num_packets)
+    {
+        // Making sure that we don't send past the end of the file, or past what the server has room for
+        cwnd = fmin(fmin(cc->cwnd, num_packets - ack_num), peer_edge - ack_num);
+        prev_seq_num = seq_num;
+        starved = send_unsent_packets(cwnd, cc, cc_pacing_rate(cc, est.srtt), &next_send, &seq_num, ack_num, &num_packets, est.rto, flow->src, &window, batch, sockfd, flow->server_addr, addr_size);
+        if (starved != watching_input)
+        {
+            if (watch_input(&loop, fileno(flow->src->fp), starved) < 0)
+            {
+                fail_window(&window);
+            }
+            watching_input = starved;
+        }
+        if (seq_num > prev_seq_num)
+        {
+            last_progress = get_time_us();
+        }
+
+        // Sleeping until an ACK arrives, the earliest retransmission deadline passes, or the pacer lets the next
+        // packet go if the window has room for it - or more input arrives if we ran out
+        deadline = earliest_deadline(&window, ack_num, seq_num);
+        wait_until = deadline;
+        if (((!starved && seq_num < ack_num + cwnd && seq_num < num_packets) || lost_ready(&window, cwnd, ack_num, seq_num)) && (wait_until < 0 || next_send < wait_until))
+        {
+            wait_until = next_send;
+        }
+        // The server sends an ACK once it has room again, but if that's lost nothing else would come back
+        if (seq_num == ack_num && peer_edge <= ack_num && ack_num > 0)
+        {
+            next_probe = next_probe < 0 ? get_time_us() + est.rto : next_probe;
+            wait_until = wait_until < 0 || next_probe < wait_until ? next_probe : wait_until;
+        }
+        else
+        {
+            next_probe = -1;
+        }
+        // No tail loss probe while recovering from a loss, or if the RTO would come first anyway
+        tail_probe = -1;
+        if (!tail_probed && seq_num > ack_num && est.has_sample && num_times_ack_repeated < 3 && !window.frto && window.lost_next >= window.lost_end)
+        {
+            tail_probe = last_progress + fmax(2 * est.srtt + ACK_DELAY, TAIL_PROBE_MIN);
+            if (deadline >= 0 && tail_probe >= deadline)
+            {
+                tail_probe = -1;
+            }
+            else if (wait_until < 0 || tail_probe < wait_until)
+            {
+                wait_until = tail_probe;
+            }
+        }
+        if (window.error)
+        {
+            break;
+        }
+        events = wait_for_events(&loop, wait_until);
+        if (events < 0)
+        {
+            fail_window(&window);
+            break;
+        }
+
+        // Handling every ACK that's arrived
+        while (!window.error && (events & EVENT_SOCKET) && (new_ack = recv_ack(&ack, flow->conn_id, flow->ack_fd, &server_addr_from, addr_size)) != -2)
+        {
+            if (new_ack == -1)
+            {
+                fail_window(&window);
+                break;
+            }
+            // Treat the case in which an ack has been received
+            int is_duplicate = (new_ack == ack_num);
+            int window_update = new_ack + ack.window > peer_edge;
+            peer_edge = fmax(peer_edge, new_ack + ack.window);
+            est.latest = 0;
+            sample_rtt(&est, &window, ack_num, new_ack);
+            info.num_acked = 0;
+            if (new_ack > ack_num && new_ack <= seq_num)
+            {
+                info.num_acked = count_delivered(&window, ack_num, new_ack);
+            }
+            old_ack = ack_num;
+            ack_num = handle_ack(&window, ack_num, new_ack, seq_num);
+            if (ack_num > old_ack)
+            {
+                reset_rto(&est);
+            }
+            highest_sacked = mark_sacked(&window, &ack, ack_num, seq_num, &est, &num_newly_sacked);
+            if (ack_num > old_ack || num_newly_sacked > 0)
+            {
+                last_progress = get_time_us();
+                tail_probed = 0;
+                tail_probe = -1;
+            }
+            // An ACK that only says the server has more room isn't a sign of loss, and nor is one that answers a
+            // probe, with nothing in flight
+            is_duplicate &= (num_newly_sacked > 0 || !window_update) && seq_num > ack_num;
+            // Packets the server rebuilt from parity were still lost, as far as the block size is concerned
+            if (window.fec != NULL)
+            {
+                window.fec->lost += ack.recovered;
+            }
+            info.ack_num = ack_num;
+            info.num_acked += num_newly_sacked;
+            info.in_flight = seq_num - ack_num;
+            info.rtt = est.latest;
+            info.srtt = est.srtt;
+            info.now = get_time_us();
+            cc_on_ack(cc, &info);
+            trace_event(window.trace, is_duplicate ? TRACE_DUPACK : TRACE_ACK, flow->stream, new_ack, 0, ack.num_sacks);
+            if (est.latest > 0)
+            {
+                trace_event(window.trace, TRACE_RTT, flow->stream, ack_num, est.latest, est.srtt);
+            }
+            if (ack.recovered > 0)
+            {
+                trace_event(window.trace, TRACE_RECOVERED, flow->stream, ack_num, ack.recovered, 0);
+            }
+            // F-RTO - an ACK that neither moves the window nor SACKs anything new says nothing about the timeout
+            if (window.frto && (ack_num > old_ack || num_newly_sacked > 0))
+            {
+                if (ack_num > old_ack && window.frto == 2)
+                {
+                    window.frto = 0;
+                    undo_lost(&window, ack_num, seq_num, est.rto);
+                    cc_undo_timeout(cc);
+                    trace_event(window.trace, TRACE_SPURIOUS, flow->stream, ack_num, llround(cc->cwnd * 1000), 0);
+                }
+                else if (ack_num > old_ack && ack_num < window.frto_recover)
+                {
+                    // The ACK may only have moved because of the resend, so two new packets are sent (if the window
+                    // has room for them) to see whether another one follows it
+                    long long sent_before = seq_num;
+                    cwnd = fmin(fmin(seq_num - ack_num + 2, window.capacity), peer_edge - ack_num);
+                    send_unsent_packets(cwnd, cc, 0, &next_send, &seq_num, ack_num, &num_packets, est.rto, flow->src, &window, batch, sockfd, flow->server_addr, addr_size);
+                    window.frto = seq_num > sent_before ? 2 : 0;
+                }
+                else
+                {
+                    // The oldest packet really was lost, or everything's been ACKed and there's no telling
+                    window.frto = 0;
+                }
+            }
+            int prev_repeated = num_times_ack_repeated;
+            if (ack_num > old_ack)
+            {
+                // The ACK moved the window forward, and the packets already SACKed beyond the new hole count as
+                // duplicates of it - stale ACKs that arrive out of order are ignored
+                prev_repeated = 0;
+                num_times_ack_repeated = count_sacked(&window, ack_num, highest_sacked);
+            }
+            else if (is_duplicate)
+            {
+                // The server may ACK several packets at once, so an ACK counts as one duplicate for every packet
+                // it newly SACKs
+                num_times_ack_repeated += fmax(num_newly_sacked, 1);
+            }
+            // Once a timeout has marked packets lost they're resent as the window allows, rather than all at once
+            if (ack_num >= window.lost_end)
+            {
+                // Fast retransmit
+                if (prev_repeated < 3 && num_times_ack_repeated >= 3)
+                {
+                    /*
+                    if (PRINT_STATEMENTS)
+                    {
+                        printf("Multiple ACKs for %d detected - beginning fast retransmit", ack_num);
+                    }
+                    */
+                    // Resending only the holes the server hasn't SACKed (at least the first unacked packet)
+                    window.holes_resent_to = ack_num;
+                    resend_packet(&window, ack_num, ack_num, est.rto, sockfd, flow->server_addr, addr_size);
+                    resend_holes(&window, ack_num, highest_sacked, est.rto, sockfd, flow->server_addr, addr_size);
+                    cc_on_loss(cc, ack_num, get_time_us());
+                }
+                // Fast recovery - repair any holes revealed since the fast retransmit
+                else if (is_duplicate && prev_repeated >= 3)
+                {
+                    resend_holes(&window, ack_num, highest_sacked, est.rto, sockfd, flow->server_addr, addr_size);
+                }
+            }
+            trace_window(&window, cc, ack_num, &traced_cwnd, &traced_ssthresh);
+        }
+
+        // Treat the case in which a retransmission deadline has passed
+        deadline = earliest_deadline(&window, ack_num, seq_num);
+        if (deadline >= 0 && deadline <= get_time_us())
+        {
+            // Back off the RTO (once per loss event) and resend the oldest unACKed packet with the new deadline
+            /*
+            if (PRINT_STATEMENTS)
+            {
+                printf("There has been a timeout, resending packet number %d\n", ack_num);
+            }
+            */
+            int timed_out = backoff_rto(&est);
+            if (timed_out)
+            {
+                // F-RTO can only tell whether the timeout was spurious if the oldest packet hasn't been resent
+                // before, and isn't started again while it's still deciding about the last timeout
+                window.frto = !window.frto && !window_slot(&window, ack_num)->resent;
+                window.frto_recover = seq_num;
+                cc_on_timeout(cc, get_time_us());
+                trace_event(window.trace, TRACE_TIMEOUT, flow->stream, ack_num, est.rto, 0);
+                trace_window(&window, cc, ack_num, &traced_cwnd, &traced_ssthresh);
+            }
+            expire_packets(&window, ack_num, seq_num, timed_out, est.rto, sockfd, flow->server_addr, addr_size);
+            tail_probe = -1;
+        }
+        // Resending the newest packet the server hasn't SACKed, whose ACK will show what's missing.  It's not a sign of
+        // congestion, so the window is left alone
+        if (tail_probe >= 0 && tail_probe <= get_time_us() && seq_num > ack_num)
+        {
+            long long newest = seq_num - 1;
+            while (newest > ack_num && window_slot(&window, newest)->sacked)
+            {
+                newest--;
+            }
+            resend_packet(&window, newest, ack_num, est.rto, sockfd, flow->server_addr, addr_size);
+            tail_probed = 1;
+        }
+        // Asking the server whether it has room yet with an empty packet it already has, which it ACKs straight away
+        if (next_probe >= 0 && next_probe <= get_time_us() && seq_num == ack_num && peer_edge <= ack_num)
+        {
+            if (serve_segment(flow->conn_id, flow->stream, ack_num - 1, 0, 0, window.digest_payload, sockfd, flow->server_addr, addr_size) < 0)
+            {
+                fail_window(&window);
+            }
+            next_probe = get_time_us() + est.rto;
+        }
+
+        // while (new_ack != seq_num)
+        // {
+        //     // Resend packet
+        //     resend_packet(&window, &ack_num, &ack_num, est.rto, sockfd, flow->server_addr, addr_size);
+        //     // Receive ack
+        //     new_ack = recv_ack(&ack, flow->conn_id, flow->ack_fd, &server_addr_from, addr_size);
+        // }
+    }
+    if (window.error)
+    {
+        flow->error = window.error;
+        flow->failed = 1;
+    }
+    if (window.fec != NULL)
+    {
+        free_fec_encoder(&fec);
+    }
+    free_send_window(&window);
+    free(batch);
+    free(handshake_buf);
+    free(cc);
+    free_event_loop(&loop);
+    return NULL;
+}
+
+// Function that makes every stream that's still going give up, with errno saying why - they notice the next time
+// they wake up
+void fail_flows(struct flow *flows, int num_streams)
+{
+    int error = errno;
+    for (int i = 0; i < num_streams; i++)
+    {
+        if (!flows[i].failed)
+        {
+            flows[i].error = error;
+            flows[i].failed = 1;
+        }
+    }
+}
+
+// Function that hands every ACK that arrives on the shared socket to the stream it's for, until each stream
+// has been sent its final ACK or has given up.  If the socket stops working, so does every stream
+void relay_acks(struct flow *flows, int num_streams, int sockfd)
+{
+    struct event_loop loop;
+    struct sockaddr_in server_addr_from;
+    socklen_t addr_size = sizeof(server_addr_from);
+    struct ack ack;
+    char buf[MAX_ACK_SIZE];
+    int num_done = 0;
+    long long acknum;
+    if (init_event_loop(&loop, sockfd) < 0)
+    {
+        fail_flows(flows, num_streams);
+        return;
+    }
+    while (num_done < num_streams)
+    {
+        // A stream that gives up gets no final ACK, so the streams are checked on every so often
+        if (wait_for_events(&loop, get_time_us() + INITIAL_RTO) < 0)
+        {
+            fail_flows(flows, num_streams);
+        }
+        for (int i = 0; i < num_streams; i++)
+        {
+            if (!flows[i].done && flows[i].failed)
+            {
+                flows[i].done = 1;
+                num_done++;
+            }
+        }
+        while (num_done < num_streams && (acknum = recv_ack(&ack, flows[0].conn_id, sockfd, &server_addr_from, addr_size)) > -2)
+        {
+            if (acknum == -1)
+            {
+                fail_flows(flows, num_streams);
+                break;
+            }
+            if (ack.stream < 0 || ack.stream >= num_streams || flows[ack.stream].failed)
+            {
+                continue;
+            }
+            struct flow *flow = &flows[ack.stream];
+            // Blocking here rather than dropping the ACK, since the stream can't finish without its final one
+            if (send(flow->relay_fd, buf, write_ack(buf, &ack), 0) < 0)
+            {
+                perror("Error relaying ACK");
+                fail_flows(flow, 1);
+                continue;
+            }
+            if (!flow->done && ack.acknum >= flow->num_packets)
+            {
+                flow->done = 1;
+                num_done++;
+            }
+        }
+    }
+    free_event_loop(&loop);
+}
+
+// Function that prints how the upload is going so far - called by the trace flusher once a second with -S
+void print_client_stats(struct tracer *tracer, long long now)
+{
+    double seconds = (now - tracer->start) / 1e6;
+    double cwnd = 0;
+    for (int i = 0; i < tracer->num_rings; i++)
+    {
+        cwnd += trace_read(&tracer->rings[i].last[TRACE_CWND]) / 1000.0;
+    }
+    printf("%.1fs: %.2fMB sent, %.2fMbit/s, cwnd %.1f, %lld resent, %lld timeouts\n", seconds, trace_total(tracer, TRACE_SEND) / 1e6,
+           trace_total(tracer, TRACE_SEND) * 8 / 1e6 / seconds, cwnd, trace_count(tracer, TRACE_RESEND), trace_count(tracer, TRACE_TIMEOUT));
+    fflush(stdout);
+}
+
+// Function that prints the end of transfer summary.  Packets that were resent or that the server rebuilt from parity
+// count as lost, and goodput only counts each byte of the file once
+void print_client_summary(struct tracer *tracer)
+{
+    double seconds = (get_time_us() - tracer->start) / 1e6;
+    long long sent = trace_count(tracer, TRACE_SEND);
+    long long resent = trace_count(tracer, TRACE_RESEND);
+    long long lost = resent + trace_total(tracer, TRACE_RECOVERED);
+    printf("Sent %lld packets (%.2fMB) in %.2fs: goodput %.2fMbit/s, %.2f%% lost, %.2f%% of packets sent were retransmissions, %lld timeouts\n",
+           sent, trace_total(tracer, TRACE_SEND) / 1e6, seconds, trace_total(tracer, TRACE_SEND) * 8 / 1e6 / seconds,
+           sent > 0 ? 100.0 * lost / sent : 0, sent + resent > 0 ? 100.0 * resent / (sent + resent) : 0, trace_count(tracer, TRACE_TIMEOUT));
+    if (trace_count(tracer, TRACE_SPURIOUS) > 0)
+    {
+        printf("%lld of the timeouts were spurious and undone\n", trace_count(tracer, TRACE_SPURIOUS));
+    }
+    if (trace_dropped(tracer) > 0)
+    {
+        printf("%lld trace records didn't fit in the trace rings and were dropped\n", trace_dropped(tracer));
+    }
+}
+
+#endif
@@ -0,0 +1,645 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+// A discrete event simulator that runs the client's streams and the server in one process, over a simulated link
+// and a virtual clock.  Each endpoint runs the same run_flow or run_worker the real programs do, on its own
+// coroutine, and the simulator's transport (see struct transport_ops in utils.h) hands it datagrams and switches
+// back to the scheduler whenever it waits.  Nothing takes any real time, so a transfer over a slow, lossy link
+// finishes as fast as the CPU can run the protocol, and the same seed always gives exactly the same run
+
+// An endpoint that gives up calls exit, which only ends its own coroutine here
+void sim_exit(int status);
+#define exit(status) sim_exit(status)
+
+#include "sender.h"
+#include "receiver.h"
+#undef exit
+
+// MACROS
+#define SIM_STACK_SIZE (1 << 20) // Bytes of stack for each endpoint's coroutine
+#define SIM_SERVER_FD 1000 // The sockets the endpoints are given - stream i of the client has SIM_CLIENT_FD + i
+#define SIM_CLIENT_FD 1001
+#define SIM_START 1000000 // Virtual time starts here rather than at 0, which some deadlines take as unset
+
+// A datagram crossing the link, or waiting to be read
+struct sim_datagram
+{
+    struct sim_datagram *next;
+    long long arrival;
+    int len;
+    char data[];
+};
+
+struct sim_queue
+{
+    struct sim_datagram *head;
+    struct sim_datagram *tail;
+};
+
+// One direction of the link - a bottleneck of rate packets a second with a queue of queue_size packets, then the
+// propagation delay.  Packets leave the bottleneck in order and the delay is fixed, so they arrive in order too
+struct sim_link
+{
+    double loss_rate;
+    double rate;
+    int queue_size;
+    long long delay;
+    // When the bottleneck is done with the last packet queued for it
+    long long busy_until;
+    struct sim_queue in_flight;
+    long long sent;
+    long long lost;
+    long long overflowed;
+};
+
+// The server or one of the client's streams, running on its own coroutine
+struct sim_endpoint
+{
+    ucontext_t context;
+    char *stack;
+    void *(*run)(void *arg);
+    void *arg;
+    int sockfd;
+    // Datagrams that have arrived and not been read yet
+    struct sim_queue inbox;
+    // What the endpoint is waiting for - the deadline is -1 when it's only waiting for a datagram
+    long long deadline;
+    int started;
+    int finished;
+    // The status it passed to exit, if it gave up
+    int exit_status;
+};
+
+// Settings every run shares
+struct sim_config
+{
+    const char *filename;
+    const char *cc_name;
+    int num_streams;
+    int window_size;
+    int fec_block;
+    int packet_size;
+    double loss_rate;
+    long long delay;
+    double rate;
+    int queue_size;
+    long long time_limit;
+};
+
+struct simulation
+{
+    long long now;
+    unsigned short rand_state[3];
+    // Client to server, and server to client
+    struct sim_link links[2];
+    // The server, then each of the client's streams
+    struct sim_endpoint *endpoints;
+    int num_endpoints;
+    struct sim_endpoint *current;
+    ucontext_t scheduler;
+};
+
+struct simulation *sim;
+
+void sim_exit(int status)
+{
+    // Outside a coroutine there's nothing to fall back to
+    if (sim == NULL || sim->current == NULL)
+    {
+        _exit(status);
+    }
+    sim->current->exit_status = status;
+    sim->current->finished = 1;
+    setcontext(&sim->scheduler);
+    _exit(status);
+}
+
+void push_datagram(struct sim_queue *queue, struct sim_datagram *dgram)
+{
+    dgram->next = NULL;
+    if (queue->tail == NULL)
+    {
+        queue->head = dgram;
+    }
+    else
+    {
+        queue->tail->next = dgram;
+    }
+    queue->tail = dgram;
+}
+
+struct sim_datagram *pop_datagram(struct sim_queue *queue)
+{
+    struct sim_datagram *dgram = queue->head;
+    queue->head = dgram->next;
+    if (queue->head == NULL)
+    {
+        queue->tail = NULL;
+    }
+    return dgram;
+}
+
+void free_queue(struct sim_queue *queue)
+{
+    while (queue->head != NULL)
+    {
+        free(pop_datagram(queue));
+    }
+}
+
+struct sim_endpoint *find_endpoint(int sockfd)
+{
+    return &sim->endpoints[sockfd == SIM_SERVER_FD ? 0 : 1 + sockfd - SIM_CLIENT_FD];
+}
+
+long long sim_now()
+{
+    return sim->now;
+}
+
+// Function that puts each datagram on the link away from whoever sent it - the server sends towards the client
+int sim_send(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    struct sim_link *link = &sim->links[sockfd == SIM_SERVER_FD];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct msghdr *msg = &msgs[i].msg_hdr;
+        size_t len = 0;
+        for (size_t j = 0; j < msg->msg_iovlen; j++)
+        {
+            len += msg->msg_iov[j].iov_len;
+        }
+        msgs[i].msg_len = len;
+        link->sent++;
+        if (erand48(sim->rand_state) < link->loss_rate)
+        {
+            link->lost++;
+            continue;
+        }
+        // A packet that would wait longer than a full queue takes to drain doesn't fit in the queue
+        long long start = link->busy_until > sim->now ? link->busy_until : sim->now;
+        long long departure = start + 1e6 / link->rate;
+        if (departure - sim->now > link->queue_size * 1e6 / link->rate)
+        {
+            link->overflowed++;
+            continue;
+        }
+        link->busy_until = departure;
+        struct sim_datagram *dgram = malloc(sizeof(struct sim_datagram) + len);
+        if (dgram == NULL)
+        {
+            perror("Could not allocate datagram");
+            _exit(1);
+        }
+        dgram->arrival = departure + link->delay;
+        dgram->len = len;
+        for (size_t j = 0, offset = 0; j < msg->msg_iovlen; offset += msg->msg_iov[j].iov_len, j++)
+        {
+            memcpy(dgram->data + offset, msg->msg_iov[j].iov_base, msg->msg_iov[j].iov_len);
+        }
+        push_datagram(&link->in_flight, dgram);
+    }
+    return count;
+}
+
+int sim_recv(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    struct sim_endpoint *endpoint = find_endpoint(sockfd);
+    unsigned int num_received = 0;
+    while (num_received < count && endpoint->inbox.head != NULL)
+    {
+        struct sim_datagram *dgram = pop_datagram(&endpoint->inbox);
+        struct msghdr *msg = &msgs[num_received].msg_hdr;
+        size_t len = dgram->len < (int)msg->msg_iov[0].iov_len ? (size_t)dgram->len : msg->msg_iov[0].iov_len;
+        memcpy(msg->msg_iov[0].iov_base, dgram->data, len);
+        msg->msg_flags = len < (size_t)dgram->len ? MSG_TRUNC : 0;
+        msg->msg_controllen = 0;
+        if (msg->msg_name != NULL)
+        {
+            memset(msg->msg_name, 0, msg->msg_namelen);
+        }
+        msgs[num_received++].msg_len = len;
+        free(dgram);
+    }
+    if (num_received == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return num_received;
+}
+
+int sim_init_loop(struct event_loop *loop, int sockfd)
+{
+    loop->sockfd = sockfd;
+    loop->epfd = -1;
+    loop->timerfd = -1;
+    loop->inputfd = -1;
+    loop->input_watched = 0;
+    loop->armed = -1;
+    return 0;
+}
+
+void sim_free_loop(struct event_loop *loop)
+{
+    (void)loop;
+}
+
+// Function that hands control back to the scheduler until a datagram arrives or the deadline passes
+int sim_wait(struct event_loop *loop, long long deadline)
+{
+    struct sim_endpoint *endpoint = find_endpoint(loop->sockfd);
+    int ready = 0;
+    endpoint->deadline = deadline;
+    swapcontext(&endpoint->context, &sim->scheduler);
+    if (endpoint->inbox.head != NULL)
+    {
+        ready |= EVENT_SOCKET;
+    }
+    if (deadline >= 0 && sim->now >= deadline)
+    {
+        ready |= EVENT_TIMER;
+    }
+    return ready;
+}
+
+// Streamed input is never simulated, since the file is always read from disk
+int sim_watch(struct event_loop *loop, int fd, int enabled)
+{
+    (void)loop;
+    (void)fd;
+    (void)enabled;
+    printf("Streamed input can't be simulated\n");
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+// The file is read and written for real
+const struct transport_ops sim_transport = {
+    "simulated", sim_now, sim_send, sim_recv, sim_init_loop, sim_free_loop, sim_wait, sim_watch, udp_read_file, udp_write_file};
+
+void run_endpoint()
+{
+    struct sim_endpoint *endpoint = sim->current;
+    endpoint->run(endpoint->arg);
+    endpoint->finished = 1;
+}
+
+// Function that moves every datagram whose time has come off the link and into its endpoint's inbox - ACKs go to
+// the stream they're for
+void deliver_datagrams()
+{
+    for (int l = 0; l < 2; l++)
+    {
+        struct sim_link *link = &sim->links[l];
+        while (link->in_flight.head != NULL && link->in_flight.head->arrival <= sim->now)
+        {
+            struct sim_datagram *dgram = pop_datagram(&link->in_flight);
+            struct ack ack;
+            int target = 0;
+            if (l == 1)
+            {
+                target = read_ack(dgram->data, dgram->len, &ack) < 0 ? -1 : 1 + ack.stream;
+            }
+            if (target < 0 || target >= sim->num_endpoints)
+            {
+                free(dgram);
+                continue;
+            }
+            push_datagram(&sim->endpoints[target].inbox, dgram);
+        }
+    }
+}
+
+// Utility function to tell whether an endpoint has something to do right now
+int is_runnable(struct sim_endpoint *endpoint)
+{
+    return !endpoint->finished &&
+           (!endpoint->started || endpoint->inbox.head != NULL || (endpoint->deadline >= 0 && endpoint->deadline <= sim->now));
+}
+
+void resume_endpoint(struct sim_endpoint *endpoint)
+{
+    sim->current = endpoint;
+    if (!endpoint->started)
+    {
+        endpoint->started = 1;
+        getcontext(&endpoint->context);
+        endpoint->context.uc_stack.ss_sp = endpoint->stack;
+        endpoint->context.uc_stack.ss_size = SIM_STACK_SIZE;
+        endpoint->context.uc_link = &sim->scheduler;
+        makecontext(&endpoint->context, run_endpoint, 0);
+    }
+    swapcontext(&sim->scheduler, &endpoint->context);
+    sim->current = NULL;
+}
+
+// Function that runs endpoints until every stream of the client is done, advancing the clock to the next arrival
+// or deadline whenever none of them has anything to do - returns 0 once they're done, or -1 if they stalled
+int run_until_sent(long long time_limit)
+{
+    for (;;)
+    {
+        int num_sent = 0;
+        for (int i = 1; i < sim->num_endpoints; i++)
+        {
+            num_sent += sim->endpoints[i].finished;
+        }
+        if (num_sent == sim->num_endpoints - 1)
+        {
+            return 0;
+        }
+        deliver_datagrams();
+        int ran = 0;
+        for (int i = 0; i < sim->num_endpoints; i++)
+        {
+            if (is_runnable(&sim->endpoints[i]))
+            {
+                resume_endpoint(&sim->endpoints[i]);
+                ran = 1;
+            }
+        }
+        if (ran)
+        {
+            continue;
+        }
+        long long next = -1;
+        for (int l = 0; l < 2; l++)
+        {
+            if (sim->links[l].in_flight.head != NULL && (next < 0 || sim->links[l].in_flight.head->arrival < next))
+            {
+                next = sim->links[l].in_flight.head->arrival;
+            }
+        }
+        for (int i = 0; i < sim->num_endpoints; i++)
+        {
+            struct sim_endpoint *endpoint = &sim->endpoints[i];
+            if (!endpoint->finished && endpoint->deadline >= 0 && (next < 0 || endpoint->deadline < next))
+            {
+                next = endpoint->deadline;
+            }
+        }
+        // Nothing will ever happen again, or not soon enough
+        if (next < 0 || next > SIM_START + time_limit)
+        {
+            return -1;
+        }
+        sim->now = next;
+    }
+}
+
+// Function that checks the server wrote exactly what was sent
+int same_contents(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same)
+    {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        same = ca == cb;
+        if (ca == EOF)
+        {
+            break;
+        }
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+// Function that simulates one upload of the file with the given seed, and prints a line of CSV about it
+void simulate_upload(const struct sim_config *config, int seed)
+{
+    struct simulation state;
+    struct server_config server_config;
+    struct worker worker;
+    struct file_source src;
+    struct sockaddr_in server_addr;
+    char output_name[32];
+    memset(&state, 0, sizeof(state));
+    memset(&server_config, 0, sizeof(server_config));
+    memset(&worker, 0, sizeof(worker));
+    memset(&server_addr, 0, sizeof(server_addr));
+    sim = &state;
+    sim->now = SIM_START;
+    sim->rand_state[0] = 0x330E;
+    sim->rand_state[1] = seed & 0xFFFF;
+    sim->rand_state[2] = (seed >> 16) & 0xFFFF;
+    for (int l = 0; l < 2; l++)
+    {
+        sim->links[l].loss_rate = config->loss_rate;
+        sim->links[l].rate = config->rate;
+        sim->links[l].queue_size = config->queue_size;
+        sim->links[l].delay = config->delay;
+    }
+
+    if (open_file_source(&src, config->filename, 0, 0) < 0)
+    {
+        perror("Error opening file");
+        _exit(1);
+    }
+    src.payload_size = config->packet_size - HANDSHAKE_HEADER_SIZE;
+    long long num_packets = (src.size + src.payload_size - 1) / src.payload_size;
+    int num_streams = split_streams(num_packets, config->num_streams);
+
+    // The server listens, so it's still there to ACK again if the client missed its final ACK, and it's told to
+    // stop once the client is done
+    server_config.window_size = DEFAULT_BUFFER;
+    server_config.policy.ack_every = ACK_EVERY;
+    server_config.policy.ack_delay = ACK_DELAY;
+    server_config.listen = 1;
+    server_config.max_packet_size = config->packet_size;
+    worker.sockfd = SIM_SERVER_FD;
+    worker.config = &server_config;
+
+    sim->num_endpoints = 1 + num_streams;
+    sim->endpoints = calloc(sim->num_endpoints, sizeof(struct sim_endpoint));
+    struct flow *flows = calloc(num_streams, sizeof(struct flow));
+    struct trace_ring *rings = calloc(num_streams, sizeof(struct trace_ring));
+    if (sim->endpoints == NULL || flows == NULL || rings == NULL)
+    {
+        perror("Could not allocate simulation");
+        _exit(1);
+    }
+    // The same connection ID for the same seed, so the output file is the same too
+    unsigned int conn_id = seed + 1;
+    for (int i = 0; i < num_streams; i++)
+    {
+        struct flow *flow = &flows[i];
+        flow->conn_id = conn_id;
+        flow->stream = i;
+        flow->num_streams = num_streams;
+        flow->total_packets = num_packets;
+        stream_range(num_packets, num_streams, i, &flow->first_packet, &flow->num_packets);
+        flow->num_packets = (flow->num_packets > 0 ? flow->num_packets : 1) + 1;
+        flow->src = &src;
+        flow->cc_name = config->cc_name;
+        flow->window_size = config->window_size;
+        flow->max_segments = 1;
+        flow->fec_block = config->fec_block;
+        flow->server_addr = &server_addr;
+        flow->data_fd = SIM_CLIENT_FD + i;
+        flow->ack_fd = SIM_CLIENT_FD + i;
+        // Only counting events, for the summary
+        flow->trace = &rings[i];
+        sim->endpoints[1 + i].run = run_flow;
+        sim->endpoints[1 + i].arg = flow;
+        sim->endpoints[1 + i].sockfd = SIM_CLIENT_FD + i;
+    }
+    sim->endpoints[0].run = run_worker;
+    sim->endpoints[0].arg = &worker;
+    sim->endpoints[0].sockfd = SIM_SERVER_FD;
+    for (int i = 0; i < sim->num_endpoints; i++)
+    {
+        sim->endpoints[i].deadline = -1;
+        sim->endpoints[i].stack = malloc(SIM_STACK_SIZE);
+        if (sim->endpoints[i].stack == NULL)
+        {
+            perror("Could not allocate stack");
+            _exit(1);
+        }
+    }
+
+    int stalled = run_until_sent(config->time_limit) < 0;
+    long long elapsed = sim->now - SIM_START;
+    // Letting the server close its connection and file
+    worker.finished = 1;
+    if (sim->endpoints[0].started && !sim->endpoints[0].finished)
+    {
+        resume_endpoint(&sim->endpoints[0]);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < sim->num_endpoints; i++)
+    {
+        failed |= sim->endpoints[i].exit_status != 0;
+    }
+    for (int i = 0; i < num_streams; i++)
+    {
+        failed |= flows[i].failed;
+    }
+    failed |= worker.error != 0;
+    snprintf(output_name, sizeof(output_name), "output-%08x.txt", conn_id);
+    const char *result = stalled ? "stalled" : failed ? "failed" : worker.corrupt || !same_contents(config->filename, output_name) ? "corrupt" : "ok";
+    unlink(output_name);
+
+    long long sent = 0, resent = 0, timeouts = 0;
+    for (int i = 0; i < num_streams; i++)
+    {
+        sent += trace_read(&rings[i].counts[TRACE_SEND]);
+        resent += trace_read(&rings[i].counts[TRACE_RESEND]);
+        timeouts += trace_read(&rings[i].counts[TRACE_TIMEOUT]);
+    }
+    printf("%d,%.3f,%.2f,%lld,%lld,%.2f,%lld,%lld,%lld,%s\n", seed, elapsed / 1e6, elapsed > 0 && strcmp(result, "ok") == 0 ? src.size * 8.0 / elapsed : 0, sent, resent,
+           sent + resent > 0 ? 100.0 * resent / (sent + resent) : 0, timeouts, sim->links[0].lost + sim->links[1].lost,
+           sim->links[0].overflowed + sim->links[1].overflowed, result);
+
+    // Endpoints that stalled or gave up never got to free what they had, so only the simulator's own memory is freed
+    for (int i = 0; i < sim->num_endpoints; i++)
+    {
+        free_queue(&sim->endpoints[i].inbox);
+        free(sim->endpoints[i].stack);
+    }
+    free_queue(&sim->links[0].in_flight);
+    free_queue(&sim->links[1].in_flight);
+    free(sim->endpoints);
+    free(flows);
+    free(rings);
+    close_file_source(&src);
+    sim = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim_config config;
+    int first_seed = 0;
+    int num_runs = 1;
+    int opt;
+    config.cc_name = reno_ops.name;
+    config.num_streams = 1;
+    config.window_size = DEFAULT_BUFFER;
+    config.fec_block = 0;
+    config.packet_size = PACKET_SIZE;
+    config.loss_rate = 0;
+    config.delay = 10000;
+    config.rate = 10000;
+    config.queue_size = 100;
+    config.time_limit = 600000000;
+
+    while ((opt = getopt(argc, argv, "c:f:k:l:n:p:q:r:w:L:M:N:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.cc_name = optarg;
+            break;
+        case 'f':
+            config.fec_block = atoi(optarg);
+            break;
+        case 'k':
+            config.rate = atof(optarg);
+            break;
+        case 'l':
+            config.loss_rate = atof(optarg);
+            break;
+        case 'n':
+            config.num_streams = atoi(optarg);
+            break;
+        case 'p':
+            config.delay = atof(optarg) * 1e6;
+            break;
+        case 'q':
+            config.queue_size = atoi(optarg);
+            break;
+        case 'r':
+            first_seed = atoi(optarg);
+            break;
+        case 'w':
+            config.window_size = atoi(optarg);
+            break;
+        case 'L':
+            config.time_limit = atof(optarg) * 1e6;
+            break;
+        case 'M':
+            config.packet_size = atoi(optarg);
+            break;
+        case 'N':
+            num_runs = atoi(optarg);
+            break;
+        default:
+            config.window_size = 0;
+        }
+    }
+    struct congestion_control *cc = create_congestion_control(config.cc_name, config.window_size > 0 ? config.window_size : 1);
+    if (optind != argc - 1 || cc == NULL || config.window_size <= 0 || config.num_streams <= 0 || config.num_streams > MAX_STREAMS ||
+        config.packet_size <= HANDSHAKE_HEADER_SIZE || config.packet_size > MAX_PACKET_SIZE ||
+        (config.fec_block != 0 && (config.fec_block < FEC_MIN_BLOCK || config.fec_block > FEC_MAX_BLOCK)) || config.rate <= 0 ||
+        config.queue_size <= 0 || config.delay < 0 || config.time_limit <= 0 || num_runs <= 0)
+    {
+        printf("Usage: ./simulate [-c reno|cubic|bbr] [-f max_fec_block] [-k packets_per_second] [-l loss_rate] [-L time_limit_s] [-M packet_bytes] "
+               "[-n streams] [-N runs] [-p prop_delay_s] [-q queue_packets] [-r first_seed] [-w window_packets] <filename>\n");
+        return 1;
+    }
+    free(cc);
+    config.filename = argv[optind];
+
+    transport = &sim_transport;
+    printf("seed,seconds,goodput_mbit,sent,resent,retransmit_pct,timeouts,link_lost,link_overflowed,result\n");
+    for (int i = 0; i < num_runs; i++)
+    {
+        simulate_upload(&config, first_seed + i);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// MACROS
+#define TRACE_RING_SIZE 16384 // Records each ring holds - a power of two, so positions wrap with a mask
+#define TRACE_RECORD_SIZE 32 // Bytes of a record in the trace file - see write_trace_record
+#define TRACE_MAGIC "RDTRACE1" // The first 8 bytes of a trace file, followed by when tracing started (8)
+#define TRACE_FILE_HEADER_SIZE 16
+#define TRACE_FLUSH_INTERVAL 10000 // How often the flusher drains the rings, in microseconds
+#define TRACE_STATS_INTERVAL 1000000 // How often live statistics are printed, in microseconds
+#define TRACE_SEND 0 // Events - a new packet sent (value is its length)
+#define TRACE_RESEND 1 // A packet resent by fast retransmit or its timer (value is its length)
+#define TRACE_ACK 2 // An ACK that moved the window (seqnum is the ACK, extra the number of SACK blocks)
+#define TRACE_DUPACK 3 // A duplicate ACK (seqnum is the ACK, extra the number of SACK blocks)
+#define TRACE_TIMEOUT 4 // A retransmission deadline passed (value is the backed off RTO in microseconds)
+#define TRACE_CWND 5 // The window changed (value is cwnd and extra is ssthresh, both in thousandths of a packet)
+#define TRACE_RTT 6 // An RTT sample (value is the sample and extra the smoothed RTT, in microseconds)
+#define TRACE_RECOVERED 7 // The server rebuilt packets from parity (value is how many)
+#define TRACE_RECV 8 // The server received a packet (value is its length, extra the connection ID)
+#define TRACE_ACK_SENT 9 // The server sent an ACK (seqnum is the ACK, extra the connection ID)
+#define TRACE_DROP 10 // The server dropped a datagram that didn't parse or failed its CRC (value is its length)
+#define TRACE_SPURIOUS 11 // A timeout turned out to be spurious and was undone (value is the restored cwnd in thousandths)
+#define TRACE_EVENT_TYPES 12
+
+const char *trace_event_names[TRACE_EVENT_TYPES] = {
+    "send", "resend", "ack", "dupack", "timeout", "cwnd", "rtt", "recovered", "recv", "ack_sent", "drop", "spurious"};
+
+// One traced event.  Records are kept in memory in this form, and written big endian by the flusher
+struct trace_record
+{
+    long long time;
+    long long seqnum;
+    long long value;
+    unsigned int extra;
+    unsigned char event;
+    unsigned char stream;
+};
+
+// A ring of records with a single producer - the stream or worker thread that owns it - and a single consumer, the
+// flusher thread.  Neither ever waits for the other: a full ring drops the record and counts it instead.  Every
+// event is also counted and totaled here, whether or not records are kept, which is what statistics are built from
+struct trace_ring
+{
+    struct trace_record *records;
+    _Atomic unsigned long long head;
+    _Atomic unsigned long long tail;
+    _Atomic long long dropped;
+    _Atomic long long counts[TRACE_EVENT_TYPES];
+    _Atomic long long totals[TRACE_EVENT_TYPES];
+    _Atomic long long last[TRACE_EVENT_TYPES];
+};
+
+// Everything one process traces.  The rings are handed out up front, one for each thread that traces, and the
+// flusher thread writes their records to the trace file and prints live statistics if asked to
+struct tracer
+{
+    FILE *fp;
+    struct trace_ring *rings;
+    int num_rings;
+    int live_stats;
+    long long start;
+    // Called by the flusher with the rings every TRACE_STATS_INTERVAL when live_stats is set
+    void (*print_stats)(struct tracer *tracer, long long now);
+    _Atomic int stop;
+    pthread_t thread;
+};
+
+// Utility functions for the single writer of a counter - a relaxed store is all that's needed for the flusher to
+// see it eventually, and it's much cheaper than an atomic read-modify-write
+void trace_add(_Atomic long long *counter, long long amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+long long trace_read(_Atomic long long *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Function that traces one event on the calling thread's ring - does nothing when ring is NULL, so the call sites
+// don't need to check whether tracing is on
+void trace_event(struct trace_ring *ring, int event, int stream, long long seqnum, long long value, unsigned int extra)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    trace_add(&ring->counts[event], 1);
+    trace_add(&ring->totals[event], value);
+    atomic_store_explicit(&ring->last[event], value, memory_order_relaxed);
+    if (ring->records == NULL)
+    {
+        return;
+    }
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE)
+    {
+        trace_add(&ring->dropped, 1);
+        return;
+    }
+    struct trace_record *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->time = get_time_us();
+    record->seqnum = seqnum;
+    record->value = value;
+    record->extra = extra;
+    record->event = event;
+    record->stream = stream;
+    // Publishing the record only once it's been filled in
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Function that writes a record in its file format:
+//   time since tracing started (8) | seqnum (8) | value (8) | extra (4) | event (1) | stream (1) | unused (2)
+void write_trace_record(char *buf, const struct trace_record *record, long long start)
+{
+    put_u64(buf, record->time - start);
+    put_u64(buf + 8, record->seqnum);
+    put_u64(buf + 16, record->value);
+    put_u32(buf + 24, record->extra);
+    buf[28] = record->event;
+    buf[29] = record->stream;
+    put_u16(buf + 30, 0);
+}
+
+// Function that reads a record written by write_trace_record - the time is left relative to the start of the trace
+void read_trace_record(const char *buf, struct trace_record *record)
+{
+    record->time = get_u64(buf);
+    record->seqnum = get_u64(buf + 8);
+    record->value = get_u64(buf + 16);
+    record->extra = get_u32(buf + 24);
+    record->event = buf[28];
+    record->stream = buf[29];
+}
+
+// Function that moves every record published so far from the rings to the trace file
+void drain_trace_rings(struct tracer *tracer)
+{
+    char buf[TRACE_RECORD_SIZE];
+    for (int i = 0; tracer->fp != NULL && i < tracer->num_rings; i++)
+    {
+        struct trace_ring *ring = &tracer->rings[i];
+        unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail < head; tail++)
+        {
+            write_trace_record(buf, &ring->records[tail & (TRACE_RING_SIZE - 1)], tracer->start);
+            fwrite(buf, 1, TRACE_RECORD_SIZE, tracer->fp);
+        }
+        // Handing the slots back to the producer only once they've been copied out
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    // A listening server never exits, so the file is kept up to date as it goes
+    if (tracer->fp != NULL)
+    {
+        fflush(tracer->fp);
+    }
+}
+
+void *run_flusher(void *arg)
+{
+    struct tracer *tracer = arg;
+    long long next_stats = tracer->start + TRACE_STATS_INTERVAL;
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL * 1000};
+    while (!atomic_load(&tracer->stop))
+    {
+        nanosleep(&interval, NULL);
+        drain_trace_rings(tracer);
+        long long now = get_time_us();
+        if (tracer->live_stats && now >= next_stats)
+        {
+            tracer->print_stats(tracer, now);
+            next_stats += TRACE_STATS_INTERVAL;
+        }
+    }
+    return NULL;
+}
+
+// Utility function to close the trace file and free the rings, leaving errno as it was
+void free_tracer(struct tracer *tracer)
+{
+    int saved = errno;
+    if (tracer->fp != NULL)
+    {
+        fclose(tracer->fp);
+    }
+    for (int i = 0; i < tracer->num_rings; i++)
+    {
+        free(tracer->rings[i].records);
+    }
+    free(tracer->rings);
+    errno = saved;
+}
+
+// Function that sets up tracing for num_rings threads, writing records to filename (or only counting events if
+// it's NULL) - returns -1 with errno set if the trace file can't be created or tracing can't be set up
+int start_tracer(struct tracer *tracer, const char *filename, int num_rings, int live_stats, void (*print_stats)(struct tracer *, long long))
+{
+    char header[TRACE_FILE_HEADER_SIZE];
+    memset(tracer, 0, sizeof(*tracer));
+    tracer->num_rings = num_rings;
+    tracer->live_stats = live_stats;
+    tracer->print_stats = print_stats;
+    tracer->start = get_time_us();
+    tracer->rings = calloc(num_rings, sizeof(struct trace_ring));
+    if (tracer->rings == NULL)
+    {
+        return -1;
+    }
+    if (filename != NULL)
+    {
+        tracer->fp = fopen(filename, "wb");
+        if (tracer->fp == NULL)
+        {
+            free(tracer->rings);
+            return -1;
+        }
+        memcpy(header, TRACE_MAGIC, 8);
+        put_u64(header + 8, tracer->start);
+        fwrite(header, 1, TRACE_FILE_HEADER_SIZE, tracer->fp);
+        for (int i = 0; i < num_rings; i++)
+        {
+            tracer->rings[i].records = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+            if (tracer->rings[i].records == NULL)
+            {
+                free_tracer(tracer);
+                return -1;
+            }
+        }
+    }
+    int result = pthread_create(&tracer->thread, NULL, run_flusher, tracer);
+    if (result != 0)
+    {
+        free_tracer(tracer);
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+// Function that stops the flusher once every traced thread is done, and writes out whatever it hadn't yet
+void stop_tracer(struct tracer *tracer)
+{
+    atomic_store(&tracer->stop, 1);
+    pthread_join(tracer->thread, NULL);
+    drain_trace_rings(tracer);
+    free_tracer(tracer);
+}
+
+// Utility functions to add up one event's count, or the total of its values, across every ring
+long long trace_count(struct tracer *tracer, int event)
+{
+    long long sum = 0;
+    for (int i = 0; i < tracer->num_rings; i++)
+    {
+        sum += trace_read(&tracer->rings[i].counts[event]);
+    }
+    return sum;
+}
+
+long long trace_total(struct tracer *tracer, int event)
+{
+    long long sum = 0;
+    for (int i = 0; i < tracer->num_rings; i++)
+    {
+        sum += trace_read(&tracer->rings[i].totals[event]);
+    }
+    return sum;
+}
+
+long long trace_dropped(struct tracer *tracer)
+{
+    long long sum = 0;
+    for (int i = 0; i < tracer->num_rings; i++)
+    {
+        sum += trace_read(&tracer->rings[i].dropped);
+    }
+    return sum;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "trace.h"
+
+// Turns a trace file written by the client or server with -T into CSV, one line per record.  Times are in
+// microseconds since tracing started, and the value and extra columns mean what the event's TRACE_ macro says
+int main(int argc, char *argv[])
+{
+    char buf[TRACE_FILE_HEADER_SIZE > TRACE_RECORD_SIZE ? TRACE_FILE_HEADER_SIZE : TRACE_RECORD_SIZE];
+    struct trace_record record;
+    if (argc != 2)
+    {
+        printf("Usage: ./trace_decode <trace_file|->\n");
+        return 1;
+    }
+    FILE *fp = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "rb");
+    if (fp == NULL)
+    {
+        perror("Error opening trace file");
+        return 1;
+    }
+    if (fread(buf, 1, TRACE_FILE_HEADER_SIZE, fp) != TRACE_FILE_HEADER_SIZE || memcmp(buf, TRACE_MAGIC, 8) != 0)
+    {
+        printf("%s isn't a trace file\n", argv[1]);
+        return 1;
+    }
+    printf("time_us,event,stream,seqnum,value,extra\n");
+    while (fread(buf, 1, TRACE_RECORD_SIZE, fp) == TRACE_RECORD_SIZE)
+    {
+        read_trace_record(buf, &record);
+        // Events this decoder doesn't know about are still printed, by number
+        if (record.event < TRACE_EVENT_TYPES)
+        {
+            printf("%lld,%s,%d,%lld,%lld,%u\n", record.time, trace_event_names[record.event], record.stream, record.seqnum, record.value, record.extra);
+        }
+        else
+        {
+            printf("%lld,%d,%d,%lld,%lld,%u\n", record.time, record.event, record.stream, record.seqnum, record.value, record.extra);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,850 @@
+#ifndef URING_H
+#define URING_H
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+// An io_uring transport, which stands in for the UDP one once use_uring_transport is called.  Each thread that
+// runs an event loop gets a ring of its own, and everything the thread sends, receives, waits for and does to the
+// file goes through it:
+// - the event loop's socket is read with one multishot receive, which the kernel keeps filling buffers from a
+//   registered ring with as datagrams arrive, so receiving costs no syscalls at all
+// - sends are copied into slots and queued, and go to the kernel with the next wait
+// - reads and writes of the file are queued along with them, so queued sends and a file operation share a syscall
+// - waiting is a single io_uring_enter with a timeout, rather than arming a timerfd and calling epoll_wait
+// The transfer logic doesn't know any of this - it still sees send_datagrams, recv_datagrams, wait_for_events and
+// read_file_at/write_file_at.  A thread without an event loop (or a socket other than its loop's) falls back to
+// the plain system calls.  Built only where the kernel headers have io_uring, since there's no liburing to lean on
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+
+// MACROS
+#define URING_ENTRIES 256 // Submission queue entries, which is also the most sends queued or in flight at once
+#define URING_CQ_ENTRIES 1024 // Room for every send, receive and poll that can complete between two looks at it
+#define URING_RECV_MEMORY 4194304 // Bytes of receive buffers the multishot receive can fill before we catch up
+#define URING_RECV_BUFFERS 256 // The most receive buffers - a power of two, as the buffer ring needs
+#define URING_BUFFER_GROUP 0 // Each ring registers one buffer ring, so it can always use the same group
+#define URING_RECV 1 // What a completion is for, kept in the top half of its user_data (a send's slot is the bottom)
+#define URING_SEND 2
+#define URING_FILE 3
+#define URING_POLL_SOCKET 4
+#define URING_POLL_INPUT 5
+#define URING_CANCEL 6
+
+// A queued send.  The message is copied, since whatever the caller built it from is gone by the time it's
+// submitted
+struct uring_send
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    // Room for a UDP_SEGMENT control message
+    union
+    {
+        char buf[64];
+        struct cmsghdr align;
+    } control;
+    char *buf;
+    size_t buf_size;
+};
+
+// A datagram the multishot receive has put in one of our buffers, waiting for recv_datagrams
+struct uring_recv
+{
+    int buf_id;
+    // Bytes of the buffer used, headers included
+    int res;
+};
+
+struct uring
+{
+    int fd;
+    // The submission queue, with our tail running ahead of the kernel's head until the next io_uring_enter
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // The event loop's socket.  Its multishot receive is started by the first recv_datagrams, which says how big
+    // the buffers need to be - until then, and for good if the kernel can't do it, the socket is polled instead
+    int sockfd;
+    struct msghdr recv_msg;
+    struct sockaddr_storage recv_name;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *bufs;
+    int num_bufs;
+    int buf_size;
+    unsigned short buf_tail;
+    int recv_armed;
+    int recv_failed;
+    int recv_error;
+    // A send that failed after uring_send had queued it, handed to the caller by the next uring_send
+    int send_error;
+    // The errno of an io_uring_enter that failed, after which the ring is no use and everything on it fails
+    int error;
+    // Received datagrams in the order they arrived, as a circular buffer - never more than there are buffers
+    struct uring_recv *received;
+    int recv_head;
+    int num_received;
+    int socket_polled;
+    int socket_ready;
+    int input_polled;
+    int input_ready;
+    struct uring_send *sends;
+    int *free_sends;
+    int num_free;
+    // The result of the file operation being waited for
+    int file_done;
+    int file_res;
+};
+
+// The ring of the thread's event loop, or NULL if it doesn't have one
+__thread struct uring *thread_ring = NULL;
+
+int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned num_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, num_args);
+}
+
+// Utility function to map part of a ring into memory - returns NULL if it can't be
+void *map_ring(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ptr == MAP_FAILED)
+    {
+        perror("Could not map io_uring");
+        return NULL;
+    }
+    return ptr;
+}
+
+// Function that frees a ring and whatever of it was set up, keeping errno for the caller
+void destroy_ring(struct uring *ring)
+{
+    int saved = errno;
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != NULL)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->bufs != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->bufs);
+    free(ring->received);
+    for (int i = 0; ring->sends != NULL && i < URING_ENTRIES; i++)
+    {
+        free(ring->sends[i].buf);
+    }
+    free(ring->sends);
+    free(ring->free_sends);
+    free(ring);
+    errno = saved;
+}
+
+// Function that sets up the ring for an event loop on sockfd - returns NULL, saying why, if it can't be
+struct uring *create_ring(int sockfd)
+{
+    struct io_uring_params params;
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL)
+    {
+        perror("Could not allocate io_uring");
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        perror("Could not set up io_uring");
+        destroy_ring(ring);
+        return NULL;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    ring->sends = calloc(URING_ENTRIES, sizeof(struct uring_send));
+    ring->free_sends = malloc(URING_ENTRIES * sizeof(int));
+    if (ring->sends == NULL || ring->free_sends == NULL)
+    {
+        perror("Could not allocate io_uring");
+    }
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL || ring->sends == NULL || ring->free_sends == NULL)
+    {
+        destroy_ring(ring);
+        return NULL;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    // Every entry is always at the same index of the array
+    for (unsigned i = 0; i < ring->sq_entries; i++)
+    {
+        ring->sq_array[i] = i;
+    }
+    ring->tail = *ring->sq_tail;
+    ring->sockfd = sockfd;
+    for (int i = 0; i < URING_ENTRIES; i++)
+    {
+        ring->free_sends[i] = URING_ENTRIES - 1 - i;
+    }
+    ring->num_free = URING_ENTRIES;
+    return ring;
+}
+
+// Function that submits everything queued and, if min_complete is above 0, waits until that many completions are
+// waiting or timeout microseconds have passed (forever if it's negative) - returns -1 if the ring has failed
+int enter_ring(struct uring *ring, unsigned min_complete, long long timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned to_submit = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = 0;
+    if (ring->error != 0)
+    {
+        errno = ring->error;
+        return -1;
+    }
+    if (to_submit == 0 && min_complete == 0)
+    {
+        return 0;
+    }
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0)
+    {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000000;
+            ts.tv_nsec = (timeout % 1000000) * 1000;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+    }
+    // Running out of time, a signal and a full completion queue all just mean looking at what's there
+    if (uring_enter(ring->fd, to_submit, min_complete, flags, flags != 0 ? &arg : NULL, flags != 0 ? sizeof(arg) : 0) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        perror("Error entering io_uring");
+        ring->error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Function that gets a cleared submission queue entry to fill in, making room first if the queue is full.  It's
+// only handed to the kernel once push_sqe is called - returns NULL if the ring has failed
+struct io_uring_sqe *next_sqe(struct uring *ring)
+{
+    if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries && enter_ring(ring, 0, 0) < 0)
+    {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void push_sqe(struct uring *ring)
+{
+    ring->tail++;
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+int sends_in_flight(struct uring *ring)
+{
+    return URING_ENTRIES - ring->num_free;
+}
+
+// Function that gives a receive buffer back to the kernel to fill again
+void return_buffer(struct uring *ring, int buf_id)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->num_bufs - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)(ring->bufs + (size_t)buf_id * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = buf_id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// The ring's error is all a failure to get an entry here leaves behind, and the caller's next wait returns it
+void arm_recv(struct uring *ring)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->sockfd;
+    sqe->addr = (unsigned long long)(uintptr_t)&ring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (unsigned long long)URING_RECV << 32;
+    push_sqe(ring);
+    ring->recv_armed = 1;
+}
+
+void poll_fd(struct uring *ring, int fd, int kind)
+{
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (unsigned long long)kind << 32;
+    push_sqe(ring);
+}
+
+// Function that sets up the buffers for the multishot receive and starts it.  Each buffer has room for the
+// header the kernel puts in front of a datagram, its address, the control messages the caller has room for and
+// as much data as the caller's buffers hold - returns -1 if they can't be allocated
+int start_receiving(struct uring *ring, const struct msghdr *hdr)
+{
+    struct io_uring_buf_reg reg;
+    size_t payload_size = 0;
+    for (size_t i = 0; i < hdr->msg_iovlen; i++)
+    {
+        payload_size += hdr->msg_iov[i].iov_len;
+    }
+    ring->buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + hdr->msg_controllen + payload_size;
+    ring->num_bufs = URING_RECV_BUFFERS;
+    while (ring->num_bufs > 1 && (long long)ring->num_bufs * ring->buf_size > URING_RECV_MEMORY)
+    {
+        ring->num_bufs /= 2;
+    }
+    ring->buf_ring_size = ring->num_bufs * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)ring->num_bufs * ring->buf_size);
+    ring->received = malloc(ring->num_bufs * sizeof(struct uring_recv));
+    if (ring->buf_ring == MAP_FAILED || ring->bufs == NULL || ring->received == NULL)
+    {
+        perror("Could not allocate receive buffers");
+        if (ring->buf_ring != MAP_FAILED)
+        {
+            munmap(ring->buf_ring, ring->buf_ring_size);
+        }
+        free(ring->bufs);
+        free(ring->received);
+        ring->bufs = NULL;
+        ring->received = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = ring->num_bufs;
+    reg.bgid = URING_BUFFER_GROUP;
+    // Too old a kernel for buffer rings only means receiving the usual way
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        ring->recv_failed = 1;
+        return 0;
+    }
+    ring->buf_tail = 0;
+    for (int i = 0; i < ring->num_bufs; i++)
+    {
+        return_buffer(ring, i);
+    }
+    // The kernel only looks at the sizes here - the address and control messages go in the buffers
+    memset(&ring->recv_msg, 0, sizeof(ring->recv_msg));
+    ring->recv_msg.msg_name = &ring->recv_name;
+    ring->recv_msg.msg_namelen = sizeof(ring->recv_name);
+    ring->recv_msg.msg_controllen = hdr->msg_controllen;
+    arm_recv(ring);
+    return 0;
+}
+
+void handle_recv_completion(struct uring *ring, int res, unsigned flags)
+{
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        struct uring_recv *entry = &ring->received[(ring->recv_head + ring->num_received) % ring->num_bufs];
+        entry->buf_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        entry->res = res;
+        ring->num_received++;
+    }
+    // Running out of buffers only stops the receive until some are given back, and a kernel that can't receive
+    // this way at all leaves the socket to recvmmsg
+    else if (res == -EINVAL || res == -EOPNOTSUPP)
+    {
+        ring->recv_failed = 1;
+    }
+    else if (res < 0 && res != -ENOBUFS && res != -ECANCELED)
+    {
+        ring->recv_error = -res;
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        ring->recv_armed = 0;
+    }
+}
+
+// Function that handles every completion waiting in the ring
+void reap_ring(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int kind = cqe->user_data >> 32;
+        if (kind == URING_RECV)
+        {
+            handle_recv_completion(ring, cqe->res, cqe->flags);
+        }
+        else if (kind == URING_SEND)
+        {
+            // The caller was told the send worked, so a failure is handed to it by the next send instead, the way
+            // a failed sendmmsg would have been
+            if (cqe->res < 0 && ring->send_error == 0)
+            {
+                ring->send_error = -cqe->res;
+            }
+            ring->free_sends[ring->num_free++] = cqe->user_data & 0xffffffff;
+        }
+        else if (kind == URING_FILE)
+        {
+            ring->file_res = cqe->res;
+            ring->file_done = 1;
+        }
+        else if (kind == URING_POLL_SOCKET)
+        {
+            ring->socket_polled = 0;
+            ring->socket_ready = 1;
+        }
+        else if (kind == URING_POLL_INPUT)
+        {
+            ring->input_polled = 0;
+            ring->input_ready = 1;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Function that copies a received datagram out of its buffer into a caller's message, the way recvmsg would have
+// filled it in - returns the bytes of data copied
+unsigned int copy_datagram(struct uring *ring, const struct uring_recv *entry, struct msghdr *hdr)
+{
+    char *buf = ring->bufs + (size_t)entry->buf_id * ring->buf_size;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *name = buf + sizeof(*out);
+    char *control = name + ring->recv_msg.msg_namelen;
+    char *data = control + ring->recv_msg.msg_controllen;
+    size_t left = entry->res - (data - buf);
+    unsigned int copied = 0;
+    if (hdr->msg_name != NULL)
+    {
+        memcpy(hdr->msg_name, name, fmin(out->namelen, hdr->msg_namelen));
+    }
+    hdr->msg_namelen = out->namelen;
+    if (hdr->msg_control != NULL)
+    {
+        hdr->msg_controllen = fmin(out->controllen, hdr->msg_controllen);
+        memcpy(hdr->msg_control, control, hdr->msg_controllen);
+    }
+    hdr->msg_flags = out->flags;
+    for (size_t i = 0; i < hdr->msg_iovlen && left > 0; i++)
+    {
+        size_t len = fmin(left, hdr->msg_iov[i].iov_len);
+        memcpy(hdr->msg_iov[i].iov_base, data + copied, len);
+        copied += len;
+        left -= len;
+    }
+    if (left > 0)
+    {
+        hdr->msg_flags |= MSG_TRUNC;
+    }
+    return copied;
+}
+
+int uring_recv(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    struct uring *ring = thread_ring;
+    unsigned int num_copied = 0;
+    if (ring == NULL || sockfd != ring->sockfd || ring->recv_failed)
+    {
+        return udp_recv(sockfd, msgs, count);
+    }
+    // Submitting the receive straight away picks up whatever is already waiting
+    if (ring->bufs == NULL && (start_receiving(ring, &msgs[0].msg_hdr) < 0 || enter_ring(ring, 0, 0) < 0))
+    {
+        return -1;
+    }
+    if (ring->error != 0)
+    {
+        errno = ring->error;
+        return -1;
+    }
+    reap_ring(ring);
+    if (ring->recv_error != 0)
+    {
+        errno = ring->recv_error;
+        ring->recv_error = 0;
+        return -1;
+    }
+    while (num_copied < count && ring->num_received > 0)
+    {
+        struct uring_recv *entry = &ring->received[ring->recv_head];
+        msgs[num_copied].msg_len = copy_datagram(ring, entry, &msgs[num_copied].msg_hdr);
+        return_buffer(ring, entry->buf_id);
+        ring->recv_head = (ring->recv_head + 1) % ring->num_bufs;
+        ring->num_received--;
+        num_copied++;
+    }
+    if (num_copied == 0)
+    {
+        if (ring->recv_failed)
+        {
+            return udp_recv(sockfd, msgs, count);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    return num_copied;
+}
+
+int uring_send(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    struct uring *ring = thread_ring;
+    if (ring == NULL)
+    {
+        return udp_send(sockfd, msgs, count);
+    }
+    reap_ring(ring);
+    if (ring->error != 0 || ring->send_error != 0)
+    {
+        errno = ring->error != 0 ? ring->error : ring->send_error;
+        ring->send_error = 0;
+        return -1;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        size_t len = 0;
+        // Anything our messages never carry is sent straight away
+        if (hdr->msg_namelen > sizeof(struct sockaddr_storage) || hdr->msg_controllen > sizeof(ring->sends[0].control))
+        {
+            ssize_t sent = sendmsg(sockfd, hdr, 0);
+            if (sent < 0)
+            {
+                return i > 0 ? (int)i : -1;
+            }
+            msgs[i].msg_len = sent;
+            continue;
+        }
+        while (ring->num_free == 0)
+        {
+            if (enter_ring(ring, 1, -1) < 0)
+            {
+                return i > 0 ? (int)i : -1;
+            }
+            reap_ring(ring);
+        }
+        int index = ring->free_sends[--ring->num_free];
+        struct uring_send *send = &ring->sends[index];
+        for (size_t j = 0; j < hdr->msg_iovlen; j++)
+        {
+            len += hdr->msg_iov[j].iov_len;
+        }
+        if (len > send->buf_size)
+        {
+            char *buf = realloc(send->buf, len);
+            if (buf == NULL)
+            {
+                perror("Could not allocate send buffer");
+                ring->free_sends[ring->num_free++] = index;
+                return i > 0 ? (int)i : -1;
+            }
+            send->buf = buf;
+            send->buf_size = len;
+        }
+        len = 0;
+        for (size_t j = 0; j < hdr->msg_iovlen; j++)
+        {
+            memcpy(send->buf + len, hdr->msg_iov[j].iov_base, hdr->msg_iov[j].iov_len);
+            len += hdr->msg_iov[j].iov_len;
+        }
+        memset(&send->msg, 0, sizeof(send->msg));
+        send->iov.iov_base = send->buf;
+        send->iov.iov_len = len;
+        send->msg.msg_iov = &send->iov;
+        send->msg.msg_iovlen = 1;
+        if (hdr->msg_name != NULL)
+        {
+            memcpy(&send->addr, hdr->msg_name, hdr->msg_namelen);
+            send->msg.msg_name = &send->addr;
+            send->msg.msg_namelen = hdr->msg_namelen;
+        }
+        if (hdr->msg_controllen > 0)
+        {
+            memcpy(send->control.buf, hdr->msg_control, hdr->msg_controllen);
+            send->msg.msg_control = send->control.buf;
+            send->msg.msg_controllen = hdr->msg_controllen;
+        }
+        struct io_uring_sqe *sqe = next_sqe(ring);
+        if (sqe == NULL)
+        {
+            ring->free_sends[ring->num_free++] = index;
+            return i > 0 ? (int)i : -1;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (unsigned long long)(uintptr_t)&send->msg;
+        sqe->len = 1;
+        sqe->user_data = ((unsigned long long)URING_SEND << 32) | index;
+        push_sqe(ring);
+        msgs[i].msg_len = len;
+    }
+    return count;
+}
+
+int uring_init_loop(struct event_loop *loop, int sockfd)
+{
+    loop->epfd = -1;
+    loop->timerfd = -1;
+    loop->sockfd = sockfd;
+    loop->inputfd = -1;
+    loop->input_watched = 0;
+    loop->armed = -1;
+    thread_ring = create_ring(sockfd);
+    return thread_ring != NULL ? 0 : -1;
+}
+
+void uring_free_loop(struct event_loop *loop)
+{
+    struct uring *ring = thread_ring;
+    (void)loop;
+    if (ring == NULL)
+    {
+        return;
+    }
+    // Queued sends still have to go out - the server's last ACK may be one of them
+    while (sends_in_flight(ring) > 0 && enter_ring(ring, 1, -1) == 0)
+    {
+        reap_ring(ring);
+    }
+    // The kernel keeps writing into the receive buffers until the multishot receive has been cancelled
+    struct io_uring_sqe *sqe = ring->recv_armed ? next_sqe(ring) : NULL;
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long long)URING_RECV << 32;
+        sqe->user_data = (unsigned long long)URING_CANCEL << 32;
+        push_sqe(ring);
+        while (ring->recv_armed && enter_ring(ring, 1, -1) == 0)
+        {
+            reap_ring(ring);
+        }
+    }
+    destroy_ring(ring);
+    thread_ring = NULL;
+}
+
+// Function that submits whatever's queued and sleeps until a datagram has been received, the input is readable
+// or the deadline passes.  The wait also lasts until every send in flight has completed, which they almost always
+// have by the time io_uring_enter has submitted them, so sends don't wake us up on their own
+int uring_wait(struct event_loop *loop, long long deadline)
+{
+    struct uring *ring = thread_ring;
+    while (1)
+    {
+        int ready = 0;
+        reap_ring(ring);
+        if (ring->num_received > 0 || ring->recv_error != 0 || ring->socket_ready)
+        {
+            ready |= EVENT_SOCKET;
+        }
+        if (ring->input_ready && loop->input_watched)
+        {
+            ready |= EVENT_INPUT;
+        }
+        ring->socket_ready = 0;
+        ring->input_ready = 0;
+        if (ring->error != 0)
+        {
+            errno = ring->error;
+            return -1;
+        }
+        long long now = get_time_us();
+        if (deadline >= 0 && now >= deadline)
+        {
+            ready |= EVENT_TIMER;
+        }
+        if (ready)
+        {
+            return enter_ring(ring, 0, 0) < 0 ? -1 : ready;
+        }
+        if (ring->bufs != NULL && !ring->recv_failed)
+        {
+            if (!ring->recv_armed)
+            {
+                arm_recv(ring);
+            }
+        }
+        else if (!ring->socket_polled)
+        {
+            poll_fd(ring, loop->sockfd, URING_POLL_SOCKET);
+            ring->socket_polled = 1;
+        }
+        if (loop->input_watched && !ring->input_polled)
+        {
+            poll_fd(ring, loop->inputfd, URING_POLL_INPUT);
+            ring->input_polled = 1;
+        }
+        if (enter_ring(ring, sends_in_flight(ring) + 1, deadline < 0 ? -1 : deadline - now) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// The input is polled in uring_wait while it's watched
+int uring_watch(struct event_loop *loop, int fd, int enabled)
+{
+    loop->inputfd = fd;
+    loop->input_watched = enabled;
+    return 0;
+}
+
+// Function that runs a file operation through the ring, along with any queued sends, and waits for it
+ssize_t run_file_op(int opcode, int fd, const struct iovec *iov, int count, off_t offset)
+{
+    struct uring *ring = thread_ring;
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)iov;
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long long)URING_FILE << 32;
+    push_sqe(ring);
+    ring->file_done = 0;
+    while (!ring->file_done)
+    {
+        if (enter_ring(ring, sends_in_flight(ring) + 1, -1) < 0)
+        {
+            return -1;
+        }
+        reap_ring(ring);
+    }
+    if (ring->file_res < 0)
+    {
+        errno = -ring->file_res;
+        return -1;
+    }
+    return ring->file_res;
+}
+
+ssize_t uring_read_file(int fd, const struct iovec *iov, int count, off_t offset)
+{
+    if (thread_ring == NULL)
+    {
+        return udp_read_file(fd, iov, count, offset);
+    }
+    return run_file_op(IORING_OP_READV, fd, iov, count, offset);
+}
+
+ssize_t uring_write_file(int fd, const struct iovec *iov, int count, off_t offset)
+{
+    if (thread_ring == NULL)
+    {
+        return udp_write_file(fd, iov, count, offset);
+    }
+    return run_file_op(IORING_OP_WRITEV, fd, iov, count, offset);
+}
+
+const struct transport_ops uring_transport = {
+    "io_uring", udp_now, uring_send, uring_recv, uring_init_loop, uring_free_loop, uring_wait, uring_watch, uring_read_file, uring_write_file};
+
+// Function that switches every transfer after it to io_uring - returns -1, saying why, if the kernel can't do it
+int use_uring_transport(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uring_setup(2, &params);
+    if (fd < 0)
+    {
+        perror("io_uring isn't available");
+        return -1;
+    }
+    close(fd);
+    // Waiting with a timeout needs IORING_ENTER_EXT_ARG
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        printf("This kernel's io_uring is too old\n");
+        return -1;
+    }
+    transport = &uring_transport;
+    return 0;
+}
+
+#else
+
+int use_uring_transport(void)
+{
+    printf("Built without io_uring\n");
+    return -1;
+}
+
+#endif
+#endif
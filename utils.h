@@ -1,62 +1,721 @@
-#ifndef UTILS_H
-#define UTILS_H
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-// MACROS
-#define SERVER_IP "127.0.0.1"
-#define LOCAL_HOST "127.0.0.1"
-#define SERVER_PORT_TO 5002
-#define CLIENT_PORT 6001
-#define SERVER_PORT 6002
-#define CLIENT_PORT_TO 5001
-#define PACKET_SIZE 1200
-#define HEADER_SIZE 10 // If I make this 6 or 8 it breaks - unsure why, but when it's lower not all data is sent.  This appears to work and we can afford to lose a few bytes
-#define PAYLOAD_SIZE (PACKET_SIZE - HEADER_SIZE)
-#define WINDOW_SIZE 5
-#define TIMEOUT 2
-#define MAX_SEQUENCE 1024
-#define MAX_BUFFER 50
-#define ALPHA 0.125
-#define BETA 0.25
-#define SSTHRESH 5
-#define INITIAL_WINDOW 1
-#define PRINT_STATEMENTS 0
-// Packet Layout
-// You may change this if you want to
-struct packet
-{
-    unsigned short length;
-    int seqnum;
-    char payload[PAYLOAD_SIZE];
-};
-
-// Utility function to build a packet
-void build_packet(struct packet *pkt, int seqnum, unsigned short length, const char *payload)
-{
-    pkt->seqnum = seqnum;
-    pkt->length = length;
-    memcpy(pkt->payload, payload, length);
-}
-
-// Utility function to print a packet
-void printRecv(struct packet *pkt)
-{
-    printf("RECV %d LENGTH %d\n", pkt->seqnum, pkt->length);
-}
-
-void printSend(struct packet *pkt, int resend)
-{
-    if (resend)
-        printf("RESEND %d LENGTH %d\n", pkt->seqnum, pkt->length);
-    else
-        printf("SEND %d LENGTH %d\n", pkt->seqnum, pkt->length);
-}
-
-void printPacket(struct packet *pkt)
-{
-    printf("%s\n", pkt->payload);
-}
-
+#ifndef UTILS_H
+#define UTILS_H
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// MACROS
+#define SERVER_IP "127.0.0.1"
+#define LOCAL_HOST "127.0.0.1"
+#define SERVER_PORT_TO 5002
+#define CLIENT_PORT 6001
+#define SERVER_PORT 6002
+#define CLIENT_PORT_TO 5001
+#define PACKET_SIZE 1200 // The default datagram size - both programs take -M to change it
+#define MAX_PACKET_SIZE 65507 // The largest UDP payload over IPv4
+#define HEADER_SIZE 20 // Bytes of the packet header on the wire - see write_header
+#define HANDSHAKE_HEADER_SIZE 22 // Handshakes also carry the payload size the file is cut into
+#define CRC_OFFSET 16 // Where the CRC32C sits in packet and ACK headers
+#define CRC32C_POLY 0x82F63B78 // The Castagnoli polynomial, bit reversed
+#define FLAG_HANDSHAKE 1
+#define FLAG_STREAM 2 // Set on the handshake of an upload whose length isn't known up front
+#define FLAG_FIN 4 // Set on the last data packet of a streamed upload
+#define FLAG_PARITY 8 // Set on forward error correction packets - see fec_encoder in client.c
+#define FLAG_COMPRESSED 16 // Set on the handshake of an upload whose payload is compressed records - see compressor in client.c
+#define FLAG_RESUME 32 // Set on a handshake that carries a resume key instead of the first packet - see save_checkpoint in server.c
+#define FLAG_DIGEST 64 // Set on the packet after a stream's data, which carries the CRC32C of all of it
+#define DIGEST_SIZE 4
+#define READBACK_SIZE 65536 // Bytes the server reads back at a time to digest packets that were written out of order
+#define DIRECT_RESERVE 67108864 // Bytes of a direct mode file reserved at a time, ahead of the packets written to it
+#define UNKNOWN_LENGTH LLONG_MAX // The packet count of a streamed upload until its FIN arrives
+#define MAX_GSO_SEGMENTS 64 // The most segments the kernel will take in one UDP_SEGMENT send (UDP_MAX_SEGMENTS)
+#define GRO_BUFFER_SIZE 65536 // Big enough for anything UDP_GRO coalesces
+#define WINDOW_SIZE 5
+#define INITIAL_RTO 1000000 // All RTO values are in microseconds - the initial value follows RFC 6298
+#define MIN_RTO 200000 // Linux's floor - RFC 6298 asks for a second, but with F-RTO undoing spurious timeouts this is enough
+#define MAX_RTO 60000000
+#define TAIL_PROBE_MIN 10000 // A tail loss probe waits two SRTTs and the server's ACK delay, but never less than this
+#define MAX_HANDSHAKE_ATTEMPTS 5 // Handshakes a stream sends (with the RTO backing off) before giving up on the server
+#define CLOCK_GRANULARITY 1000
+#define MAX_SEQUENCE 1024
+#define DEFAULT_BUFFER 50 // Packets each side buffers by default - both programs take -w to change it
+#define ALPHA 0.125
+#define BETA 0.25
+#define SSTHRESH 5
+#define INITIAL_WINDOW 1
+#define PRINT_STATEMENTS 0
+#define MAX_SACK_BLOCKS 8
+#define ACK_EVERY 2 // By default the server ACKs every second in order packet
+#define ACK_DELAY 1000 // or once one has waited this many microseconds
+#define PACING_SLACK 500 // Paced packets due within this many microseconds are sent together
+#define MAX_BATCH 1024 // The most messages sendmmsg/recvmmsg will take in one call (UIO_MAXIOV)
+#define FILE_BATCH 64 // The most packets read or written with one call to the file
+#define EVENT_SOCKET 1 // What wait_for_events woke up for
+#define EVENT_TIMER 2
+#define EVENT_INPUT 4
+#define MAX_STREAMS 255 // Stream IDs have to fit in one byte of the header
+#define CONN_BUCKETS 1024 // Buckets in each server worker's connection table
+#define CONN_TIMEOUT 60000000 // A connection that hasn't sent anything for this many microseconds is dropped
+#define STOP_CHECK_INTERVAL 100000 // How often a worker with others looks for whether one of them has given up
+#define PROTOCOL_VERSION 4 // Packets and ACKs with any other version are dropped
+#define CONN_ID_OFFSET 4 // Where the connection ID sits in the packet header
+#define ACK_HEADER_SIZE 24
+#define ACK_WINDOW_OFFSET 20 // Where the advertised window sits in the ACK header
+#define SACK_BLOCK_SIZE 16
+#define MAX_ACK_SIZE (ACK_HEADER_SIZE + MAX_SACK_BLOCKS * SACK_BLOCK_SIZE)
+#define FEC_MIN_BLOCK 2 // The fewest packets a parity packet covers
+#define FEC_MAX_BLOCK 255 // The most - the count has to fit in one byte of the header
+#define FEC_TARGET_LOSSES 0.5 // Blocks are sized so that this many of their packets are expected to be lost
+#define FEC_LOSS_WINDOW 1000 // The loss estimate halves its counts every this many packets, so it follows changes
+#define FEC_BUFFERS 16 // Parity packets that can wait in a send batch at once
+#define COMPRESS_BLOCK 65536 // Bytes of the input compressed into each record
+#define RECORD_HEADER_SIZE 9 // method (1) | raw length (4) | stored length (4), all big endian
+#define RECORD_STORED 0 // Record methods - blocks that don't shrink are stored as they are
+#define RECORD_ZLIB 1
+#define RESUME_KEY_SIZE 8 // A resume handshake's payload is the key the client names the file by
+#define CHECKPOINT_HEADER_SIZE 24 // key (8) | total packets (8) | payload size (4) | streams (4), then each stream's entry
+#define CHECKPOINT_STREAM_SIZE 12 // expected packet (8) | digest of everything before it (4)
+#define CHECKPOINT_INTERVAL 1000000 // A resumable upload's progress is saved at most this often, in microseconds
+
+// Packet Layout
+// You may change this if you want to
+// A file can be split across several streams, each with its own sequence numbers starting from 0.  num_streams
+// and payload_size are only read from handshakes, and a handshake's seqnum is the packet count of the whole file.
+// A parity packet's seqnum is the first packet it covers, and num_streams is how many it covers.  conn_id is
+// picked at random by the client for each upload, and lets one server tell any number of uploads apart.  This is
+// only the in-memory form - on the wire a packet is a packed big endian header (see write_header) followed by
+// exactly length bytes of payload, so length isn't sent
+struct packet
+{
+    unsigned short length;
+    // FLAG_ options for the packet - unknown ones are ignored
+    unsigned char flags;
+    unsigned char stream;
+    unsigned char num_streams;
+    unsigned int conn_id;
+    long long seqnum;
+    // The size of every packet's payload but the last - the file is cut into pieces this big
+    unsigned short payload_size;
+    // The payload lives wherever the packet was read from or received into
+    char *payload;
+};
+
+// ACK Layout
+// The cumulative ACK is followed by up to MAX_SACK_BLOCKS ranges [start, end) of packets the
+// server has buffered out of order.  Only the used blocks are sent over the wire
+struct sack_block
+{
+    long long start;
+    long long end;
+};
+
+struct ack
+{
+    unsigned int conn_id;
+    long long acknum;
+    int stream;
+    // Packets the server has rebuilt from parity since its last ACK, so the client can count them as lost
+    int recovered;
+    // How many packets from acknum on the server has room for
+    long long window;
+    int num_sacks;
+    struct sack_block sacks[MAX_SACK_BLOCKS];
+};
+
+// Utility functions to copy big endian integers to and from unaligned wire buffers
+void put_u16(char *buf, uint16_t value)
+{
+    value = htons(value);
+    memcpy(buf, &value, sizeof(value));
+}
+
+void put_u32(char *buf, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(buf, &value, sizeof(value));
+}
+
+void put_u64(char *buf, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(buf, &value, sizeof(value));
+}
+
+uint16_t get_u16(const char *buf)
+{
+    uint16_t value;
+    memcpy(&value, buf, sizeof(value));
+    return ntohs(value);
+}
+
+uint32_t get_u32(const char *buf)
+{
+    uint32_t value;
+    memcpy(&value, buf, sizeof(value));
+    return ntohl(value);
+}
+
+uint64_t get_u64(const char *buf)
+{
+    uint64_t value;
+    memcpy(&value, buf, sizeof(value));
+    return be64toh(value);
+}
+
+// CRC32C tables for slicing-by-8 - table k gives the CRC of a byte followed by k zero bytes, so 8 bytes are folded
+// in with 8 lookups.  They're built the first time a CRC is needed
+static uint32_t crc32c_tables[8][256];
+static int crc32c_hardware;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        crc32c_tables[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            crc32c_tables[k][i] = (crc32c_tables[k - 1][i] >> 8) ^ crc32c_tables[0][crc32c_tables[k - 1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// SSE4.2's crc32 instruction computes CRC32C directly, 8 bytes at a time.  Only this function is built for SSE4.2,
+// so the programs still run on CPUs without it
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c_slicing(uint32_t crc, const unsigned char *data, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low = le32toh(low) ^ crc;
+        high = le32toh(high);
+        crc = crc32c_tables[7][low & 0xff] ^ crc32c_tables[6][(low >> 8) & 0xff] ^ crc32c_tables[5][(low >> 16) & 0xff] ^
+              crc32c_tables[4][low >> 24] ^ crc32c_tables[3][high & 0xff] ^ crc32c_tables[2][(high >> 8) & 0xff] ^
+              crc32c_tables[1][(high >> 16) & 0xff] ^ crc32c_tables[0][high >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc = crc32c_tables[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Function that extends crc, the CRC32C of everything before data (0 to start), over len more bytes - so a CRC can
+// be built up piece by piece, and crc32c(crc32c(0, a), b) is the CRC of a followed by b
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+    if (crc32c_hardware)
+    {
+        return ~crc32c_sse42(~crc, data, len);
+    }
+#endif
+    return ~crc32c_slicing(~crc, data, len);
+}
+
+// Function that writes a packet header in its wire format and returns its length:
+//   version (1) | flags (1) | stream (1) | num_streams (1) | conn_id (4) | seqnum (8) | crc (4) [| payload_size (2)]
+// Every field is big endian and there's no padding.  payload_size is only sent with FLAG_HANDSHAKE.  crc is the
+// CRC32C of the whole packet but the crc itself, payload included, so the header has to be written last
+int write_header(char *buf, unsigned char flags, int stream, int num_streams, unsigned int conn_id, long long seqnum, int payload_size, const char *payload, int length)
+{
+    int header_size = HEADER_SIZE;
+    buf[0] = PROTOCOL_VERSION;
+    buf[1] = flags;
+    buf[2] = stream;
+    buf[3] = num_streams;
+    put_u32(buf + CONN_ID_OFFSET, conn_id);
+    put_u64(buf + 8, seqnum);
+    if (flags & FLAG_HANDSHAKE)
+    {
+        put_u16(buf + HEADER_SIZE, payload_size);
+        header_size = HANDSHAKE_HEADER_SIZE;
+    }
+    uint32_t crc = crc32c(crc32c(0, buf, CRC_OFFSET), buf + HEADER_SIZE, header_size - HEADER_SIZE);
+    put_u32(buf + CRC_OFFSET, crc32c(crc, payload, length));
+    return header_size;
+}
+
+// Function that parses a datagram of datagram_len bytes into pkt - the payload is whatever follows the header, and
+// pkt points at it in buf.  Returns -1 if the datagram isn't a packet we understand, or was corrupted on the way
+int read_header(char *buf, size_t datagram_len, struct packet *pkt)
+{
+    size_t header_size = HEADER_SIZE;
+    if (datagram_len < HEADER_SIZE || buf[0] != PROTOCOL_VERSION ||
+        get_u32(buf + CRC_OFFSET) != crc32c(crc32c(0, buf, CRC_OFFSET), buf + HEADER_SIZE, datagram_len - HEADER_SIZE))
+    {
+        return -1;
+    }
+    pkt->flags = buf[1];
+    pkt->stream = buf[2];
+    pkt->num_streams = buf[3];
+    pkt->conn_id = get_u32(buf + CONN_ID_OFFSET);
+    pkt->seqnum = get_u64(buf + 8);
+    // Sequence numbers are signed in memory, so anything past the top half of the space is nonsense
+    if (pkt->seqnum < 0)
+    {
+        return -1;
+    }
+    pkt->payload_size = 0;
+    if (pkt->flags & FLAG_HANDSHAKE)
+    {
+        header_size = HANDSHAKE_HEADER_SIZE;
+        if (datagram_len < header_size)
+        {
+            return -1;
+        }
+        pkt->payload_size = get_u16(buf + HEADER_SIZE);
+    }
+    pkt->length = datagram_len - header_size;
+    pkt->payload = buf + header_size;
+    return 0;
+}
+
+// Function that writes an ACK in its wire format and returns its length - only the used SACK blocks are sent:
+//   version (1) | stream (1) | num_sacks (1) | recovered (1) | conn_id (4) | acknum (8) | crc (4) | window (4) | (start (8) | end (8)) * num_sacks
+// crc is the CRC32C of the rest of the ACK
+int write_ack(char *buf, const struct ack *ack)
+{
+    buf[0] = PROTOCOL_VERSION;
+    buf[1] = ack->stream;
+    buf[2] = ack->num_sacks;
+    buf[3] = ack->recovered < 255 ? ack->recovered : 255;
+    put_u32(buf + 4, ack->conn_id);
+    put_u64(buf + 8, ack->acknum);
+    put_u32(buf + ACK_WINDOW_OFFSET, ack->window < UINT_MAX ? ack->window : UINT_MAX);
+    for (int i = 0; i < ack->num_sacks; i++)
+    {
+        put_u64(buf + ACK_HEADER_SIZE + i * SACK_BLOCK_SIZE, ack->sacks[i].start);
+        put_u64(buf + ACK_HEADER_SIZE + i * SACK_BLOCK_SIZE + 8, ack->sacks[i].end);
+    }
+    int len = ACK_HEADER_SIZE + ack->num_sacks * SACK_BLOCK_SIZE;
+    put_u32(buf + CRC_OFFSET, crc32c(crc32c(0, buf, CRC_OFFSET), buf + ACK_WINDOW_OFFSET, len - ACK_WINDOW_OFFSET));
+    return len;
+}
+
+// Function that parses an ACK of len bytes - returns -1 if it isn't an ACK we understand, or was corrupted on the
+// way
+int read_ack(const char *buf, size_t len, struct ack *ack)
+{
+    if (len < ACK_HEADER_SIZE || buf[0] != PROTOCOL_VERSION ||
+        get_u32(buf + CRC_OFFSET) != crc32c(crc32c(0, buf, CRC_OFFSET), buf + ACK_WINDOW_OFFSET, len - ACK_WINDOW_OFFSET))
+    {
+        return -1;
+    }
+
+    ack->stream = (unsigned char)buf[1];
+    ack->num_sacks = (unsigned char)buf[2];
+    ack->recovered = (unsigned char)buf[3];
+    ack->conn_id = get_u32(buf + 4);
+    ack->acknum = get_u64(buf + 8);
+    ack->window = get_u32(buf + ACK_WINDOW_OFFSET);
+    if (ack->num_sacks > MAX_SACK_BLOCKS || len < ACK_HEADER_SIZE + (size_t)ack->num_sacks * SACK_BLOCK_SIZE)
+    {
+        ack->num_sacks = 0;
+    }
+    for (int i = 0; i < ack->num_sacks; i++)
+    {
+        ack->sacks[i].start = get_u64(buf + ACK_HEADER_SIZE + i * SACK_BLOCK_SIZE);
+        ack->sacks[i].end = get_u64(buf + ACK_HEADER_SIZE + i * SACK_BLOCK_SIZE + 8);
+    }
+    return 0;
+}
+
+// Function that works out how many streams a file of num_packets is actually split into when num_streams are
+// asked for - every stream but the last carries the same number of packets, and none of them are empty
+int split_streams(long long num_packets, int num_streams)
+{
+    if (num_packets <= 0 || num_streams <= 1)
+    {
+        return 1;
+    }
+    long long per_stream = (num_packets + num_streams - 1) / num_streams;
+    return (num_packets + per_stream - 1) / per_stream;
+}
+
+// Function that gets the packets of the file a stream carries - both sides split the file the same way, so the
+// handshake only has to carry the file's packet count and the number of streams
+void stream_range(long long num_packets, int num_streams, int stream, long long *first_packet, long long *stream_packets)
+{
+    long long per_stream = num_streams <= 1 ? num_packets : (num_packets + num_streams - 1) / num_streams;
+    *first_packet = stream * per_stream;
+    *stream_packets = stream == num_streams - 1 ? num_packets - *first_packet : per_stream;
+}
+
+// Both programs sleep in epoll on their socket and a timerfd set to their next deadline, so anything that's due
+// is handled as soon as it's due
+struct event_loop
+{
+    int epfd;
+    int timerfd;
+    int sockfd;
+    // A pipe we're streaming from, which is only watched while we're waiting on it - -1 if there isn't one
+    int inputfd;
+    int input_watched;
+    // The deadline the timer is armed for, or -1 when it's disarmed
+    long long armed;
+};
+
+// Everything either program does with the network, the clock or the file on its hot path goes through a
+// transport.  The real one is UDP sockets, epoll, the monotonic clock and plain positional file I/O, io_uring can
+// stand in for the sockets, event loop and file I/O (see uring.h), and the simulator swaps in a virtual network
+// and clock so the same transfer logic runs in one process without any sockets.  Sockets are plain ints throughout
+struct transport_ops
+{
+    const char *name;
+    // A timestamp in microseconds
+    long long (*now)(void);
+    // Like sendmmsg and recvmmsg with MSG_DONTWAIT - recv fails with EAGAIN when there's nothing waiting
+    int (*send)(int sockfd, struct mmsghdr *msgs, unsigned int count);
+    int (*recv)(int sockfd, struct mmsghdr *msgs, unsigned int count);
+    // Setting up and tearing down an event loop on a socket, and sleeping in it - see wait_for_events.  Setting up
+    // and sleeping return -1 with errno set if they fail
+    int (*init_loop)(struct event_loop *loop, int sockfd);
+    void (*free_loop)(struct event_loop *loop);
+    int (*wait)(struct event_loop *loop, long long deadline);
+    // See watch_input
+    int (*watch)(struct event_loop *loop, int fd, int enabled);
+    // Like preadv and pwritev
+    ssize_t (*read_file)(int fd, const struct iovec *iov, int count, off_t offset);
+    ssize_t (*write_file)(int fd, const struct iovec *iov, int count, off_t offset);
+};
+
+long long udp_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int udp_send(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    return sendmmsg(sockfd, msgs, count, 0);
+}
+
+int udp_recv(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    return recvmmsg(sockfd, msgs, count, MSG_DONTWAIT, NULL);
+}
+
+// Utility function to close whatever a loop that couldn't be set up had opened, leaving errno as it was
+void udp_close_loop(struct event_loop *loop)
+{
+    int error = errno;
+    if (loop->timerfd >= 0)
+    {
+        close(loop->timerfd);
+    }
+    if (loop->epfd >= 0)
+    {
+        close(loop->epfd);
+    }
+    errno = error;
+}
+
+int udp_init_loop(struct event_loop *loop, int sockfd)
+{
+    struct epoll_event ev;
+    loop->sockfd = sockfd;
+    loop->inputfd = -1;
+    loop->input_watched = 0;
+    loop->armed = -1;
+    loop->epfd = epoll_create1(0);
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (loop->epfd < 0 || loop->timerfd < 0)
+    {
+        perror("Could not create event loop");
+        udp_close_loop(loop);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        perror("Could not watch socket");
+        udp_close_loop(loop);
+        return -1;
+    }
+    ev.data.fd = loop->timerfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0)
+    {
+        perror("Could not watch timer");
+        udp_close_loop(loop);
+        return -1;
+    }
+    return 0;
+}
+
+void udp_free_loop(struct event_loop *loop)
+{
+    close(loop->timerfd);
+    close(loop->epfd);
+}
+
+// Function that arms the timer for a deadline from get_time_us, or disarms it if the deadline is negative -
+// returns -1 if it can't
+int arm_timer(struct event_loop *loop, long long deadline)
+{
+    struct itimerspec spec;
+    if (deadline == loop->armed)
+    {
+        return 0;
+    }
+    memset(&spec, 0, sizeof(spec));
+    if (deadline >= 0)
+    {
+        // An all zero time would disarm the timer instead
+        if (deadline == 0)
+        {
+            deadline = 1;
+        }
+        spec.it_value.tv_sec = deadline / 1000000;
+        spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    {
+        perror("Error arming timer");
+        return -1;
+    }
+    loop->armed = deadline;
+    return 0;
+}
+
+int udp_wait(struct event_loop *loop, long long deadline)
+{
+    struct epoll_event events[3];
+    uint64_t expirations;
+    int num_events, ready = 0;
+    if (arm_timer(loop, deadline) < 0)
+    {
+        return -1;
+    }
+    do
+    {
+        num_events = epoll_wait(loop->epfd, events, 3, -1);
+    } while (num_events < 0 && errno == EINTR);
+    if (num_events < 0)
+    {
+        perror("Error waiting for events");
+        return -1;
+    }
+    for (int i = 0; i < num_events; i++)
+    {
+        if (events[i].data.fd == loop->sockfd)
+        {
+            ready |= EVENT_SOCKET;
+        }
+        else if (events[i].data.fd == loop->inputfd)
+        {
+            ready |= EVENT_INPUT;
+        }
+        else if (read(loop->timerfd, &expirations, sizeof(expirations)) > 0)
+        {
+            loop->armed = -1;
+            ready |= EVENT_TIMER;
+        }
+    }
+    return ready;
+}
+
+int udp_watch(struct event_loop *loop, int fd, int enabled)
+{
+    struct epoll_event ev;
+    ev.events = enabled ? EPOLLIN : 0;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, loop->inputfd < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        perror("Could not watch input");
+        return -1;
+    }
+    loop->inputfd = fd;
+    loop->input_watched = enabled;
+    return 0;
+}
+
+ssize_t udp_read_file(int fd, const struct iovec *iov, int count, off_t offset)
+{
+    return preadv(fd, iov, count, offset);
+}
+
+ssize_t udp_write_file(int fd, const struct iovec *iov, int count, off_t offset)
+{
+    return pwritev(fd, iov, count, offset);
+}
+
+const struct transport_ops udp_transport = {
+    "udp", udp_now, udp_send, udp_recv, udp_init_loop, udp_free_loop, udp_wait, udp_watch, udp_read_file, udp_write_file};
+
+// The transport in use - only ever changed before anything starts
+const struct transport_ops *transport = &udp_transport;
+
+// Utility function to get a timestamp in microseconds - monotonic, or virtual under the simulator
+long long get_time_us()
+{
+    return transport->now();
+}
+
+// Utility functions to send or receive a batch of datagrams without blocking, and to send a single message -
+// return how many were sent or received (the bytes sent for send_message), or -1 with errno set
+int send_datagrams(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    return transport->send(sockfd, msgs, count);
+}
+
+int recv_datagrams(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+    return transport->recv(sockfd, msgs, count);
+}
+
+int send_message(int sockfd, struct msghdr *msg)
+{
+    struct mmsghdr mmsg;
+    mmsg.msg_hdr = *msg;
+    mmsg.msg_len = 0;
+    if (transport->send(sockfd, &mmsg, 1) < 0)
+    {
+        return -1;
+    }
+    return mmsg.msg_len;
+}
+
+// Function that sets up an event loop on a socket - returns -1 if it can't be
+int init_event_loop(struct event_loop *loop, int sockfd)
+{
+    return transport->init_loop(loop, sockfd);
+}
+
+// Function that starts or stops waking up when the input has more to read - the input is added the first time.
+// Returns -1 if it can't be watched
+int watch_input(struct event_loop *loop, int fd, int enabled)
+{
+    return transport->watch(loop, fd, enabled);
+}
+
+// Utility functions to read or write runs of packets at an offset in a file with one call - return the bytes read
+// (short only at the end of the file), or -1 with errno set.  A write that's cut short carries on from where it
+// stopped, so the whole run is always written
+ssize_t read_file_at(int fd, const struct iovec *iov, int count, off_t offset)
+{
+    return transport->read_file(fd, iov, count, offset);
+}
+
+ssize_t write_file_at(int fd, struct iovec *iov, int count, off_t offset)
+{
+    ssize_t total = 0;
+    while (count > 0 && iov[count - 1].iov_len == 0)
+    {
+        count--;
+    }
+    while (count > 0)
+    {
+        ssize_t written = transport->write_file(fd, iov, count, offset + total);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        total += written;
+        // Skipping whatever was written in full, and the part of the iovec it stopped in
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+void free_event_loop(struct event_loop *loop)
+{
+    transport->free_loop(loop);
+}
+
+// Function that blocks until the socket is readable or the deadline passes (forever if it's negative) - returns
+// EVENT_SOCKET, EVENT_TIMER and/or EVENT_INPUT for whichever happened, or -1 with errno set if it can't wait
+int wait_for_events(struct event_loop *loop, long long deadline)
+{
+    return transport->wait(loop, deadline);
+}
+
+// Utility function to print a packet
+void printRecv(struct packet *pkt)
+{
+    printf("RECV %lld LENGTH %d\n", pkt->seqnum, pkt->length);
+}
+
+void printSend(struct packet *pkt, int resend)
+{
+    if (resend)
+        printf("RESEND %lld LENGTH %d\n", pkt->seqnum, pkt->length);
+    else
+        printf("SEND %lld LENGTH %d\n", pkt->seqnum, pkt->length);
+}
+
+void printPacket(struct packet *pkt)
+{
+    printf("%s\n", pkt->payload);
+}
+
 #endif
\ No newline at end of file
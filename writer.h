@@ -0,0 +1,313 @@
+#ifndef WRITER_H
+#define WRITER_H
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// MACROS
+#define WRITE_QUEUE_SIZE 4096 // Writes the queue holds - a power of two, so positions wrap with a mask
+#define WRITE_CHUNK 256 // The most writes the writer takes off the queue before handing their slots back
+#define WRITE_RUNS 16 // Runs the writer builds up at once - one for each stream whose packets are in the chunk
+
+// One packet for the writer thread to write out.  Its payload stays in its slot of the receive window, which isn't
+// reused until written says the writer is done with it
+struct write_request
+{
+    int fd;
+    unsigned short length;
+    off_t offset;
+    const char *payload;
+    long long seqnum;
+    // Set to one past seqnum once the packet is in the file
+    _Atomic long long *written;
+};
+
+// Packets that sit one after the other in the same file, written with one call
+struct write_run
+{
+    int fd;
+    off_t offset;
+    off_t end;
+    int num;
+    struct iovec iov[FILE_BATCH];
+};
+
+// A thread that writes a worker's packets to their files, so a disk that stalls holds up the writes rather than the
+// socket.  The worker is the only producer and the writer the only consumer of the queue, so neither ever takes a
+// lock.  Each of them sleeps on an eventfd when it has nothing to do, which the other only writes to once it's said
+// that it's sleeping.  Whichever of them first hits an error it can't get past records it in error, after which the
+// writer stops writing and neither waits for the other any more
+struct disk_writer
+{
+    struct write_request *requests;
+    _Atomic unsigned long long head;
+    // On a cache line of its own, so the two threads don't fight over the line holding head
+    _Alignas(64) _Atomic unsigned long long tail;
+    _Atomic int sleeping;
+    int wake_fd;
+    // Set by the worker while it's waiting for the writer to make room, in the queue or in a window
+    _Atomic int worker_waiting;
+    int worker_fd;
+    _Atomic int stop;
+    _Atomic int error;
+    pthread_t thread;
+};
+
+// Function that queues a packet's write - returns -1 if the queue is full, in which case the packet has to wait.
+// The writer isn't woken up here, see kick_writer
+int push_write(struct disk_writer *writer, int fd, off_t offset, const char *payload, unsigned short length, long long seqnum, _Atomic long long *written)
+{
+    unsigned long long head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&writer->tail, memory_order_acquire) >= WRITE_QUEUE_SIZE)
+    {
+        return -1;
+    }
+    struct write_request *req = &writer->requests[head & (WRITE_QUEUE_SIZE - 1)];
+    req->fd = fd;
+    req->offset = offset;
+    req->payload = payload;
+    req->length = length;
+    req->seqnum = seqnum;
+    req->written = written;
+    // Publishing the request only once it's been filled in.  Sequentially consistent, since kick_writer's check of
+    // sleeping mustn't be seen to happen before it
+    atomic_store(&writer->head, head + 1);
+    return 0;
+}
+
+// Utility functions to check whether the queue has room for another write, and whether the writer has caught up
+// with everything queued so far
+int writer_full(struct disk_writer *writer)
+{
+    return atomic_load(&writer->head) - atomic_load(&writer->tail) >= WRITE_QUEUE_SIZE;
+}
+
+int writer_idle(struct disk_writer *writer)
+{
+    return atomic_load(&writer->tail) == atomic_load(&writer->head);
+}
+
+// Function that records why the writer can't carry on, keeping the first error, and wakes the worker to see it
+void fail_writer(struct disk_writer *writer, int error)
+{
+    uint64_t one = 1;
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&writer->error, &expected, error != 0 ? error : EIO))
+    {
+        // Nothing more can be done if even this fails - the worker sees the error the next time it looks
+        if (write(writer->worker_fd, &one, sizeof(one)) < 0)
+        {
+            perror("Error waking worker");
+        }
+    }
+}
+
+// Utility function to make one of the writer's eventfds readable
+void signal_eventfd(struct disk_writer *writer, int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+    {
+        perror("Error waking thread");
+        fail_writer(writer, errno);
+    }
+}
+
+// Function that wakes the writer if it went to sleep - called once the worker has queued a batch's writes rather
+// than for every write.  The writer says it's sleeping before it looks at head one last time, so either it sees the
+// new writes or we see that it's asleep
+void kick_writer(struct disk_writer *writer)
+{
+    if (atomic_load(&writer->sleeping) && atomic_exchange(&writer->sleeping, 0))
+    {
+        signal_eventfd(writer, writer->wake_fd);
+    }
+}
+
+// Function that takes whatever wakeups the writer has sent the worker, so its eventfd stops being readable
+void drain_wakeups(struct disk_writer *writer)
+{
+    uint64_t count;
+    if (read(writer->worker_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("Error reading writer wakeups");
+        fail_writer(writer, errno);
+    }
+}
+
+// Function that blocks the worker until the writer has written everything before packet end of a window, or has
+// failed - the worker says it's waiting before checking one last time, the other way round from the writer
+void wait_for_writes(struct disk_writer *writer, _Atomic long long *written, long long end)
+{
+    struct pollfd pfd = {writer->worker_fd, POLLIN, 0};
+    // The writes may not have been handed over yet
+    kick_writer(writer);
+    while (atomic_load(written) < end && !atomic_load(&writer->error))
+    {
+        atomic_store(&writer->worker_waiting, 1);
+        if (atomic_load(written) < end && !atomic_load(&writer->error) && poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            perror("Error waiting for writes");
+            fail_writer(writer, errno);
+        }
+        drain_wakeups(writer);
+    }
+}
+
+// Function that writes out a run, unless an earlier write has already failed
+void write_run(struct disk_writer *writer, struct write_run *run)
+{
+    if (!atomic_load(&writer->error) && write_file_at(run->fd, run->iov, run->num, run->offset) < 0)
+    {
+        perror("Error writing to file");
+        fail_writer(writer, errno);
+    }
+}
+
+// Function that runs the writer thread.  The streams' packets are queued mixed together, in the order they were
+// saved, so each chunk taken off the queue is sorted into a run for each stream.  Once a write has failed the rest
+// are only taken off the queue, until the worker stops the writer
+void *run_writer(void *arg)
+{
+    struct disk_writer *writer = arg;
+    struct write_run runs[WRITE_RUNS];
+    int num_runs;
+    uint64_t count;
+    while (1)
+    {
+        unsigned long long tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+        unsigned long long head = atomic_load_explicit(&writer->head, memory_order_acquire);
+        if (tail == head)
+        {
+            if (atomic_load(&writer->stop))
+            {
+                break;
+            }
+            atomic_store(&writer->sleeping, 1);
+            if (atomic_load(&writer->head) == tail && !atomic_load(&writer->stop) && read(writer->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            {
+                perror("Error waiting for writes");
+                fail_writer(writer, errno);
+                break;
+            }
+            atomic_store(&writer->sleeping, 0);
+            continue;
+        }
+        unsigned long long end = head - tail > WRITE_CHUNK ? tail + WRITE_CHUNK : head;
+        num_runs = 0;
+        for (unsigned long long i = tail; i < end; i++)
+        {
+            struct write_request *req = &writer->requests[i & (WRITE_QUEUE_SIZE - 1)];
+            struct write_run *run = NULL;
+            for (int r = 0; r < num_runs && run == NULL; r++)
+            {
+                if (runs[r].fd == req->fd && runs[r].end == req->offset)
+                {
+                    run = &runs[r];
+                }
+            }
+            if (run == NULL)
+            {
+                // Too many streams at once - the runs so far are written out to make room
+                if (num_runs == WRITE_RUNS)
+                {
+                    for (int r = 0; r < num_runs; r++)
+                    {
+                        write_run(writer, &runs[r]);
+                    }
+                    num_runs = 0;
+                }
+                run = &runs[num_runs++];
+                run->fd = req->fd;
+                run->offset = req->offset;
+                run->end = req->offset;
+                run->num = 0;
+            }
+            run->iov[run->num].iov_base = (void *)req->payload;
+            run->iov[run->num].iov_len = req->length;
+            run->end += req->length;
+            // A full run goes out straight away, and the stream's next packet starts a new one
+            if (++run->num == FILE_BATCH)
+            {
+                write_run(writer, run);
+                *run = runs[--num_runs];
+            }
+        }
+        for (int r = 0; r < num_runs; r++)
+        {
+            write_run(writer, &runs[r]);
+        }
+        // Handing the slots back to the worker.  Sequentially consistent, like the worker's stores to
+        // worker_waiting, so a worker that starts waiting just as we finish is always woken up
+        for (unsigned long long i = tail; i < end; i++)
+        {
+            struct write_request *req = &writer->requests[i & (WRITE_QUEUE_SIZE - 1)];
+            atomic_store(req->written, req->seqnum + 1);
+        }
+        atomic_store(&writer->tail, end);
+        if (atomic_exchange(&writer->worker_waiting, 0))
+        {
+            signal_eventfd(writer, writer->worker_fd);
+        }
+    }
+    return NULL;
+}
+
+// Utility function to free whatever of a writer was set up, leaving errno as it was
+void free_writer(struct disk_writer *writer)
+{
+    int saved = errno;
+    if (writer->wake_fd >= 0)
+    {
+        close(writer->wake_fd);
+    }
+    if (writer->worker_fd >= 0)
+    {
+        close(writer->worker_fd);
+    }
+    free(writer->requests);
+    errno = saved;
+}
+
+// Function that starts a worker's writer thread - returns -1, saying why, if it can't be
+int start_writer(struct disk_writer *writer)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->requests = malloc(WRITE_QUEUE_SIZE * sizeof(struct write_request));
+    writer->wake_fd = eventfd(0, 0);
+    writer->worker_fd = eventfd(0, EFD_NONBLOCK);
+    if (writer->requests == NULL || writer->wake_fd < 0 || writer->worker_fd < 0)
+    {
+        perror("Could not set up the disk writer");
+        free_writer(writer);
+        return -1;
+    }
+    int result = pthread_create(&writer->thread, NULL, run_writer, writer);
+    if (result != 0)
+    {
+        printf("Could not start the disk writer\n");
+        free_writer(writer);
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+// Function that stops the writer once it's written everything queued
+void stop_writer(struct disk_writer *writer)
+{
+    atomic_store(&writer->stop, 1);
+    signal_eventfd(writer, writer->wake_fd);
+    pthread_join(writer->thread, NULL);
+    free_writer(writer);
+}
+
+#endif